@@ -52,10 +52,9 @@ static void _picohash_md5_final(_picohash_md5_ctx_t *ctx, void *digest);
 #define PICOHASH_SHA1_DIGEST_LENGTH 20
 
 typedef struct {
-   uint32_t buffer[PICOHASH_SHA1_BLOCK_LENGTH / 4];
    uint32_t state[PICOHASH_SHA1_DIGEST_LENGTH / 4];
    uint64_t byteCount;
-   uint8_t bufferOffset;
+   uint8_t buffer[PICOHASH_SHA1_BLOCK_LENGTH];
 } _picohash_sha1_ctx_t;
 
 static void _picohash_sha1_init(_picohash_sha1_ctx_t *ctx);
@@ -111,6 +110,19 @@ static void picohash_reset(picohash_ctx_t *ctx);
 
 static void picohash_init_hmac(picohash_ctx_t *ctx, void (*initf)(picohash_ctx_t *), const void *key, size_t key_len);
 
+/*
+* The SHA-1 and SHA-256 block functions used by the update/final functions
+* can be replaced (e.g. by a hardware accelerated implementation) by defining
+* these before including this header. They are called as f(state, block),
+* where block points to 64 bytes of input.
+*/
+#ifndef PICOHASH_SHA1_COMPRESS
+#define PICOHASH_SHA1_COMPRESS _picohash_sha1_compress
+#endif
+#ifndef PICOHASH_SHA256_COMPRESS
+#define PICOHASH_SHA256_COMPRESS _picohash_sha256_compress
+#endif
+
 /* following are private definitions */
 
 /*
@@ -368,20 +380,124 @@ static inline uint32_t _picohash_sha1_rol32(uint32_t number, uint8_t bits)
    return ((number << bits) | (number >> (32 - bits)));
 }
 
-static inline void _picohash_sha1_hash_block(_picohash_sha1_ctx_t *s)
+static inline uint32_t _picohash_load_be32(const uint8_t *p)
+{
+   return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline void _picohash_store_be32(uint8_t *p, uint32_t v)
+{
+   p[0] = (uint8_t)(v >> 24);
+   p[1] = (uint8_t)(v >> 16);
+   p[2] = (uint8_t)(v >> 8);
+   p[3] = (uint8_t)v;
+}
+
+static inline void _picohash_store_be64(uint8_t *p, uint64_t v)
+{
+   _picohash_store_be32(p, (uint32_t)(v >> 32));
+   _picohash_store_be32(p + 4, (uint32_t)v);
+}
+
+/*
+* The SHA-1 round functions for the four groups of 20 rounds each.
+* The message schedule is kept in a 16-word ring buffer and expanded in place.
+*/
+#define _PICOHASH_SHA1_BLK(i) (w[(i)&15] = _picohash_sha1_rol32(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i)&15], 1))
+#define _PICOHASH_SHA1_R0(v, w_, x, y, z, i)                                                                                       \
+   z += ((w_ & (x ^ y)) ^ y) + w[i] + _PICOHASH_SHA1_K0 + _picohash_sha1_rol32(v, 5);                                            \
+   w_ = _picohash_sha1_rol32(w_, 30);
+#define _PICOHASH_SHA1_R1(v, w_, x, y, z, i)                                                                                       \
+   z += ((w_ & (x ^ y)) ^ y) + _PICOHASH_SHA1_BLK(i) + _PICOHASH_SHA1_K0 + _picohash_sha1_rol32(v, 5);                           \
+   w_ = _picohash_sha1_rol32(w_, 30);
+#define _PICOHASH_SHA1_R2(v, w_, x, y, z, i)                                                                                       \
+   z += (w_ ^ x ^ y) + _PICOHASH_SHA1_BLK(i) + _PICOHASH_SHA1_K20 + _picohash_sha1_rol32(v, 5);                                  \
+   w_ = _picohash_sha1_rol32(w_, 30);
+#define _PICOHASH_SHA1_R3(v, w_, x, y, z, i)                                                                                       \
+   z += (((w_ | x) & y) | (w_ & x)) + _PICOHASH_SHA1_BLK(i) + _PICOHASH_SHA1_K40 + _picohash_sha1_rol32(v, 5);                   \
+   w_ = _picohash_sha1_rol32(w_, 30);
+#define _PICOHASH_SHA1_R4(v, w_, x, y, z, i)                                                                                       \
+   z += (w_ ^ x ^ y) + _PICOHASH_SHA1_BLK(i) + _PICOHASH_SHA1_K60 + _picohash_sha1_rol32(v, 5);                                  \
+   w_ = _picohash_sha1_rol32(w_, 30);
+
+/* Five consecutive rounds, after which the working variables are back in their original roles. */
+#define _PICOHASH_SHA1_R5(R, i)                                                                                                    \
+   R(a, b, c, d, e, (i))                                                                                                          \
+   R(e, a, b, c, d, (i) + 1)                                                                                                      \
+   R(d, e, a, b, c, (i) + 2)                                                                                                      \
+   R(c, d, e, a, b, (i) + 3)                                                                                                      \
+   R(b, c, d, e, a, (i) + 4)
+
+/*
+* Hashes one 64-byte block straight from the input: the message words
+* are loaded as big-endian 32-bit words, no alignment requirements.
+*/
+#ifndef PICOHASH_COMPACT
+
+static inline void _picohash_sha1_compress(uint32_t *state, const uint8_t *block)
+{
+   uint32_t a, b, c, d, e, w[16];
+   int i;
+
+   for (i = 0; i < 16; i++)
+       w[i] = _picohash_load_be32(block + 4 * i);
+
+   a = state[0];
+   b = state[1];
+   c = state[2];
+   d = state[3];
+   e = state[4];
+
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R0, 0)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R0, 5)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R0, 10)
+   _PICOHASH_SHA1_R0(a, b, c, d, e, 15)
+   _PICOHASH_SHA1_R1(e, a, b, c, d, 16)
+   _PICOHASH_SHA1_R1(d, e, a, b, c, 17)
+   _PICOHASH_SHA1_R1(c, d, e, a, b, 18)
+   _PICOHASH_SHA1_R1(b, c, d, e, a, 19)
+
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R2, 20)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R2, 25)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R2, 30)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R2, 35)
+
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R3, 40)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R3, 45)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R3, 50)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R3, 55)
+
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R4, 60)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R4, 65)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R4, 70)
+   _PICOHASH_SHA1_R5(_PICOHASH_SHA1_R4, 75)
+
+   state[0] += a;
+   state[1] += b;
+   state[2] += c;
+   state[3] += d;
+   state[4] += e;
+}
+
+#else /* PICOHASH_COMPACT: one rolled loop, smaller code */
+
+static inline void _picohash_sha1_compress(uint32_t *state, const uint8_t *block)
 {
    uint8_t i;
-   uint32_t a, b, c, d, e, t;
+   uint32_t a, b, c, d, e, t, w[16];
+
+   for (i = 0; i < 16; i++)
+       w[i] = _picohash_load_be32(block + 4 * i);
 
-   a = s->state[0];
-   b = s->state[1];
-   c = s->state[2];
-   d = s->state[3];
-   e = s->state[4];
+   a = state[0];
+   b = state[1];
+   c = state[2];
+   d = state[3];
+   e = state[4];
    for (i = 0; i < 80; i++) {
        if (i >= 16) {
-           t = s->buffer[(i + 13) & 15] ^ s->buffer[(i + 8) & 15] ^ s->buffer[(i + 2) & 15] ^ s->buffer[i & 15];
-           s->buffer[i & 15] = _picohash_sha1_rol32(t, 1);
+           t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+           w[i & 15] = _picohash_sha1_rol32(t, 1);
        }
        if (i < 20) {
            t = (d ^ (b & (c ^ d))) + _PICOHASH_SHA1_K0;
@@ -392,34 +508,21 @@ static inline void _picohash_sha1_hash_block(_picohash_sha1_ctx_t *s)
        } else {
            t = (b ^ c ^ d) + _PICOHASH_SHA1_K60;
        }
-       t += _picohash_sha1_rol32(a, 5) + e + s->buffer[i & 15];
+       t += _picohash_sha1_rol32(a, 5) + e + w[i & 15];
        e = d;
        d = c;
        c = _picohash_sha1_rol32(b, 30);
        b = a;
        a = t;
    }
-   s->state[0] += a;
-   s->state[1] += b;
-   s->state[2] += c;
-   s->state[3] += d;
-   s->state[4] += e;
+   state[0] += a;
+   state[1] += b;
+   state[2] += c;
+   state[3] += d;
+   state[4] += e;
 }
 
-static inline void _picohash_sha1_add_uncounted(_picohash_sha1_ctx_t *s, uint8_t data)
-{
-   uint8_t *const b = (uint8_t *)s->buffer;
-#ifdef _PICOHASH_BIG_ENDIAN
-   b[s->bufferOffset] = data;
-#else
-   b[s->bufferOffset ^ 3] = data;
 #endif
-   s->bufferOffset++;
-   if (s->bufferOffset == PICOHASH_SHA1_BLOCK_LENGTH) {
-       _picohash_sha1_hash_block(s);
-       s->bufferOffset = 0;
-   }
-}
 
 inline void _picohash_sha1_init(_picohash_sha1_ctx_t *s)
 {
@@ -429,46 +532,59 @@ inline void _picohash_sha1_init(_picohash_sha1_ctx_t *s)
    s->state[3] = 0x10325476;
    s->state[4] = 0xc3d2e1f0;
    s->byteCount = 0;
-   s->bufferOffset = 0;
 }
 
 inline void _picohash_sha1_update(_picohash_sha1_ctx_t *s, const void *_data, size_t len)
 {
    const uint8_t *data = _data;
-   for (; len != 0; --len) {
-       ++s->byteCount;
-       _picohash_sha1_add_uncounted(s, *data++);
+   size_t used = (size_t)(s->byteCount & (PICOHASH_SHA1_BLOCK_LENGTH - 1));
+
+   s->byteCount += len;
+
+   /* Top up a partially filled buffer first */
+   if (used != 0) {
+       size_t space = PICOHASH_SHA1_BLOCK_LENGTH - used;
+       if (len < space) {
+           memcpy(s->buffer + used, data, len);
+           return;
+       }
+       memcpy(s->buffer + used, data, space);
+       PICOHASH_SHA1_COMPRESS(s->state, s->buffer);
+       data += space;
+       len -= space;
+   }
+
+   /* Whole blocks are hashed directly from the input */
+   for (; len >= PICOHASH_SHA1_BLOCK_LENGTH; len -= PICOHASH_SHA1_BLOCK_LENGTH) {
+       PICOHASH_SHA1_COMPRESS(s->state, data);
+       data += PICOHASH_SHA1_BLOCK_LENGTH;
    }
+
+   if (len != 0)
+       memcpy(s->buffer, data, len);
 }
 
 inline void _picohash_sha1_final(_picohash_sha1_ctx_t *s, void *digest)
 {
-   // Pad with 0x80 followed by 0x00 until the end of the block
-   _picohash_sha1_add_uncounted(s, 0x80);
-   while (s->bufferOffset != 56)
-       _picohash_sha1_add_uncounted(s, 0x00);
-
-   // Append length in the last 8 bytes
-   _picohash_sha1_add_uncounted(s, s->byteCount >> 53); // Shifting to multiply by 8
-   _picohash_sha1_add_uncounted(s, s->byteCount >> 45); // as SHA-1 supports bitstreams as well as
-   _picohash_sha1_add_uncounted(s, s->byteCount >> 37); // byte.
-   _picohash_sha1_add_uncounted(s, s->byteCount >> 29);
-   _picohash_sha1_add_uncounted(s, s->byteCount >> 21);
-   _picohash_sha1_add_uncounted(s, s->byteCount >> 13);
-   _picohash_sha1_add_uncounted(s, s->byteCount >> 5);
-   _picohash_sha1_add_uncounted(s, s->byteCount << 3);
-
-#ifndef SHA_BIG_ENDIAN
-   { // Swap byte order back
-       int i;
-       for (i = 0; i < 5; i++) {
-           s->state[i] = (((s->state[i]) << 24) & 0xff000000) | (((s->state[i]) << 8) & 0x00ff0000) |
-                         (((s->state[i]) >> 8) & 0x0000ff00) | (((s->state[i]) >> 24) & 0x000000ff);
-       }
+   size_t used = (size_t)(s->byteCount & (PICOHASH_SHA1_BLOCK_LENGTH - 1));
+   uint8_t *out = digest;
+   int i;
+
+   /* Pad with 0x80 followed by 0x00 until the end of the block */
+   s->buffer[used++] = 0x80;
+   if (used > PICOHASH_SHA1_BLOCK_LENGTH - 8) {
+       memset(s->buffer + used, 0, PICOHASH_SHA1_BLOCK_LENGTH - used);
+       PICOHASH_SHA1_COMPRESS(s->state, s->buffer);
+       used = 0;
    }
-#endif
+   memset(s->buffer + used, 0, PICOHASH_SHA1_BLOCK_LENGTH - 8 - used);
+
+   /* Append the length in bits in the last 8 bytes */
+   _picohash_store_be64(s->buffer + PICOHASH_SHA1_BLOCK_LENGTH - 8, s->byteCount << 3);
+   PICOHASH_SHA1_COMPRESS(s->state, s->buffer);
 
-   memcpy(digest, s->state, sizeof(s->state));
+   for (i = 0; i < 5; i++)
+       _picohash_store_be32(out + 4 * i, s->state[i]);
 }
 
 #define _picohash_sha256_ch(x, y, z) (z ^ (x & (y ^ z)))
@@ -486,28 +602,100 @@ inline void _picohash_sha1_final(_picohash_sha1_ctx_t *s, void *digest)
    d += t0;                                                                                                                       \
    h = t0 + t1;
 
-static inline void _picohash_sha256_compress(_picohash_sha256_ctx_t *ctx, unsigned char *buf)
-{
-   static const uint32_t K[64] = {
-       0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
-       0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
-       0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
-       0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
-       0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
-       0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
-       0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
-       0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL};
+static const uint32_t _picohash_sha256_K[64] = {
+   0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+   0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+   0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+   0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+   0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+   0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+   0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+   0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL};
+
+/* One step of the message schedule expansion. */
+#define _PICOHASH_SHA256_SCHED(i) W[i] = _picohash_sha256_gamma1(W[(i)-2]) + W[(i)-7] + _picohash_sha256_gamma0(W[(i)-15]) + W[(i)-16];
+#define _PICOHASH_SHA256_SCHED8(i)                                                                                                 \
+   _PICOHASH_SHA256_SCHED(i)                                                                                                      \
+   _PICOHASH_SHA256_SCHED((i) + 1)                                                                                                \
+   _PICOHASH_SHA256_SCHED((i) + 2)                                                                                                \
+   _PICOHASH_SHA256_SCHED((i) + 3)                                                                                                \
+   _PICOHASH_SHA256_SCHED((i) + 4)                                                                                                \
+   _PICOHASH_SHA256_SCHED((i) + 5)                                                                                                \
+   _PICOHASH_SHA256_SCHED((i) + 6)                                                                                                \
+   _PICOHASH_SHA256_SCHED((i) + 7)
+
+/* Eight consecutive rounds, after which the working variables are back in their original roles. */
+#define _PICOHASH_SHA256_RND8(i)                                                                                                   \
+   _picohash_sha256_rnd(a, b, c, d, e, f, g, h, (i))                                                                              \
+   _picohash_sha256_rnd(h, a, b, c, d, e, f, g, (i) + 1)                                                                          \
+   _picohash_sha256_rnd(g, h, a, b, c, d, e, f, (i) + 2)                                                                          \
+   _picohash_sha256_rnd(f, g, h, a, b, c, d, e, (i) + 3)                                                                          \
+   _picohash_sha256_rnd(e, f, g, h, a, b, c, d, (i) + 4)                                                                          \
+   _picohash_sha256_rnd(d, e, f, g, h, a, b, c, (i) + 5)                                                                          \
+   _picohash_sha256_rnd(c, d, e, f, g, h, a, b, (i) + 6)                                                                          \
+   _picohash_sha256_rnd(b, c, d, e, f, g, h, a, (i) + 7)
+
+#ifndef PICOHASH_COMPACT
+
+static inline void _picohash_sha256_compress(uint32_t *state, const unsigned char *buf)
+{
+   const uint32_t *K = _picohash_sha256_K;
+   uint32_t a, b, c, d, e, f, g, h, W[64], t0, t1;
+   int i;
+
+   for (i = 0; i < 16; i++)
+       W[i] = _picohash_load_be32(buf + 4 * i);
+
+   _PICOHASH_SHA256_SCHED8(16)
+   _PICOHASH_SHA256_SCHED8(24)
+   _PICOHASH_SHA256_SCHED8(32)
+   _PICOHASH_SHA256_SCHED8(40)
+   _PICOHASH_SHA256_SCHED8(48)
+   _PICOHASH_SHA256_SCHED8(56)
+
+   a = state[0];
+   b = state[1];
+   c = state[2];
+   d = state[3];
+   e = state[4];
+   f = state[5];
+   g = state[6];
+   h = state[7];
+
+   _PICOHASH_SHA256_RND8(0)
+   _PICOHASH_SHA256_RND8(8)
+   _PICOHASH_SHA256_RND8(16)
+   _PICOHASH_SHA256_RND8(24)
+   _PICOHASH_SHA256_RND8(32)
+   _PICOHASH_SHA256_RND8(40)
+   _PICOHASH_SHA256_RND8(48)
+   _PICOHASH_SHA256_RND8(56)
+
+   state[0] += a;
+   state[1] += b;
+   state[2] += c;
+   state[3] += d;
+   state[4] += e;
+   state[5] += f;
+   state[6] += g;
+   state[7] += h;
+}
+
+#else /* PICOHASH_COMPACT: rolled loops, smaller code */
+
+static inline void _picohash_sha256_compress(uint32_t *state, const unsigned char *buf)
+{
+   const uint32_t *K = _picohash_sha256_K;
    uint32_t S[8], W[64], t, t0, t1;
    int i;
 
    /* copy state into S */
    for (i = 0; i < 8; i++)
-       S[i] = ctx->state[i];
+       S[i] = state[i];
 
    /* copy the state into 512-bits into W[0..15] */
    for (i = 0; i < 16; i++)
-       W[i] =
-           (uint32_t)buf[4 * i] << 24 | (uint32_t)buf[4 * i + 1] << 16 | (uint32_t)buf[4 * i + 2] << 8 | (uint32_t)buf[4 * i + 3];
+       W[i] = _picohash_load_be32(buf + 4 * i);
 
    /* fill W[16..63] */
    for (i = 16; i < 64; i++)
@@ -529,9 +717,11 @@ static inline void _picohash_sha256_compress(_picohash_sha256_ctx_t *ctx, unsign
 
    /* feedback */
    for (i = 0; i < 8; i++)
-       ctx->state[i] = ctx->state[i] + S[i];
+       state[i] = state[i] + S[i];
 }
 
+#endif
+
 static inline void _picohash_sha256_do_final(_picohash_sha256_ctx_t *ctx, void *digest, size_t len)
 {
    unsigned char *out = digest;
@@ -551,7 +741,7 @@ static inline void _picohash_sha256_do_final(_picohash_sha256_ctx_t *ctx, void *
        while (ctx->curlen < 64) {
            ctx->buf[ctx->curlen++] = (unsigned char)0;
        }
-       _picohash_sha256_compress(ctx, ctx->buf);
+       PICOHASH_SHA256_COMPRESS(ctx->state, ctx->buf);
        ctx->curlen = 0;
    }
 
@@ -563,7 +753,7 @@ static inline void _picohash_sha256_do_final(_picohash_sha256_ctx_t *ctx, void *
    /* store length */
    for (i = 0; i != 8; ++i)
        ctx->buf[56 + i] = ctx->length >> (56 - 8 * i);
-   _picohash_sha256_compress(ctx, ctx->buf);
+   PICOHASH_SHA256_COMPRESS(ctx->state, ctx->buf);
 
    /* copy output */
    for (i = 0; i != len / 4; ++i) {
@@ -595,7 +785,7 @@ inline void _picohash_sha256_update(_picohash_sha256_ctx_t *ctx, const void *dat
 
    while (len > 0) {
        if (ctx->curlen == 0 && len >= PICOHASH_SHA256_BLOCK_LENGTH) {
-           _picohash_sha256_compress(ctx, (unsigned char *)in);
+           PICOHASH_SHA256_COMPRESS(ctx->state, in);
            ctx->length += PICOHASH_SHA256_BLOCK_LENGTH * 8;
            in += PICOHASH_SHA256_BLOCK_LENGTH;
            len -= PICOHASH_SHA256_BLOCK_LENGTH;
@@ -608,7 +798,7 @@ inline void _picohash_sha256_update(_picohash_sha256_ctx_t *ctx, const void *dat
            in += n;
            len -= n;
            if (ctx->curlen == 64) {
-               _picohash_sha256_compress(ctx, ctx->buf);
+               PICOHASH_SHA256_COMPRESS(ctx->state, ctx->buf);
                ctx->length += 8 * PICOHASH_SHA256_BLOCK_LENGTH;
                ctx->curlen = 0;
            }
@@ -735,7 +925,7 @@ inline void picohash_init_hmac(picohash_ctx_t *ctx, void (*initf)(picohash_ctx_t
        /* hash the key if it is too long */
        picohash_update(ctx, key, key_len);
        picohash_final(ctx, ctx->_hmac.key);
-       ctx->_hmac.hash_reset(ctx);
+       picohash_reset(ctx);
    } else {
        memcpy(ctx->_hmac.key, key, key_len);
    }
@@ -19,7 +19,19 @@
 #include <string.h>
 
 #include "tfac.h"
+#include "tfac_cpu.h"
+#include "tfac_replay.h"
+#include "tfac_wal.h"
+#include "tfac_key_cache.h"
 #include "base32.h"
+
+// Route picohash's SHA-1/SHA-256 block functions through the (possibly hardware accelerated) backends selected below.
+static void tfac_sha1_compress(uint32_t* state, const uint8_t* block);
+static void tfac_sha256_compress(uint32_t* state, const uint8_t* block);
+
+#define PICOHASH_SHA1_COMPRESS tfac_sha1_compress
+#define PICOHASH_SHA256_COMPRESS tfac_sha256_compress
+
 #include "picohash.h"
 
 #ifdef _WIN32
@@ -27,167 +39,2560 @@
 #include <windows.h>
 #undef WIN32_NO_STATUS
 #include <bcrypt.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #endif
 
 #define TFAC_MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define TFAC_MAX(x, y) (((x) > (y)) ? (x) : (y))
 
+// SHA-1, SHA-224 and SHA-256 all share the same 64-byte block size.
+#define TFAC_HASH_BLOCK_LENGTH 64
+
+// Up to this many leftover lanes, a partially filled multi-buffer batch is slower than computing them one by one.
+#ifndef TFAC_SHA1_X8_MIN_LANES
+#define TFAC_SHA1_X8_MIN_LANES 2
+#endif
+
+#ifndef TFAC_SHA256_X16_MIN_LANES
+#define TFAC_SHA256_X16_MIN_LANES 3
+#endif
+
 #ifndef TFAC_OBLITERATION_TABLE_SIZE
 #define TFAC_OBLITERATION_TABLE_SIZE 4096
 #endif
 
+// How many base32 secrets' keys to cache by default (0 = key cache disabled until tfac_set_key_cache_size() is called).
+#ifndef TFAC_KEY_CACHE_SIZE
+#define TFAC_KEY_CACHE_SIZE 0
+#endif
+
+// How many shards a verifier's used tokens are spread over (0 = one per CPU).
+#ifndef TFAC_VERIFIER_SHARDS
+#define TFAC_VERIFIER_SHARDS 0
+#endif
+
 // Digits handling constants:
 static const char* DIGITS_FORMAT[] = { "%ull", "%ull", "%02u", "%03u", "%04u", "%05u", "%06u", "%07u", "%08u", "%09u", "%010u", "%011u", "%012u", "%013u", "%014u", "%015u", "%016u", "%017u", "%018u" };
 static const uint64_t DIGITS_POW[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000, 100000000000, 1000000000000, 10000000000000, 100000000000000, 1000000000000000, 10000000000000000, 100000000000000000,
     1000000000000000000 };
 
 // Hash algorithm constants:
+#ifdef TFAC_X86
+// Only the multi-lane kernels need these (the portable code gets the digest lengths from picohash).
 static const size_t HASH_ALGO_DIGEST_LENGTHS[] = { 20, 28, 32 };
+#endif
+static const uint32_t HASH_ALGO_IVS[][8] = {
+    { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0, 0x00000000, 0x00000000, 0x00000000 },
+    { 0xC1059ED8, 0x367CD507, 0x3070DD17, 0xF70E5939, 0xFFC00B31, 0x68581511, 0x64F98FA7, 0xBEFA4FA4 },
+    { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 },
+};
 static void (*HASH_ALGOS[])(picohash_ctx_t*) = {
     &picohash_init_sha1,
     &picohash_init_sha224,
     &picohash_init_sha256,
 };
 
-// Token re-usage prevention:
-struct tfac_obliterated_token
+// Hash compression backends (portable C by default, upgraded once at startup if the CPU supports something faster):
+static uint32_t cpu_features = 0;
+
+#ifdef TFAC_X86
+#define TFAC_SHA_NI (cpu_features & TFAC_CPU_SHA_NI)
+#else
+#define TFAC_SHA_NI 0
+#endif
+
+static void tfac_sha1_compress(uint32_t* state, const uint8_t* block)
+{
+#ifdef TFAC_X86
+    if (TFAC_SHA_NI)
+    {
+        tfac_sha1_compress_sha_ni(state, block);
+        return;
+    }
+#endif
+    _picohash_sha1_compress(state, block);
+}
+
+static void tfac_sha256_compress(uint32_t* state, const uint8_t* block)
+{
+#ifdef TFAC_X86
+    if (TFAC_SHA_NI)
+    {
+        tfac_sha256_compress_sha_ni(state, block);
+        return;
+    }
+#endif
+    _picohash_sha256_compress(state, block);
+}
+
+static void tfac_select_hash_backends(const uint8_t hardware_acceleration)
+{
+    cpu_features = hardware_acceleration ? tfac_cpu_detect_features() : 0;
+}
+
+static void tfac_init_hash_backends()
+{
+    const char* force_portable = getenv("TFAC_FORCE_PORTABLE");
+    tfac_select_hash_backends(force_portable == NULL || *force_portable == '\0' || strcmp(force_portable, "0") == 0);
+}
+
+// Run the CPU detection once at load time, before any thread can call into the library.
+#if defined(_MSC_VER)
+#pragma section(".CRT$XCU", read)
+static void __cdecl tfac_init_hash_backends_msvc(void)
+{
+    tfac_init_hash_backends();
+}
+__declspec(allocate(".CRT$XCU")) static void(__cdecl* tfac_init_hash_backends_msvc_)(void) = &tfac_init_hash_backends_msvc;
+#elif defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor)) static void tfac_init_hash_backends_constructor()
+{
+    tfac_init_hash_backends();
+}
+#endif
+
+uint8_t tfac_set_hardware_acceleration(const uint8_t enabled)
+{
+    tfac_select_hash_backends(enabled);
+    return TFAC_SHA_NI ? 1 : 0;
+}
+
+// One partition of a verifier's used tokens, picked by fingerprint. Every shard header sits on cache lines of its own, so that cores working on different shards don't false-share.
+// Tokens with a steps parameter of up to TFAC_REPLAY_EPOCH seconds go into the first table; longer ones expire so much later that they get their own, with 255-second epochs
+// (otherwise, their far-ahead epochs would recycle the generations that the regular tokens still need).
+struct TFAC_CACHE_ALIGNED tfac_verifier_shard
+{
+    struct tfac_replay_table tables[2];
+};
+
+// Token re-usage prevention: the shards plus what's needed to release their memory again.
+// The shard headers are followed by all of the shards' slots (everything 64-byte aligned): right after the verifier itself, or after the file header in a memory-mapped verifier file.
+// Durable verifiers additionally log every accepted token to their write-ahead log.
+struct tfac_verifier
+{
+    struct tfac_verifier_shard* shards;
+    uint32_t shard_count;
+    void (*free_fn)(void*);
+    void* allocation;
+    void* mapping;
+    size_t mapping_size;
+    struct tfac_wal* wal;
+};
+
+#define TFAC_VERIFIER_FILE_MAGIC "TFACRPL"
+#define TFAC_VERIFIER_FILE_VERSION 1
+
+// Header of a memory-mapped verifier file. The layout fields must all match for a process to attach to an existing file
+// (they describe how the shards that follow the header were laid out by whoever created the file).
+struct TFAC_CACHE_ALIGNED tfac_verifier_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t shard_count;
+    uint64_t capacity;
+    uint32_t shard_header_size;
+    uint32_t generations;
+    uint32_t bucket_slots;
+    uint32_t epoch_length;
+};
+
+#define TFAC_VERIFIER_HEADER_SIZE ((sizeof(struct tfac_verifier) + 63) / 64 * 64)
+
+// The verifier behind tfac_verify_totp() and tfac_verify_totp_key(): only allocated on first use, so that programs that never verify anything don't pay for it.
+static uint64_t default_verifier = 0;
+
+// Key registry handles: the lower 24 bits are the slot index, the upper 8 ones the slot's generation (bumped whenever a key is unregistered, so that stale handles stop working).
+#define TFAC_KEY_REGISTRY_INDEX_BITS 24
+#define TFAC_KEY_REGISTRY_MAX_CAPACITY (UINT32_C(1) << TFAC_KEY_REGISTRY_INDEX_BITS)
+#define TFAC_KEY_REGISTRY_FREE 0xFF
+
+// Registered keys, one array per field (each of them 64-byte aligned): a lookup touches one cache line of each, and going through many handles in order streams through all of them.
+// The arrays live right after the registry itself, in the same allocation.
+// Every slot also has a sequence number that writers bump before and after changing it (odd = being written): readers never take the lock, they just copy the slot again if it changed under them.
+// Writers take turns with a mutex rather than a spinlock: saving a large registry can hold it for a while, and whoever waits for it shouldn't burn a core doing so.
+struct tfac_key_registry
+{
+    uint32_t (*inner_states)[8];
+    uint32_t (*outer_states)[8];
+    uint8_t* hash_algos;
+    uint8_t* generations;
+    uint64_t* sequences;
+    uint32_t* free_slots;
+    uint32_t free_count;
+    uint32_t used_count;
+    uint32_t capacity;
+#ifdef _WIN32
+    SRWLOCK lock;
+#else
+    pthread_mutex_t lock;
+#endif
+    void* allocation;
+    const void* mapping;
+    size_t mapping_size;
+};
+
+#define TFAC_ALIGN_64(n) (((n) + 63) / 64 * 64)
+
+// How many steps' worth of tokens a token cache holds: the current step, its two neighbours (the verification window) and the next step after that (computed ahead of time).
+#define TFAC_TOKEN_CACHE_ROWS 4
+#define TFAC_TOKEN_CACHE_COUNTER_STRIPES 64
+
+// How often the background refresh thread checks whether a step boundary was crossed (in milliseconds).
+#ifndef TFAC_TOKEN_CACHE_POLL_MS
+#define TFAC_TOKEN_CACHE_POLL_MS 50
+#endif
+
+// Hit and miss counters, striped across cache lines by slot index so that verifying threads don't all hammer the same one.
+struct TFAC_CACHE_ALIGNED tfac_token_cache_counter
+{
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Precomputed tokens of a key registry's keys: one row of entries per step (step s lives in row s % TFAC_TOKEN_CACHE_ROWS), one 64-bit entry per slot.
+// Bits 0-31 of an entry are the token, bits 32-55 the lower 24 bits of the slot's sequence number when it was computed, and bits 56-63 the slot's generation (0 = no token).
+// Lookups compare those with the registry's: keys that were changed since the token was computed are missed (and computed on demand), never served stale.
+struct tfac_token_cache
+{
+    const struct tfac_key_registry* registry;
+    uint64_t* entries;
+    struct tfac_token_cache_counter* counters;
+    uint64_t row_steps[TFAC_TOKEN_CACHE_ROWS];
+    uint32_t capacity;
+    uint8_t digits;
+    uint8_t steps;
+    uint64_t refreshing;
+    uint64_t stop;
+    uint64_t rows_computed;
+    uint64_t tokens_computed;
+    uint64_t refresh_ns;
+    void* allocation;
+    uint8_t thread_started;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
+#define TFAC_KEY_STORE_MAGIC "TFACKEY"
+#define TFAC_KEY_STORE_VERSION 2
+#define TFAC_KEY_STORE_BYTE_ORDER 0x01020304
+
+// Header of a key store file (see tfac_key_registry_save()). It's followed by the registry's arrays for all of its capacity slots, laid out just like in memory,
+// so that tfac_key_registry_open() can use them straight out of the (copy-on-write) mapping. The records are in host byte order: files from machines with another one are rejected.
+struct TFAC_CACHE_ALIGNED tfac_key_store_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t used_count;
+    uint32_t header_size;
+    uint32_t byte_order;
+    uint64_t checksum;
+};
+
+#define TFAC_KEY_DELTA_MAGIC "TFACKDL"
+#define TFAC_KEY_DELTA_VERSION 1
+
+// Header of a key delta file (see tfac_key_registry_save_delta()): it's followed by record_count records, each of them the new state of one slot of a registry with the given capacity.
+struct tfac_key_delta_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_count;
+    uint32_t capacity;
+    uint32_t header_size;
+    uint32_t byte_order;
+    uint32_t record_size;
+    uint64_t checksum;
+};
+
+struct tfac_key_delta_record
 {
-    uint8_t used_token_sha256[32];
-    uint8_t secret_key_base32_sha256[32];
+    uint32_t inner_state[8];
+    uint32_t outer_state[8];
+    uint32_t index;
+    uint8_t hash_algo;
+    uint8_t generation;
+    uint8_t reserved[2];
 };
 
-static struct tfac_obliterated_token obliteration_table[TFAC_MIN(TFAC_OBLITERATION_TABLE_SIZE, UINT32_MAX - 2)] = { 0x00 };
-static uint32_t next_obliteration_index = 0;
+// The key cache behind all of the functions that take base32 secrets: 0 = not set up yet, TFAC_KEY_CACHE_DISABLED = disabled, anything else = the tfac_key_cache.
+static uint64_t key_cache = 0;
+
+#define TFAC_KEY_CACHE_DISABLED 1
+
+static void tfac_dev_urandom(uint8_t* output_buffer, size_t output_buffer_size);
 
-static uint64_t tfac_truncate(const uint8_t* hmac, const size_t hmac_length, const uint8_t digits)
+// Big-endian word store that reliably compiles down to a single bswap + mov
+// (GCC doesn't always merge the byte by byte variant from picohash back together once the HMAC routines below are unrolled).
+static inline void tfac_store_be32(uint8_t* p, const uint32_t v)
 {
-    uint8_t offset = hmac[hmac_length - 1] & 0x0F;
-    uint64_t trunc = 0;
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const uint32_t be = __builtin_bswap32(v);
+    memcpy(p, &be, sizeof(be));
+#else
+    _picohash_store_be32(p, v);
+#endif
+}
+
+static uint64_t tfac_truncate(const uint32_t* hmac_state, const size_t hmac_length, const uint8_t digits)
+{
+    // The dynamic truncation works straight on the hash state words (the digest is just their big-endian serialization):
+    // the 4 bytes at the given offset are made of the tail of one word and the head of the next.
+
+    const uint32_t offset = hmac_state[hmac_length / 4 - 1] & 0x0F;
+    const uint32_t* w = hmac_state + offset / 4;
 
-    trunc <<= 8;
-    trunc |= hmac[offset++];
-    trunc <<= 8;
-    trunc |= hmac[offset++];
-    trunc <<= 8;
-    trunc |= hmac[offset++];
-    trunc <<= 8;
-    trunc |= hmac[offset++];
+    uint64_t trunc = (((uint64_t)w[0] << 32) | w[1]) >> (32 - (offset % 4) * 8);
 
     trunc &= 0x7FFFFFFF;
     return trunc % DIGITS_POW[TFAC_MIN(TFAC_MAX_DIGITS, digits)];
 }
 
-uint64_t tfac_hotp_raw(const uint8_t* secret_key, const size_t secret_key_length, const uint8_t digits, const uint64_t counter, const enum tfac_hash_algo hash_algo)
+static void tfac_save_midstate(const picohash_ctx_t* ctx, const enum tfac_hash_algo hash_algo, uint32_t* state)
 {
-    assert(sizeof(counter) == 8);
-
-    uint8_t c[8];
-    for (size_t i = 0; i < 8; i++)
+    if (hash_algo == TFAC_SHA1)
     {
-        c[i] = (counter >> ((sizeof(counter) - i - 1) * 8)) & 0xFF;
+        memcpy(state, ctx->_sha1.state, sizeof(ctx->_sha1.state));
     }
+    else
+    {
+        memcpy(state, ctx->_sha256.state, sizeof(ctx->_sha256.state));
+    }
+}
 
-    uint8_t hash[32];
-    picohash_ctx_t ctx;
+/*
+ * Per-algorithm (and per-backend) HMAC routines for the fixed-shape messages that HOTP needs.
+ * Every instantiation calls its compression function directly (the portable ones can even be inlined),
+ * so that tfac_key_init() and tfac_hotp_key() only dispatch once on the hash algo and backend instead of on every block.
+ */
+#define TFAC_DEFINE_HMAC(name, compress, iv, digest_length)                                                                                                                                                                                                    \
+    /* Short key (<= 1 block) setup: hash the ipad and opad blocks, starting from the algorithm's IV. */                                                                                                                                                       \
+    static void tfac_key_setup_##name(struct tfac_key* out, uint8_t* block)                                                                                                                                                                                    \
+    {                                                                                                                                                                                                                                                          \
+        memcpy(out->inner_state, (iv), sizeof(out->inner_state));                                                                                                                                                                                              \
+        compress(out->inner_state, block);                                                                                                                                                                                                                     \
+                                                                                                                                                                                                                                                               \
+        for (size_t i = 0; i < TFAC_HASH_BLOCK_LENGTH; i++)                                                                                                                                                                                                    \
+        {                                                                                                                                                                                                                                                      \
+            block[i] ^= 0x36 ^ 0x5c;                                                                                                                                                                                                                           \
+        }                                                                                                                                                                                                                                                      \
+                                                                                                                                                                                                                                                               \
+        memcpy(out->outer_state, (iv), sizeof(out->outer_state));                                                                                                                                                                                              \
+        compress(out->outer_state, block);                                                                                                                                                                                                                     \
+    }                                                                                                                                                                                                                                                          \
+                                                                                                                                                                                                                                                               \
+    /* The HMAC messages always have the same shape (an 8-byte counter for the inner hash, the inner digest for the outer one), */                                                                                                                             \
+    /* so both fit into a single block whose padding is known in advance: no need to go through the generic picohash update/final machinery. */                                                                                                                \
+    static uint64_t tfac_hotp_##name(const struct tfac_key* key, const uint8_t digits, const uint64_t counter)                                                                                                                                                 \
+    {                                                                                                                                                                                                                                                          \
+        uint32_t state[8];                                                                                                                                                                                                                                     \
+        uint8_t block[TFAC_HASH_BLOCK_LENGTH];                                                                                                                                                                                                                 \
+                                                                                                                                                                                                                                                               \
+        memset(block, 0x00, sizeof(block));                                                                                                                                                                                                                    \
+        _picohash_store_be64(block, counter);                                                                                                                                                                                                                  \
+        block[8] = 0x80;                                                                                                                                                                                                                                       \
+        _picohash_store_be64(block + 56, (TFAC_HASH_BLOCK_LENGTH + 8) * 8);                                                                                                                                                                                    \
+                                                                                                                                                                                                                                                               \
+        memcpy(state, key->inner_state, sizeof(state));                                                                                                                                                                                                        \
+        compress(state, block);                                                                                                                                                                                                                                \
+                                                                                                                                                                                                                                                               \
+        memset(block, 0x00, sizeof(block));                                                                                                                                                                                                                    \
+                                                                                                                                                                                                                                                               \
+        for (size_t i = 0; i < (digest_length) / 4; i++)                                                                                                                                                                                                       \
+        {                                                                                                                                                                                                                                                      \
+            tfac_store_be32(block + i * 4, state[i]);                                                                                                                                                                                                          \
+        }                                                                                                                                                                                                                                                      \
+                                                                                                                                                                                                                                                               \
+        block[(digest_length)] = 0x80;                                                                                                                                                                                                                         \
+        _picohash_store_be64(block + 56, (TFAC_HASH_BLOCK_LENGTH + (digest_length)) * 8);                                                                                                                                                                      \
+                                                                                                                                                                                                                                                               \
+        memcpy(state, key->outer_state, sizeof(state));                                                                                                                                                                                                        \
+        compress(state, block);                                                                                                                                                                                                                                \
+                                                                                                                                                                                                                                                               \
+        return tfac_truncate(state, (digest_length), digits);                                                                                                                                                                                                   \
+    }
 
-    picohash_init_hmac(&ctx, HASH_ALGOS[hash_algo], secret_key, secret_key_length);
-    picohash_update(&ctx, c, sizeof(counter));
-    picohash_final(&ctx, hash);
+TFAC_DEFINE_HMAC(sha1, _picohash_sha1_compress, HASH_ALGO_IVS[TFAC_SHA1], 20)
+TFAC_DEFINE_HMAC(sha224, _picohash_sha256_compress, HASH_ALGO_IVS[TFAC_SHA224], 28)
+TFAC_DEFINE_HMAC(sha256, _picohash_sha256_compress, HASH_ALGO_IVS[TFAC_SHA256], 32)
 
-    return tfac_truncate(hash, HASH_ALGO_DIGEST_LENGTHS[hash_algo], digits);
-}
+#ifdef TFAC_X86
+TFAC_DEFINE_HMAC(sha1_sha_ni, tfac_sha1_compress_sha_ni, HASH_ALGO_IVS[TFAC_SHA1], 20)
+TFAC_DEFINE_HMAC(sha224_sha_ni, tfac_sha256_compress_sha_ni, HASH_ALGO_IVS[TFAC_SHA224], 28)
+TFAC_DEFINE_HMAC(sha256_sha_ni, tfac_sha256_compress_sha_ni, HASH_ALGO_IVS[TFAC_SHA256], 32)
+#else
+// No SHA-NI kernels to specialize for here (TFAC_SHA_NI is always 0 in that case anyway).
+#define tfac_key_setup_sha1_sha_ni tfac_key_setup_sha1
+#define tfac_key_setup_sha224_sha_ni tfac_key_setup_sha224
+#define tfac_key_setup_sha256_sha_ni tfac_key_setup_sha256
+#define tfac_hotp_sha1_sha_ni tfac_hotp_sha1
+#define tfac_hotp_sha224_sha_ni tfac_hotp_sha224
+#define tfac_hotp_sha256_sha_ni tfac_hotp_sha256
+#endif
 
-struct tfac_token tfac_hotp(const char* secret_key_base32, const uint8_t digits, const uint64_t counter, const enum tfac_hash_algo hash_algo)
+#undef TFAC_DEFINE_HMAC
+
+struct tfac_key tfac_key_init(const uint8_t* secret_key, const size_t secret_key_length, const enum tfac_hash_algo hash_algo)
 {
-    struct tfac_token out;
+    struct tfac_key out;
     memset(&out, 0x00, sizeof(out));
 
+    out.hash_algo = hash_algo;
+
+    if (secret_key_length > TFAC_HASH_BLOCK_LENGTH)
+    {
+        // Keys longer than a block need to be hashed down first: leave that to the generic HMAC implementation.
+
+        picohash_ctx_t ctx;
+        picohash_init_hmac(&ctx, HASH_ALGOS[hash_algo], secret_key, secret_key_length);
+        tfac_save_midstate(&ctx, hash_algo, out.inner_state);
+
+        ctx._hmac.hash_reset(&ctx);
+        _picohash_hmac_apply_key(&ctx, 0x5c);
+        tfac_save_midstate(&ctx, hash_algo, out.outer_state);
+
+        memset(&ctx, 0x00, sizeof(ctx));
+        return out;
+    }
+
+    uint8_t block[TFAC_HASH_BLOCK_LENGTH];
+    memset(block, 0x36, sizeof(block));
+
+    for (size_t i = 0; i < secret_key_length; i++)
+    {
+        block[i] ^= secret_key[i];
+    }
+
+    switch (hash_algo)
+    {
+        case TFAC_SHA1:
+            TFAC_SHA_NI ? tfac_key_setup_sha1_sha_ni(&out, block) : tfac_key_setup_sha1(&out, block);
+            break;
+        case TFAC_SHA224:
+            TFAC_SHA_NI ? tfac_key_setup_sha224_sha_ni(&out, block) : tfac_key_setup_sha224(&out, block);
+            break;
+        case TFAC_SHA256:
+            TFAC_SHA_NI ? tfac_key_setup_sha256_sha_ni(&out, block) : tfac_key_setup_sha256(&out, block);
+            break;
+    }
+
+    memset(block, 0x00, sizeof(block));
+    return out;
+}
+
+struct tfac_key tfac_key_init_base32(const char* secret_key_base32, const enum tfac_hash_algo hash_algo)
+{
     uint8_t key[TFAC_MAX_SECRET_KEY_SIZE];
     const int key_length = base32_decode((uint8_t*)secret_key_base32, key, sizeof(key));
 
-    out.number = tfac_hotp_raw(key, key_length, digits, counter, hash_algo);
-    snprintf(out.string, sizeof(out.string), DIGITS_FORMAT[TFAC_MIN(TFAC_MAX_DIGITS, digits)], out.number);
+    const struct tfac_key out = tfac_key_init(key, TFAC_MAX(key_length, 0), hash_algo);
 
+    memset(key, 0x00, sizeof(key));
     return out;
 }
 
-uint64_t tfac_totp_raw(const uint8_t* secret_key, const size_t secret_key_length, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo, const time_t utc)
+static struct tfac_key_cache* tfac_default_key_cache()
 {
-    return tfac_hotp_raw(secret_key, secret_key_length, digits, (uint64_t)(utc / steps), hash_algo);
+    uint64_t cache = tfac_atomic_load(&key_cache);
+
+    if (cache != 0)
+    {
+        return cache == TFAC_KEY_CACHE_DISABLED ? NULL : (struct tfac_key_cache*)(uintptr_t)cache;
+    }
+
+    uint8_t hash_key[32];
+    tfac_dev_urandom(hash_key, sizeof(hash_key));
+
+    struct tfac_key_cache* new_cache = tfac_key_cache_new(TFAC_KEY_CACHE_SIZE, hash_key);
+    memset(hash_key, 0x00, sizeof(hash_key));
+
+    // Same as with the default verifier: if two threads get here at the same time, only one of their caches survives.
+    if (!tfac_atomic_cas(&key_cache, 0, new_cache != NULL ? (uint64_t)(uintptr_t)new_cache : TFAC_KEY_CACHE_DISABLED))
+    {
+        tfac_key_cache_free(new_cache);
+        cache = tfac_atomic_load(&key_cache);
+        return cache == TFAC_KEY_CACHE_DISABLED ? NULL : (struct tfac_key_cache*)(uintptr_t)cache;
+    }
+
+    return new_cache;
 }
 
-struct tfac_token tfac_totp(const char* secret_key_base32, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo)
+// What all of the functions that take a base32 secret use to get its key: from the key cache (if it's enabled), otherwise decoded on the spot.
+static struct tfac_key tfac_key_get_base32(const char* secret_key_base32, const enum tfac_hash_algo hash_algo)
 {
-    struct tfac_token out;
-    memset(&out, 0x00, sizeof(out));
+    struct tfac_key_cache* cache = tfac_default_key_cache();
+    return cache != NULL ? tfac_key_cache_get(cache, secret_key_base32, hash_algo) : tfac_key_init_base32(secret_key_base32, hash_algo);
+}
 
-    uint8_t key[TFAC_MAX_SECRET_KEY_SIZE];
-    const int key_length = base32_decode((uint8_t*)secret_key_base32, key, sizeof(key));
+uint8_t tfac_set_key_cache_size(const size_t entries)
+{
+    uint8_t hash_key[32];
+    tfac_dev_urandom(hash_key, sizeof(hash_key));
 
-    out.number = tfac_totp_raw(key, key_length, digits, steps, hash_algo, time(0));
-    snprintf(out.string, sizeof(out.string), DIGITS_FORMAT[TFAC_MIN(TFAC_MAX_DIGITS, digits)], out.number);
+    struct tfac_key_cache* new_cache = tfac_key_cache_new(entries, hash_key);
+    memset(hash_key, 0x00, sizeof(hash_key));
 
-    return out;
+    // Swap the new cache in first, and only then free the old one: lookups that start from here on never get to see it
+    // (the ones that are already running still might, which is why nobody may be generating or verifying tokens while this runs).
+    uint64_t old_cache;
+
+    do
+    {
+        old_cache = tfac_atomic_load(&key_cache);
+    } while (!tfac_atomic_cas(&key_cache, old_cache, new_cache != NULL ? (uint64_t)(uintptr_t)new_cache : TFAC_KEY_CACHE_DISABLED));
+
+    if (old_cache > TFAC_KEY_CACHE_DISABLED)
+    {
+        tfac_key_cache_free((struct tfac_key_cache*)(uintptr_t)old_cache);
+    }
+
+    return entries == 0 || new_cache != NULL;
 }
 
-uint8_t tfac_verify_totp(const char* secret_key_base32, const char* totp, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo)
+struct tfac_key_cache_stats tfac_get_key_cache_stats()
 {
-    if (digits == 0 || strlen(totp) != digits || secret_key_base32 == 0)
+    struct tfac_key_cache_stats stats;
+    memset(&stats, 0x00, sizeof(stats));
+
+    struct tfac_key_cache* cache = tfac_default_key_cache();
+
+    if (cache != NULL)
     {
-        return 0;
+        stats.entries = cache->set_count * TFAC_KEY_CACHE_WAYS;
+        tfac_key_cache_count(cache, &stats.hits, &stats.misses);
     }
 
-    uint8_t key[TFAC_MAX_SECRET_KEY_SIZE];
-    const int key_length = base32_decode((uint8_t*)secret_key_base32, key, sizeof(key));
+    return stats;
+}
 
-    const time_t ct = time(0);
-    const uint64_t tr = strtoull(totp, NULL, 10);
-    const uint64_t t0 = tfac_totp_raw(key, key_length, digits, steps, hash_algo, ct);
-    const uint64_t t1 = tfac_totp_raw(key, key_length, digits, steps, hash_algo, ct - steps);
-    const uint64_t t2 = tfac_totp_raw(key, key_length, digits, steps, hash_algo, ct + steps);
+uint64_t tfac_hotp_key(const struct tfac_key* key, const uint8_t digits, const uint64_t counter)
+{
+    switch (key->hash_algo)
+    {
+        case TFAC_SHA1:
+            return TFAC_SHA_NI ? tfac_hotp_sha1_sha_ni(key, digits, counter) : tfac_hotp_sha1(key, digits, counter);
+        case TFAC_SHA224:
+            return TFAC_SHA_NI ? tfac_hotp_sha224_sha_ni(key, digits, counter) : tfac_hotp_sha224(key, digits, counter);
+        case TFAC_SHA256:
+            return TFAC_SHA_NI ? tfac_hotp_sha256_sha_ni(key, digits, counter) : tfac_hotp_sha256(key, digits, counter);
+        default:
+            return 0;
+    }
+}
+
+uint64_t tfac_totp_key(const struct tfac_key* key, const uint8_t digits, const uint8_t steps, const time_t utc)
+{
+    return tfac_hotp_key(key, digits, (uint64_t)(utc / steps));
+}
+
+#ifdef TFAC_X86
+
+// Computes the HOTPs for a batch of same-algorithm keys (referenced by their indices in the keys array) in one go: up to 8 SHA-1 or 16 SHA-224/256 ones.
+// Unused lanes are filled up with copies of the first one: that's still cheaper than doing the leftovers one by one.
+static void tfac_hotp_lanes(const struct tfac_key* keys, const uint64_t* counters, const enum tfac_hash_algo hash_algo, const size_t* lanes, const size_t lane_count, const uint8_t digits, uint64_t* out)
+{
+    const uint32_t* inner_states[16];
+    const uint32_t* outer_states[16];
+    uint64_t lane_counters[16];
+    uint32_t digests[16][8];
 
-    if (tr != t0 && tr != t1 && tr != t2)
+    for (size_t i = 0; i < 16; i++)
     {
-        return 0;
+        const size_t index = lanes[i < lane_count ? i : 0];
+
+        inner_states[i] = keys[index].inner_state;
+        outer_states[i] = keys[index].outer_state;
+        lane_counters[i] = counters[index];
+    }
+
+    if (hash_algo == TFAC_SHA1)
+    {
+        uint32_t sha1_digests[8][5];
+        tfac_hmac_sha1_x8_avx2(inner_states, outer_states, lane_counters, sha1_digests);
+
+        for (size_t i = 0; i < 8; i++)
+        {
+            memcpy(digests[i], sha1_digests[i], sizeof(sha1_digests[i]));
+        }
+
+        memset(sha1_digests, 0x00, sizeof(sha1_digests));
+    }
+    else
+    {
+        tfac_hmac_sha256_x16_avx512(inner_states, outer_states, lane_counters, HASH_ALGO_DIGEST_LENGTHS[hash_algo] / 4, digests);
+    }
+
+    for (size_t i = 0; i < lane_count; i++)
+    {
+        out[lanes[i]] = tfac_truncate(digests[i], HASH_ALGO_DIGEST_LENGTHS[hash_algo], digits);
+    }
+
+    memset(digests, 0x00, sizeof(digests));
+}
+
+#endif // TFAC_X86
+
+void tfac_hotp_key_batch(const struct tfac_key* keys, const uint64_t* counters, const size_t count, const uint8_t digits, uint64_t* out)
+{
+    if (keys == NULL || counters == NULL || out == NULL)
+    {
+        return;
+    }
+
+    size_t i = 0;
+
+#ifdef TFAC_X86
+    // How many keys of each hash algo can be computed in parallel (0 means one by one),
+    // and from how many leftover keys on a partially filled batch is worth it.
+    const size_t lane_widths[] = { cpu_features & TFAC_CPU_AVX2 ? 8 : 0, cpu_features & TFAC_CPU_AVX512F ? 16 : 0, cpu_features & TFAC_CPU_AVX512F ? 16 : 0 };
+    const size_t min_lanes[] = { TFAC_SHA1_X8_MIN_LANES, TFAC_SHA256_X16_MIN_LANES, TFAC_SHA256_X16_MIN_LANES };
+
+    if (lane_widths[TFAC_SHA1] || lane_widths[TFAC_SHA256])
+    {
+        size_t lanes[3][16];
+        size_t lane_counts[3] = { 0, 0, 0 };
+
+        for (; i < count; i++)
+        {
+            const enum tfac_hash_algo hash_algo = keys[i].hash_algo;
+
+            // Keys with an unknown hash algo don't get anywhere near the lane arrays: tfac_hotp_key() rejects them on its own.
+            if ((uint32_t)hash_algo > TFAC_SHA256 || lane_widths[hash_algo] == 0)
+            {
+                out[i] = tfac_hotp_key(&keys[i], digits, counters[i]);
+                continue;
+            }
+
+            lanes[hash_algo][lane_counts[hash_algo]++] = i;
+
+            if (lane_counts[hash_algo] == lane_widths[hash_algo])
+            {
+                tfac_hotp_lanes(keys, counters, hash_algo, lanes[hash_algo], lane_counts[hash_algo], digits, out);
+                lane_counts[hash_algo] = 0;
+            }
+        }
+
+        for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+        {
+            if (lane_counts[hash_algo] > min_lanes[hash_algo])
+            {
+                tfac_hotp_lanes(keys, counters, (enum tfac_hash_algo)hash_algo, lanes[hash_algo], lane_counts[hash_algo], digits, out);
+                continue;
+            }
+
+            for (size_t j = 0; j < lane_counts[hash_algo]; j++)
+            {
+                out[lanes[hash_algo][j]] = tfac_hotp_key(&keys[lanes[hash_algo][j]], digits, counters[lanes[hash_algo][j]]);
+            }
+        }
+
+        return;
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        out[i] = tfac_hotp_key(&keys[i], digits, counters[i]);
+    }
+}
+
+void tfac_totp_key_batch(const struct tfac_key* keys, const size_t count, const uint8_t digits, const uint8_t steps, const time_t utc, uint64_t* out)
+{
+    uint64_t counters[256];
+    const uint64_t counter = (uint64_t)(utc / steps);
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        counters[i] = counter;
+    }
+
+    for (size_t i = 0; i < count; i += sizeof(counters) / sizeof(counters[0]))
+    {
+        tfac_hotp_key_batch(keys + i, counters, TFAC_MIN(count - i, sizeof(counters) / sizeof(counters[0])), digits, out + i);
     }
+}
 
-    uint8_t totp_sha256[32];
-    uint8_t secret_key_base32_sha256[32];
+// How many raw secrets tfac_hotp_raw_many() and tfac_totp_raw_many() set up at a time (on the stack) before handing them to tfac_hotp_key_batch().
+#ifndef TFAC_RAW_MANY_CHUNK_SIZE
+#define TFAC_RAW_MANY_CHUNK_SIZE 128
+#endif
 
-    picohash_ctx_t ctx;
-    picohash_init_sha256(&ctx);
-    picohash_update(&ctx, &tr, sizeof(tr));
-    picohash_final(&ctx, totp_sha256);
-    picohash_reset(&ctx);
-    picohash_update(&ctx, secret_key_base32, strlen(secret_key_base32));
-    picohash_final(&ctx, secret_key_base32_sha256);
-    picohash_reset(&ctx);
+void tfac_hotp_raw_many(const uint8_t* const* secret_keys, const size_t* secret_key_lengths, const uint64_t* counters, const size_t count, const uint8_t digits, const enum tfac_hash_algo hash_algo, uint64_t* out)
+{
+    if (secret_keys == NULL || secret_key_lengths == NULL || counters == NULL || out == NULL)
+    {
+        return;
+    }
 
-    uint32_t c = 0;
-    uint32_t i = TFAC_MIN(next_obliteration_index - 1, TFAC_OBLITERATION_TABLE_SIZE - 1);
+    struct tfac_key keys[TFAC_RAW_MANY_CHUNK_SIZE];
 
-    while (c < TFAC_OBLITERATION_TABLE_SIZE)
+    for (size_t i = 0; i < count; i += TFAC_RAW_MANY_CHUNK_SIZE)
     {
-        const struct tfac_obliterated_token t = obliteration_table[i];
-        if (memcmp(totp_sha256, t.used_token_sha256, sizeof(totp_sha256)) == 0 && memcmp(secret_key_base32_sha256, t.secret_key_base32_sha256, sizeof(secret_key_base32_sha256)) == 0)
+        const size_t n = TFAC_MIN(count - i, TFAC_RAW_MANY_CHUNK_SIZE);
+
+        for (size_t j = 0; j < n; j++)
         {
-            return 0;
+#if defined(__GNUC__) || defined(__clang__)
+            // The secrets are usually scattered all over the heap: get the next one on its way while this one is being set up.
+            if (j + 1 < n)
+            {
+                __builtin_prefetch(secret_keys[i + j + 1]);
+            }
+#endif
+            keys[j] = tfac_key_init(secret_keys[i + j], secret_key_lengths[i + j], hash_algo);
         }
 
-        if (--i >= TFAC_OBLITERATION_TABLE_SIZE)
+        tfac_hotp_key_batch(keys, counters + i, n, digits, out + i);
+    }
+
+    memset(keys, 0x00, sizeof(keys));
+}
+
+void tfac_totp_raw_many(const uint8_t* const* secret_keys, const size_t* secret_key_lengths, const time_t* utcs, const size_t count, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo, uint64_t* out)
+{
+    if (utcs == NULL)
+    {
+        return;
+    }
+
+    uint64_t counters[TFAC_RAW_MANY_CHUNK_SIZE];
+
+    for (size_t i = 0; i < count; i += TFAC_RAW_MANY_CHUNK_SIZE)
+    {
+        const size_t n = TFAC_MIN(count - i, TFAC_RAW_MANY_CHUNK_SIZE);
+
+        for (size_t j = 0; j < n; j++)
         {
-            i = TFAC_OBLITERATION_TABLE_SIZE - 1;
+            counters[j] = (uint64_t)(utcs[i + j] / steps);
         }
 
-        c++;
+        tfac_hotp_raw_many(secret_keys + i, secret_key_lengths + i, counters, n, digits, hash_algo, out + i);
     }
+}
 
-    struct tfac_obliterated_token* obliterated_token = &obliteration_table[next_obliteration_index];
-    memcpy(obliterated_token->used_token_sha256, totp_sha256, sizeof(totp_sha256));
-    memcpy(obliterated_token->secret_key_base32_sha256, secret_key_base32_sha256, sizeof(secret_key_base32_sha256));
-    next_obliteration_index = (next_obliteration_index + 1) % TFAC_OBLITERATION_TABLE_SIZE;
+uint64_t tfac_hotp_raw(const uint8_t* secret_key, const size_t secret_key_length, const uint8_t digits, const uint64_t counter, const enum tfac_hash_algo hash_algo)
+{
+    const struct tfac_key key = tfac_key_init(secret_key, secret_key_length, hash_algo);
+    return tfac_hotp_key(&key, digits, counter);
+}
 
-    return 1;
+struct tfac_token tfac_hotp(const char* secret_key_base32, const uint8_t digits, const uint64_t counter, const enum tfac_hash_algo hash_algo)
+{
+    struct tfac_token out;
+    memset(&out, 0x00, sizeof(out));
+
+    const struct tfac_key key = tfac_key_get_base32(secret_key_base32, hash_algo);
+
+    out.number = tfac_hotp_key(&key, digits, counter);
+    snprintf(out.string, sizeof(out.string), DIGITS_FORMAT[TFAC_MIN(TFAC_MAX_DIGITS, digits)], out.number);
+
+    return out;
+}
+
+uint64_t tfac_totp_raw(const uint8_t* secret_key, const size_t secret_key_length, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo, const time_t utc)
+{
+    return tfac_hotp_raw(secret_key, secret_key_length, digits, (uint64_t)(utc / steps), hash_algo);
+}
+
+struct tfac_token tfac_totp(const char* secret_key_base32, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo)
+{
+    struct tfac_token out;
+    memset(&out, 0x00, sizeof(out));
+
+    const struct tfac_key key = tfac_key_get_base32(secret_key_base32, hash_algo);
+
+    out.number = tfac_totp_key(&key, digits, steps, time(0));
+    snprintf(out.string, sizeof(out.string), DIGITS_FORMAT[TFAC_MIN(TFAC_MAX_DIGITS, digits)], out.number);
+
+    return out;
+}
+
+// Checks the token against the previous, current and next time step, and tells which one it belongs to.
+static uint8_t tfac_match_totp_step(const struct tfac_key* key, const uint64_t tr, const uint8_t digits, const uint8_t steps, uint64_t* step)
+{
+    const time_t ct = time(0);
+    *step = (uint64_t)(ct / steps);
+
+    // Most tokens are entered within their own time step: only compute the neighbouring steps' tokens (allowed clock drift) on a miss.
+    // Two HMACs are too few to fill the multi-lane kernels (tfac_hotp_key_batch() would fall back to computing them one by one anyway), so they are computed right here, the second one only if the first one doesn't match.
+
+    if (tr == tfac_hotp_key(key, digits, *step))
+    {
+        return 1;
+    }
+
+    const uint64_t neighbours[2] = { (uint64_t)((ct - steps) / steps), (uint64_t)((ct + steps) / steps) };
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (tr == tfac_hotp_key(key, digits, neighbours[i]))
+        {
+            *step = neighbours[i];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t tfac_verifier_shard_count(const size_t capacity)
+{
+    static uint64_t cpu_count = 0;
+
+    // Cached, so that the buffer size that tfac_verifier_size() reports still fits once tfac_verifier_init() is called (even if CPUs go on- or offline in between).
+    // Threads that get here at the same time may all count the CPUs, but only the first count is kept: everybody uses that one from then on.
+    uint64_t cpus = tfac_atomic_load(&cpu_count);
+
+    if (cpus == 0)
+    {
+        tfac_atomic_cas(&cpu_count, 0, (uint64_t)tfac_cpu_count());
+        cpus = tfac_atomic_load(&cpu_count);
+    }
+
+    const uint32_t shards = TFAC_VERIFIER_SHARDS > 0 ? TFAC_VERIFIER_SHARDS : (uint32_t)cpus;
+    return (uint32_t)TFAC_MAX(1, TFAC_MIN(TFAC_MIN(shards, 1024), capacity));
+}
+
+// Slots per replay table of a shard: two per token, so that the probe sequences stay short.
+static size_t tfac_verifier_shard_slots(const size_t capacity, const uint32_t shard_count)
+{
+    const size_t shard_capacity = (TFAC_MIN(capacity, UINT32_MAX / 8) + shard_count - 1) / shard_count;
+    return TFAC_REPLAY_GENERATIONS * ((shard_capacity * 2 + TFAC_REPLAY_BUCKET_SLOTS - 1) / TFAC_REPLAY_BUCKET_SLOTS) * TFAC_REPLAY_BUCKET_SLOTS;
+}
+
+// How many bytes the shard headers and their slots take up.
+static size_t tfac_verifier_shards_size(const size_t capacity, const uint32_t shard_count)
+{
+    return shard_count * (sizeof(struct tfac_verifier_shard) + 2 * tfac_verifier_shard_slots(capacity, shard_count) * sizeof(uint64_t));
+}
+
+// Lays out the shard headers and their (zeroed out) slots in the given 64-byte aligned memory.
+// The fingerprint key is random, unless one is passed in (durable verifiers have to keep using the one that their log was written with).
+static void tfac_verifier_init_shards(struct tfac_verifier_shard* shards, const uint32_t shard_count, const size_t capacity, const uint8_t* key)
+{
+    const size_t slot_count = tfac_verifier_shard_slots(capacity, shard_count);
+    uint64_t* slots = (uint64_t*)(shards + shard_count);
+
+    uint8_t replay_key[16];
+
+    if (key != NULL)
+    {
+        memcpy(replay_key, key, sizeof(replay_key));
+    }
+    else
+    {
+        tfac_dev_urandom(replay_key, sizeof(replay_key));
+    }
+
+    for (uint32_t i = 0; i < shard_count; i++, slots += 2 * slot_count)
+    {
+        struct tfac_replay_table* tables = shards[i].tables;
+
+        tfac_replay_init(&tables[0], slots, slot_count, TFAC_REPLAY_EPOCH);
+        tfac_replay_init(&tables[1], slots + slot_count, slot_count, UINT8_MAX);
+        tfac_replay_set_key(&tables[0], replay_key);
+        tfac_replay_set_key(&tables[1], replay_key);
+    }
+
+    memset(replay_key, 0x00, sizeof(replay_key));
+}
+
+size_t tfac_verifier_size(const size_t capacity)
+{
+    if (capacity == 0)
+    {
+        return 0;
+    }
+
+    // The extra 63 bytes leave room for aligning the verifier to a cache line.
+    return 63 + TFAC_VERIFIER_HEADER_SIZE + tfac_verifier_shards_size(capacity, tfac_verifier_shard_count(capacity));
+}
+
+static struct tfac_verifier* tfac_verifier_init_keyed(void* buffer, const size_t buffer_size, const size_t capacity, const uint8_t* key)
+{
+    const size_t size = tfac_verifier_size(capacity);
+
+    if (buffer == NULL || size == 0 || buffer_size < size)
+    {
+        return NULL;
+    }
+
+    struct tfac_verifier* verifier = (struct tfac_verifier*)(((uintptr_t)buffer + 63) & ~(uintptr_t)63);
+
+    verifier->shard_count = tfac_verifier_shard_count(capacity);
+    verifier->shards = (struct tfac_verifier_shard*)((uint8_t*)verifier + TFAC_VERIFIER_HEADER_SIZE);
+    verifier->free_fn = NULL;
+    verifier->allocation = buffer;
+    verifier->mapping = NULL;
+    verifier->mapping_size = 0;
+    verifier->wal = NULL;
+
+    tfac_verifier_init_shards(verifier->shards, verifier->shard_count, capacity, key);
+
+    return verifier;
+}
+
+struct tfac_verifier* tfac_verifier_init(void* buffer, const size_t buffer_size, const size_t capacity)
+{
+    return tfac_verifier_init_keyed(buffer, buffer_size, capacity, NULL);
+}
+
+struct tfac_verifier* tfac_verifier_new(const size_t capacity, void* (*malloc_fn)(size_t), void (*free_fn)(void*))
+{
+    if ((malloc_fn == NULL) != (free_fn == NULL))
+    {
+        return NULL;
+    }
+
+    if (malloc_fn == NULL)
+    {
+        malloc_fn = &malloc;
+        free_fn = &free;
+    }
+
+    const size_t size = tfac_verifier_size(capacity);
+
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    void* buffer = malloc_fn(size);
+
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+
+    struct tfac_verifier* verifier = tfac_verifier_init(buffer, size, capacity);
+    verifier->free_fn = free_fn;
+
+    return verifier;
+}
+
+// Checks whether a verifier file header describes the shard layout that this build of TFAC would create (and expects).
+static uint8_t tfac_verifier_file_header_is_valid(const struct tfac_verifier_file_header* header, const size_t file_size)
+{
+    return memcmp(header->magic, TFAC_VERIFIER_FILE_MAGIC, sizeof(header->magic)) == 0
+        && header->version == TFAC_VERIFIER_FILE_VERSION
+        && header->shard_count > 0
+        && header->shard_count <= header->capacity
+        && header->shard_header_size == sizeof(struct tfac_verifier_shard)
+        && header->generations == TFAC_REPLAY_GENERATIONS
+        && header->bucket_slots == TFAC_REPLAY_BUCKET_SLOTS
+        && header->epoch_length == TFAC_REPLAY_EPOCH
+        && file_size >= sizeof(struct tfac_verifier_file_header) + tfac_verifier_shards_size(header->capacity, header->shard_count);
+}
+
+// Sets up the shards in a freshly mapped verifier file (or attaches to the ones that are already in there). The caller holds the file lock.
+static struct tfac_verifier* tfac_verifier_attach(void* mapping, const size_t mapping_size, const size_t capacity, const uint8_t create)
+{
+    struct tfac_verifier_file_header* header = (struct tfac_verifier_file_header*)mapping;
+
+    if (create)
+    {
+        // The magic goes in last: a file whose creator crashed half way through is simply set up again by the next process that opens it.
+        memset(header, 0x00, sizeof(struct tfac_verifier_file_header));
+        header->version = TFAC_VERIFIER_FILE_VERSION;
+        header->shard_count = tfac_verifier_shard_count(capacity);
+        header->capacity = capacity;
+        header->shard_header_size = sizeof(struct tfac_verifier_shard);
+        header->generations = TFAC_REPLAY_GENERATIONS;
+        header->bucket_slots = TFAC_REPLAY_BUCKET_SLOTS;
+        header->epoch_length = TFAC_REPLAY_EPOCH;
+
+        tfac_verifier_init_shards((struct tfac_verifier_shard*)(header + 1), header->shard_count, capacity, NULL);
+        memcpy(header->magic, TFAC_VERIFIER_FILE_MAGIC, sizeof(header->magic));
+    }
+
+    if (!tfac_verifier_file_header_is_valid(header, mapping_size))
+    {
+        return NULL;
+    }
+
+    struct tfac_verifier* verifier = malloc(sizeof(struct tfac_verifier));
+
+    if (verifier == NULL)
+    {
+        return NULL;
+    }
+
+    verifier->shards = (struct tfac_verifier_shard*)(header + 1);
+    verifier->shard_count = header->shard_count;
+    verifier->free_fn = &free;
+    verifier->allocation = verifier;
+    verifier->mapping = mapping;
+    verifier->mapping_size = mapping_size;
+    verifier->wal = NULL;
+
+    return verifier;
+}
+
+struct tfac_verifier* tfac_verifier_open(const char* path, const size_t capacity)
+{
+    if (path == NULL || capacity == 0)
+    {
+        return NULL;
+    }
+
+    const size_t new_file_size = sizeof(struct tfac_verifier_file_header) + tfac_verifier_shards_size(capacity, tfac_verifier_shard_count(capacity));
+    struct tfac_verifier* verifier = NULL;
+
+    // Files that are empty (or whose creator never got to write the magic) are set up from scratch: everybody else just attaches to them.
+    // The file lock makes sure that only one process at a time gets to decide which one it is.
+    char magic[8] = { 0x00 };
+    uint8_t create = 0;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0x00, sizeof(overlapped));
+
+    if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped))
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    DWORD bytes_read = 0;
+    LARGE_INTEGER file_size;
+    file_size.QuadPart = 0;
+
+    if (GetFileSizeEx(file, &file_size) && ReadFile(file, magic, sizeof(magic), &bytes_read, NULL) && memcmp(magic, "\0\0\0\0\0\0\0\0", sizeof(magic)) == 0)
+    {
+        file_size.QuadPart = (LONGLONG)new_file_size;
+        create = SetFilePointerEx(file, file_size, NULL, FILE_BEGIN) && SetEndOfFile(file);
+        file_size.QuadPart = create ? (LONGLONG)new_file_size : 0;
+    }
+
+    HANDLE file_mapping = file_size.QuadPart > 0 ? CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)file_size.QuadPart >> 32), (DWORD)file_size.QuadPart, NULL) : NULL;
+
+    if (file_mapping != NULL)
+    {
+        void* mapping = MapViewOfFile(file_mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)file_size.QuadPart);
+        CloseHandle(file_mapping);
+
+        if (mapping != NULL)
+        {
+            verifier = tfac_verifier_attach(mapping, (size_t)file_size.QuadPart, capacity, create);
+
+            if (verifier == NULL)
+            {
+                UnmapViewOfFile(mapping);
+            }
+        }
+    }
+
+    UnlockFileEx(file, 0, MAXDWORD, MAXDWORD, &overlapped);
+    CloseHandle(file);
+#else
+    const int fd = open(path, O_RDWR | O_CREAT, 0600);
+
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    if (flock(fd, LOCK_EX) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    struct stat file_info;
+    size_t file_size = 0;
+
+    if (fstat(fd, &file_info) == 0 && pread(fd, magic, sizeof(magic), 0) >= 0)
+    {
+        file_size = (size_t)file_info.st_size;
+
+        if (memcmp(magic, "\0\0\0\0\0\0\0\0", sizeof(magic)) == 0)
+        {
+            create = ftruncate(fd, 0) == 0 && ftruncate(fd, (off_t)new_file_size) == 0;
+            file_size = create ? new_file_size : 0;
+        }
+    }
+
+    void* mapping = file_size > 0 ? mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+    if (mapping != MAP_FAILED)
+    {
+        verifier = tfac_verifier_attach(mapping, file_size, capacity, create);
+
+        if (verifier == NULL)
+        {
+            munmap(mapping, file_size);
+        }
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+#endif
+
+    return verifier;
+}
+
+// Picks the replay table that a token's fingerprint belongs into.
+static struct tfac_replay_table* tfac_verifier_table(struct tfac_verifier* verifier, const uint64_t fingerprint, const uint8_t steps)
+{
+    // The replay tables only store the fingerprint's upper 40 bits: the lower 24 ones pick the shard.
+    const uint32_t shard = (uint32_t)(((fingerprint & 0xFFFFFF) * verifier->shard_count) >> 24);
+    return &verifier->shards[shard].tables[steps > TFAC_REPLAY_EPOCH];
+}
+
+static void tfac_verifier_load_used_token(void* user, const uint64_t fingerprint, const uint64_t expires, const uint8_t steps)
+{
+    struct tfac_verifier* verifier = (struct tfac_verifier*)user;
+    tfac_replay_check_and_insert(tfac_verifier_table(verifier, fingerprint, steps), fingerprint, expires);
+}
+
+struct tfac_verifier* tfac_verifier_open_durable(const char* path, const size_t capacity, const uint32_t fsync_interval_ms)
+{
+    const size_t size = tfac_verifier_size(capacity);
+
+    if (path == NULL || size == 0)
+    {
+        return NULL;
+    }
+
+    struct tfac_wal* wal = malloc(sizeof(struct tfac_wal));
+    void* buffer = malloc(size);
+
+    if (wal == NULL || buffer == NULL)
+    {
+        free(wal);
+        free(buffer);
+        return NULL;
+    }
+
+    // New logs get a random fingerprint key: existing ones bring their own, since that's what the fingerprints in there were computed with.
+    uint8_t replay_key[16];
+    tfac_dev_urandom(replay_key, sizeof(replay_key));
+
+    if (!tfac_wal_open(wal, path, fsync_interval_ms, replay_key))
+    {
+        memset(replay_key, 0x00, sizeof(replay_key));
+        free(wal);
+        free(buffer);
+        return NULL;
+    }
+
+    struct tfac_verifier* verifier = tfac_verifier_init_keyed(buffer, size, capacity, replay_key);
+    verifier->free_fn = &free;
+
+    memset(replay_key, 0x00, sizeof(replay_key));
+
+    if (!tfac_wal_load(wal, &tfac_verifier_load_used_token, verifier))
+    {
+        tfac_wal_close(wal);
+        free(wal);
+        free(buffer);
+        return NULL;
+    }
+
+    verifier->wal = wal;
+    return verifier;
+}
+
+uint8_t tfac_verifier_sync(struct tfac_verifier* verifier)
+{
+    if (verifier == NULL)
+    {
+        return 0;
+    }
+
+    return verifier->wal == NULL || tfac_wal_sync(verifier->wal);
+}
+
+uint8_t tfac_verifier_compact(struct tfac_verifier* verifier)
+{
+    if (verifier == NULL)
+    {
+        return 0;
+    }
+
+    return verifier->wal == NULL || tfac_wal_compact(verifier->wal);
+}
+
+void tfac_verifier_free(struct tfac_verifier* verifier)
+{
+    if (verifier == NULL || verifier->free_fn == NULL)
+    {
+        return;
+    }
+
+    if (verifier->wal != NULL)
+    {
+        tfac_wal_close(verifier->wal);
+        free(verifier->wal);
+    }
+
+    if (verifier->mapping != NULL)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(verifier->mapping);
+#else
+        munmap(verifier->mapping, verifier->mapping_size);
+#endif
+    }
+
+    verifier->free_fn(verifier->allocation);
+}
+
+// Marks a token that matched the given step as used: returns 0 if it has been used before (or if a durable verifier couldn't log it).
+static uint8_t tfac_verifier_accept(struct tfac_verifier* verifier, const struct tfac_key* key, const uint64_t tr, const uint64_t step, const uint8_t steps)
+{
+    // The key's midstates identify the secret (and hash algo) just as well as the secret itself:
+    // this way, re-encoded variants of the same base32 secret (e.g. lowercase) cannot be used to replay a token.
+    uint8_t used_token[sizeof(key->inner_state) + sizeof(key->outer_state) + sizeof(tr) + sizeof(step)];
+    memcpy(used_token, key->inner_state, sizeof(key->inner_state));
+    memcpy(used_token + sizeof(key->inner_state), key->outer_state, sizeof(key->outer_state));
+    memcpy(used_token + sizeof(key->inner_state) + sizeof(key->outer_state), &tr, sizeof(tr));
+    memcpy(used_token + sizeof(key->inner_state) + sizeof(key->outer_state) + sizeof(tr), &step, sizeof(step));
+
+    const uint64_t fingerprint = tfac_replay_fingerprint(&verifier->shards[0].tables[0], used_token, sizeof(used_token));
+    memset(used_token, 0x00, sizeof(used_token));
+
+    // The token is accepted within a window of three steps (the matched one and its neighbours), so it's safe to forget it after that.
+    const uint64_t expires = (step + 2) * steps;
+
+    if (!tfac_replay_check_and_insert(tfac_verifier_table(verifier, fingerprint, steps), fingerprint, expires))
+    {
+        return 0;
+    }
+
+    // Durable verifiers fail closed: a token whose use couldn't be logged is rejected (it stays marked as used in memory all the same).
+    return verifier->wal == NULL || tfac_wal_append(verifier->wal, fingerprint, expires, steps);
+}
+
+uint8_t tfac_verifier_verify_totp_key(struct tfac_verifier* verifier, const struct tfac_key* key, const char* totp, const uint8_t digits, const uint8_t steps)
+{
+    if (verifier == NULL || digits == 0 || key == NULL || totp == NULL || strlen(totp) != digits)
+    {
+        return 0;
+    }
+
+    // The time step that the token belongs to: that's what its replay protection entry expires with.
+    uint64_t step;
+    const uint64_t tr = strtoull(totp, NULL, 10);
+
+    if (!tfac_match_totp_step(key, tr, digits, steps, &step))
+    {
+        return 0;
+    }
+
+    return tfac_verifier_accept(verifier, key, tr, step, steps);
+}
+
+uint8_t tfac_verifier_verify_totp(struct tfac_verifier* verifier, const char* secret_key_base32, const char* totp, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo)
+{
+    if (verifier == NULL || digits == 0 || totp == NULL || strlen(totp) != digits || secret_key_base32 == 0)
+    {
+        return 0;
+    }
+
+    const struct tfac_key key = tfac_key_get_base32(secret_key_base32, hash_algo);
+    return tfac_verifier_verify_totp_key(verifier, &key, totp, digits, steps);
+}
+
+static struct tfac_verifier* tfac_default_verifier()
+{
+    struct tfac_verifier* verifier = (struct tfac_verifier*)(uintptr_t)tfac_atomic_load(&default_verifier);
+
+    if (verifier != NULL)
+    {
+        return verifier;
+    }
+
+    verifier = tfac_verifier_new(TFAC_OBLITERATION_TABLE_SIZE, NULL, NULL);
+
+    if (verifier == NULL)
+    {
+        return NULL;
+    }
+
+    // Two threads verifying their first tokens at the same time: only one of the two verifiers survives.
+    if (!tfac_atomic_cas(&default_verifier, 0, (uint64_t)(uintptr_t)verifier))
+    {
+        tfac_verifier_free(verifier);
+        verifier = (struct tfac_verifier*)(uintptr_t)tfac_atomic_load(&default_verifier);
+    }
+
+    return verifier;
+}
+
+uint8_t tfac_verify_totp_key(const struct tfac_key* key, const char* totp, const uint8_t digits, const uint8_t steps)
+{
+    if (digits == 0 || key == NULL || totp == NULL || strlen(totp) != digits)
+    {
+        return 0;
+    }
+
+    return tfac_verifier_verify_totp_key(tfac_default_verifier(), key, totp, digits, steps);
+}
+
+uint8_t tfac_verify_totp_key_step(const struct tfac_key* key, const char* totp, const uint8_t digits, const uint8_t steps, uint64_t* last_accepted_step)
+{
+    if (digits == 0 || key == NULL || totp == NULL || last_accepted_step == NULL || strlen(totp) != digits)
+    {
+        return 0;
+    }
+
+    uint64_t step;
+
+    if (!tfac_match_totp_step(key, strtoull(totp, NULL, 10), digits, steps, &step))
+    {
+        return 0;
+    }
+
+    return tfac_replay_advance_step(last_accepted_step, step);
+}
+
+uint8_t tfac_verify_totp(const char* secret_key_base32, const char* totp, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo)
+{
+    if (digits == 0 || totp == NULL || strlen(totp) != digits || secret_key_base32 == 0)
+    {
+        return 0;
+    }
+
+    const struct tfac_key key = tfac_key_get_base32(secret_key_base32, hash_algo);
+    return tfac_verify_totp_key(&key, totp, digits, steps);
+}
+
+uint8_t tfac_verify_totp_step(const char* secret_key_base32, const char* totp, const uint8_t digits, const uint8_t steps, const enum tfac_hash_algo hash_algo, uint64_t* last_accepted_step)
+{
+    if (digits == 0 || totp == NULL || strlen(totp) != digits || secret_key_base32 == 0)
+    {
+        return 0;
+    }
+
+    const struct tfac_key key = tfac_key_get_base32(secret_key_base32, hash_algo);
+    return tfac_verify_totp_key_step(&key, totp, digits, steps, last_accepted_step);
+}
+
+// How many bytes the registry's key arrays (all but the free slot list) take up for the given number of slots: that's also exactly what follows a key store file's header.
+static size_t tfac_key_registry_arrays_size(const uint32_t capacity)
+{
+    return 2 * TFAC_ALIGN_64((size_t)capacity * 8 * sizeof(uint32_t)) + 2 * TFAC_ALIGN_64((size_t)capacity);
+}
+
+// Points the registry's arrays into the given 64-byte aligned memory (one after the other, each of them starting on a cache line of its own).
+static void tfac_key_registry_place_arrays(struct tfac_key_registry* registry, uint8_t* arrays, const uint32_t capacity)
+{
+    const size_t states_size = TFAC_ALIGN_64((size_t)capacity * 8 * sizeof(uint32_t));
+    const size_t bytes_size = TFAC_ALIGN_64((size_t)capacity);
+
+    registry->inner_states = (uint32_t(*)[8])arrays;
+    registry->outer_states = (uint32_t(*)[8])(arrays + states_size);
+    registry->hash_algos = arrays + 2 * states_size;
+    registry->generations = arrays + 2 * states_size + bytes_size;
+}
+
+static uint8_t tfac_key_registry_init_lock(struct tfac_key_registry* registry)
+{
+#ifdef _WIN32
+    InitializeSRWLock(&registry->lock);
+    return 1;
+#else
+    return pthread_mutex_init(&registry->lock, NULL) == 0;
+#endif
+}
+
+struct tfac_key_registry* tfac_key_registry_new(const uint32_t capacity)
+{
+    if (capacity == 0 || capacity > TFAC_KEY_REGISTRY_MAX_CAPACITY)
+    {
+        return NULL;
+    }
+
+    const size_t header_size = TFAC_ALIGN_64(sizeof(struct tfac_key_registry));
+    const size_t arrays_size = tfac_key_registry_arrays_size(capacity);
+
+    // The extra 63 bytes leave room for aligning the registry (and with it, all of its arrays) to a cache line.
+    void* allocation = malloc(63 + header_size + arrays_size + (size_t)capacity * (sizeof(uint64_t) + sizeof(uint32_t)));
+
+    if (allocation == NULL)
+    {
+        return NULL;
+    }
+
+    struct tfac_key_registry* registry = (struct tfac_key_registry*)(((uintptr_t)allocation + 63) & ~(uintptr_t)63);
+    uint8_t* arrays = (uint8_t*)registry + header_size;
+
+    tfac_key_registry_place_arrays(registry, arrays, capacity);
+    registry->sequences = (uint64_t*)(arrays + arrays_size);
+    registry->free_slots = (uint32_t*)(registry->sequences + capacity);
+    registry->free_count = 0;
+    registry->used_count = 0;
+    registry->capacity = capacity;
+    registry->allocation = allocation;
+    registry->mapping = NULL;
+    registry->mapping_size = 0;
+
+    if (!tfac_key_registry_init_lock(registry))
+    {
+        free(allocation);
+        return NULL;
+    }
+
+    memset(registry->hash_algos, TFAC_KEY_REGISTRY_FREE, capacity);
+    memset(registry->generations, 1, capacity);
+    memset(registry->sequences, 0x00, (size_t)capacity * sizeof(uint64_t));
+
+    return registry;
+}
+
+void tfac_key_registry_free(struct tfac_key_registry* registry)
+{
+    if (registry == NULL)
+    {
+        return;
+    }
+
+#ifndef _WIN32
+    pthread_mutex_destroy(&registry->lock);
+#endif
+
+    if (registry->mapping != NULL)
+    {
+        // The mapping is private: the keys that were changed since opening it only ever lived in this process' copies of their pages, and those go away with it.
+#ifdef _WIN32
+        UnmapViewOfFile(registry->mapping);
+#else
+        munmap((void*)registry->mapping, registry->mapping_size);
+#endif
+        free(registry->allocation);
+        return;
+    }
+
+    // Don't leave the pre-processed secrets lying around on the heap.
+    memset(registry->inner_states, 0x00, (size_t)registry->capacity * sizeof(registry->inner_states[0]));
+    memset(registry->outer_states, 0x00, (size_t)registry->capacity * sizeof(registry->outer_states[0]));
+
+    free(registry->allocation);
+}
+
+static void tfac_key_registry_lock(struct tfac_key_registry* registry)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&registry->lock);
+#else
+    pthread_mutex_lock(&registry->lock);
+#endif
+}
+
+static void tfac_key_registry_unlock(struct tfac_key_registry* registry)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&registry->lock);
+#else
+    pthread_mutex_unlock(&registry->lock);
+#endif
+}
+
+// Overwrites a slot with the given key (or wipes it, if key is NULL) and generation. Only ever called with the registry locked, so the sequence number can't change in between.
+static void tfac_key_registry_write(struct tfac_key_registry* registry, const uint32_t index, const struct tfac_key* key, const uint8_t generation)
+{
+    uint64_t* sequence = &registry->sequences[index];
+    const uint64_t s = tfac_atomic_load(sequence);
+
+    tfac_atomic_cas(sequence, s, s + 1);
+    tfac_atomic_fence();
+
+    if (key != NULL)
+    {
+        memcpy(registry->inner_states[index], key->inner_state, sizeof(key->inner_state));
+        memcpy(registry->outer_states[index], key->outer_state, sizeof(key->outer_state));
+        registry->hash_algos[index] = (uint8_t)key->hash_algo;
+    }
+    else
+    {
+        memset(registry->inner_states[index], 0x00, sizeof(registry->inner_states[index]));
+        memset(registry->outer_states[index], 0x00, sizeof(registry->outer_states[index]));
+        registry->hash_algos[index] = TFAC_KEY_REGISTRY_FREE;
+    }
+
+    registry->generations[index] = generation;
+
+    tfac_atomic_cas(sequence, s + 1, s + 2);
+}
+
+uint32_t tfac_key_registry_register_key(struct tfac_key_registry* registry, const struct tfac_key* key)
+{
+    if (registry == NULL || key == NULL || (uint32_t)key->hash_algo > TFAC_SHA256)
+    {
+        return 0;
+    }
+
+    tfac_key_registry_lock(registry);
+
+    uint32_t index;
+
+    if (registry->free_count > 0)
+    {
+        index = registry->free_slots[--registry->free_count];
+    }
+    else if (registry->used_count < registry->capacity)
+    {
+        index = registry->used_count++;
+    }
+    else
+    {
+        tfac_key_registry_unlock(registry);
+        return 0;
+    }
+
+    tfac_key_registry_write(registry, index, key, registry->generations[index]);
+
+    const uint32_t handle = ((uint32_t)registry->generations[index] << TFAC_KEY_REGISTRY_INDEX_BITS) | index;
+
+    tfac_key_registry_unlock(registry);
+
+    return handle;
+}
+
+uint32_t tfac_key_registry_register(struct tfac_key_registry* registry, const char* secret_key_base32, const enum tfac_hash_algo hash_algo)
+{
+    if (registry == NULL || secret_key_base32 == NULL)
+    {
+        return 0;
+    }
+
+    struct tfac_key key = tfac_key_init_base32(secret_key_base32, hash_algo);
+    const uint32_t handle = tfac_key_registry_register_key(registry, &key);
+
+    memset(&key, 0x00, sizeof(key));
+    return handle;
+}
+
+// Resolves a handle to its slot index for writers (with the registry locked): returns TFAC_KEY_REGISTRY_MAX_CAPACITY for handles that are invalid (or have been unregistered in the meantime).
+static uint32_t tfac_key_registry_index(const struct tfac_key_registry* registry, const uint32_t handle)
+{
+    const uint32_t index = handle & (TFAC_KEY_REGISTRY_MAX_CAPACITY - 1);
+
+    if (registry == NULL || index >= registry->capacity || registry->hash_algos[index] == TFAC_KEY_REGISTRY_FREE || registry->generations[index] != handle >> TFAC_KEY_REGISTRY_INDEX_BITS)
+    {
+        return TFAC_KEY_REGISTRY_MAX_CAPACITY;
+    }
+
+    return index;
+}
+
+// Copies a slot's key out of the registry without taking the lock: if a writer changed the slot in the meantime, it's simply read again,
+// so readers never see half of an old key and half of a new one. Returns the slot's generation (0 if it's free), and the sequence number that the copy belongs to in *sequence.
+static uint8_t tfac_key_registry_read_slot(const struct tfac_key_registry* registry, const uint32_t index, struct tfac_key* key, uint64_t* sequence)
+{
+    for (;;)
+    {
+        const uint64_t before = tfac_atomic_load(&registry->sequences[index]);
+        const uint8_t generation = registry->hash_algos[index] != TFAC_KEY_REGISTRY_FREE ? registry->generations[index] : 0;
+
+        if (generation != 0)
+        {
+            memcpy(key->inner_state, registry->inner_states[index], sizeof(key->inner_state));
+            memcpy(key->outer_state, registry->outer_states[index], sizeof(key->outer_state));
+            key->hash_algo = (enum tfac_hash_algo)registry->hash_algos[index];
+        }
+
+        tfac_atomic_fence();
+
+        if ((before & 1) == 0 && tfac_atomic_load(&registry->sequences[index]) == before)
+        {
+            *sequence = before;
+            return generation;
+        }
+    }
+}
+
+// Copies a handle's key out of the registry (see tfac_key_registry_read_slot()): returns 0 for handles that are invalid (or have been unregistered in the meantime).
+static uint8_t tfac_key_registry_read(const struct tfac_key_registry* registry, const uint32_t handle, struct tfac_key* key)
+{
+    const uint32_t index = handle & (TFAC_KEY_REGISTRY_MAX_CAPACITY - 1);
+
+    if (registry == NULL || index >= registry->capacity)
+    {
+        return 0;
+    }
+
+    uint64_t sequence;
+    const uint8_t generation = tfac_key_registry_read_slot(registry, index, key, &sequence);
+
+    return generation != 0 && generation == handle >> TFAC_KEY_REGISTRY_INDEX_BITS;
+}
+
+uint8_t tfac_key_registry_unregister(struct tfac_key_registry* registry, const uint32_t handle)
+{
+    if (registry == NULL)
+    {
+        return 0;
+    }
+
+    tfac_key_registry_lock(registry);
+
+    const uint32_t index = tfac_key_registry_index(registry, handle);
+
+    if (index == TFAC_KEY_REGISTRY_MAX_CAPACITY)
+    {
+        tfac_key_registry_unlock(registry);
+        return 0;
+    }
+
+    // Generation 0 is skipped, so that no valid handle is ever 0.
+    tfac_key_registry_write(registry, index, NULL, registry->generations[index] == UINT8_MAX ? 1 : registry->generations[index] + 1);
+    registry->free_slots[registry->free_count++] = index;
+
+    tfac_key_registry_unlock(registry);
+    return 1;
+}
+
+uint8_t tfac_key_registry_replace_key(struct tfac_key_registry* registry, const uint32_t handle, const struct tfac_key* key)
+{
+    if (registry == NULL || key == NULL || (uint32_t)key->hash_algo > TFAC_SHA256)
+    {
+        return 0;
+    }
+
+    tfac_key_registry_lock(registry);
+
+    const uint32_t index = tfac_key_registry_index(registry, handle);
+
+    if (index == TFAC_KEY_REGISTRY_MAX_CAPACITY)
+    {
+        tfac_key_registry_unlock(registry);
+        return 0;
+    }
+
+    tfac_key_registry_write(registry, index, key, registry->generations[index]);
+
+    tfac_key_registry_unlock(registry);
+    return 1;
+}
+
+uint8_t tfac_key_registry_replace(struct tfac_key_registry* registry, const uint32_t handle, const char* secret_key_base32, const enum tfac_hash_algo hash_algo)
+{
+    if (registry == NULL || secret_key_base32 == NULL)
+    {
+        return 0;
+    }
+
+    struct tfac_key key = tfac_key_init_base32(secret_key_base32, hash_algo);
+    const uint8_t r = tfac_key_registry_replace_key(registry, handle, &key);
+
+    memset(&key, 0x00, sizeof(key));
+    return r;
+}
+
+struct tfac_token tfac_key_registry_hotp(const struct tfac_key_registry* registry, const uint32_t handle, const uint8_t digits, const uint64_t counter)
+{
+    struct tfac_token out;
+    memset(&out, 0x00, sizeof(out));
+
+    struct tfac_key key;
+
+    if (!tfac_key_registry_read(registry, handle, &key))
+    {
+        return out;
+    }
+
+    out.number = tfac_hotp_key(&key, digits, counter);
+    snprintf(out.string, sizeof(out.string), DIGITS_FORMAT[TFAC_MIN(TFAC_MAX_DIGITS, digits)], out.number);
+
+    return out;
+}
+
+struct tfac_token tfac_key_registry_totp(const struct tfac_key_registry* registry, const uint32_t handle, const uint8_t digits, const uint8_t steps)
+{
+    return tfac_key_registry_hotp(registry, handle, digits, (uint64_t)(time(0) / steps));
+}
+
+uint8_t tfac_key_registry_verify_totp(const struct tfac_key_registry* registry, const uint32_t handle, const char* totp, const uint8_t digits, const uint8_t steps)
+{
+    struct tfac_key key;
+
+    if (!tfac_key_registry_read(registry, handle, &key))
+    {
+        return 0;
+    }
+
+    return tfac_verify_totp_key(&key, totp, digits, steps);
+}
+
+void tfac_key_registry_totp_many(const struct tfac_key_registry* registry, const uint32_t* handles, const size_t count, const uint8_t digits, const uint8_t steps, const time_t utc, uint64_t* out)
+{
+    if (registry == NULL || handles == NULL || out == NULL)
+    {
+        return;
+    }
+
+    struct tfac_key keys[TFAC_RAW_MANY_CHUNK_SIZE];
+    uint8_t valid[TFAC_RAW_MANY_CHUNK_SIZE];
+
+    for (size_t i = 0; i < count; i += TFAC_RAW_MANY_CHUNK_SIZE)
+    {
+        const size_t n = TFAC_MIN(count - i, TFAC_RAW_MANY_CHUNK_SIZE);
+
+        // Gather the chunk's keys out of the arrays (invalid handles get an all-zero placeholder key, whose token is overwritten right after).
+        for (size_t j = 0; j < n; j++)
+        {
+            valid[j] = tfac_key_registry_read(registry, handles[i + j], &keys[j]);
+
+            if (!valid[j])
+            {
+                memset(&keys[j], 0x00, sizeof(keys[j]));
+            }
+        }
+
+        tfac_totp_key_batch(keys, n, digits, steps, utc, out + i);
+
+        for (size_t j = 0; j < n; j++)
+        {
+            if (!valid[j])
+            {
+                out[i + j] = UINT64_MAX;
+            }
+        }
+    }
+
+    memset(keys, 0x00, sizeof(keys));
+}
+
+// Checksum over the registry's arrays (SipHash-2-4 with an all-zero key: this is about catching corrupted files, not forged ones).
+static uint64_t tfac_key_store_checksum(const struct tfac_key_registry* registry)
+{
+    const uint64_t zero_key[2] = { 0, 0 };
+    uint64_t checksums[4];
+
+    checksums[0] = tfac_siphash(zero_key, registry->inner_states, (size_t)registry->capacity * sizeof(registry->inner_states[0]));
+    checksums[1] = tfac_siphash(zero_key, registry->outer_states, (size_t)registry->capacity * sizeof(registry->outer_states[0]));
+    checksums[2] = tfac_siphash(zero_key, registry->hash_algos, registry->capacity);
+    checksums[3] = tfac_siphash(zero_key, registry->generations, registry->capacity);
+
+    return tfac_siphash(zero_key, checksums, sizeof(checksums));
+}
+
+static uint8_t tfac_key_store_write_padded(FILE* file, const void* data, const size_t length)
+{
+    static const uint8_t padding[64] = { 0x00 };
+    return fwrite(data, 1, length, file) == length && fwrite(padding, 1, TFAC_ALIGN_64(length) - length, file) == TFAC_ALIGN_64(length) - length;
+}
+
+// Creates the file that a key store (or delta) is written to before it's renamed over path (see tfac_key_store_commit()): *tmp_path has to be freed afterwards.
+static FILE* tfac_key_store_create(const char* path, char** tmp_path)
+{
+    const size_t tmp_path_length = strlen(path) + 5;
+    *tmp_path = malloc(tmp_path_length);
+
+    if (*tmp_path == NULL)
+    {
+        return NULL;
+    }
+
+    snprintf(*tmp_path, tmp_path_length, "%s.tmp", path);
+
+#ifdef _WIN32
+    FILE* file = fopen(*tmp_path, "wb");
+#else
+    // Only readable by the owner: the file holds the keys' midstates, which are as good as the secrets themselves
+    // (fchmod() takes care of leftover temporary files from earlier, failed attempts, which O_CREAT would leave as they are).
+    const int fd = open(*tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE* file = fd != -1 && fchmod(fd, 0600) == 0 ? fdopen(fd, "wb") : NULL;
+
+    if (fd != -1 && file == NULL)
+    {
+        close(fd);
+    }
+#endif
+
+    if (file == NULL)
+    {
+        free(*tmp_path);
+        *tmp_path = NULL;
+    }
+
+    return file;
+}
+
+// Fsyncs and closes a file that was opened with tfac_key_store_create(), and renames it over path: processes that read it never see a half-written one.
+// If r is 0 (writing it failed) or any of this fails, the file is removed again. Frees tmp_path either way.
+static uint8_t tfac_key_store_commit(FILE* file, char* tmp_path, const char* path, uint8_t r)
+{
+    r = r && fflush(file) == 0;
+#ifdef _WIN32
+    r = r && _commit(_fileno(file)) == 0;
+#else
+    r = r && fsync(fileno(file)) == 0;
+#endif
+    r = fclose(file) == 0 && r;
+
+    if (r)
+    {
+#ifdef _WIN32
+        r = MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        r = rename(tmp_path, path) == 0;
+#endif
+    }
+
+    if (!r)
+    {
+        remove(tmp_path);
+    }
+
+    free(tmp_path);
+    return r;
+}
+
+uint8_t tfac_key_registry_save(struct tfac_key_registry* registry, const char* path)
+{
+    if (registry == NULL || path == NULL)
+    {
+        return 0;
+    }
+
+    char* tmp_path;
+    FILE* file = tfac_key_store_create(path, &tmp_path);
+
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    // All of the slots are saved (the free ones too), so that the opened registry has just as much room for new keys as this one
+    // (the free slot list isn't saved: tfac_key_registry_open() rebuilds it out of the hash algos).
+    const uint32_t capacity = registry->capacity;
+    const size_t arrays_size = tfac_key_registry_arrays_size(capacity);
+    uint8_t* arrays = malloc(arrays_size);
+
+    if (arrays == NULL)
+    {
+        return tfac_key_store_commit(file, tmp_path, path, 0);
+    }
+
+    // The file is a consistent snapshot of the registry: keys that are registered (or unregistered) in the meantime
+    // only have to wait for the arrays to be copied, not for the copy to be written to disk.
+    struct tfac_key_registry snapshot;
+    tfac_key_registry_place_arrays(&snapshot, arrays, capacity);
+    snapshot.capacity = capacity;
+
+    tfac_key_registry_lock(registry);
+
+    memcpy(arrays, registry->inner_states, arrays_size);
+    const uint32_t used_count = registry->used_count;
+
+    tfac_key_registry_unlock(registry);
+
+    struct tfac_key_store_header header;
+    memset(&header, 0x00, sizeof(header));
+    memcpy(header.magic, TFAC_KEY_STORE_MAGIC, sizeof(header.magic));
+    header.version = TFAC_KEY_STORE_VERSION;
+    header.capacity = capacity;
+    header.used_count = used_count;
+    header.header_size = sizeof(header);
+    header.byte_order = TFAC_KEY_STORE_BYTE_ORDER;
+    header.checksum = tfac_key_store_checksum(&snapshot);
+
+    // The padding in between the arrays is written as zeros, rather than whatever the heap had lying around in there.
+    const uint8_t r = fwrite(&header, sizeof(header), 1, file) == 1
+        && tfac_key_store_write_padded(file, snapshot.inner_states, (size_t)capacity * sizeof(snapshot.inner_states[0]))
+        && tfac_key_store_write_padded(file, snapshot.outer_states, (size_t)capacity * sizeof(snapshot.outer_states[0]))
+        && tfac_key_store_write_padded(file, snapshot.hash_algos, capacity)
+        && tfac_key_store_write_padded(file, snapshot.generations, capacity);
+
+    memset(arrays, 0x00, arrays_size);
+    free(arrays);
+
+    return tfac_key_store_commit(file, tmp_path, path, r);
+}
+
+struct tfac_key_registry* tfac_key_registry_open(const char* path, const uint8_t verify_checksum)
+{
+    if (path == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t* mapping = NULL;
+    size_t mapping_size = 0;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+
+    LARGE_INTEGER file_size;
+    HANDLE file_mapping = GetFileSizeEx(file, &file_size) && file_size.QuadPart >= (LONGLONG)sizeof(struct tfac_key_store_header) ? CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL) : NULL;
+
+    if (file_mapping != NULL)
+    {
+        mapping = (uint8_t*)MapViewOfFile(file_mapping, FILE_MAP_COPY, 0, 0, 0);
+        mapping_size = (size_t)file_size.QuadPart;
+        CloseHandle(file_mapping);
+    }
+
+    CloseHandle(file);
+#else
+    const int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    struct stat file_info;
+
+    if (fstat(fd, &file_info) == 0 && (size_t)file_info.st_size >= sizeof(struct tfac_key_store_header))
+    {
+        // Private (copy-on-write): every process that opens the same key store shares its pages in the page cache,
+        // until it changes a key in there, which only ever copies that one page (the file itself is never written to).
+        void* m = mmap(NULL, (size_t)file_info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+        if (m != MAP_FAILED)
+        {
+            mapping = (uint8_t*)m;
+            mapping_size = (size_t)file_info.st_size;
+        }
+    }
+
+    close(fd);
+#endif
+
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+
+    const struct tfac_key_store_header* header = (const struct tfac_key_store_header*)mapping;
+    struct tfac_key_registry* registry = NULL;
+
+    const uint8_t valid = memcmp(header->magic, TFAC_KEY_STORE_MAGIC, sizeof(header->magic)) == 0
+        && header->version == TFAC_KEY_STORE_VERSION
+        && header->header_size == sizeof(struct tfac_key_store_header)
+        && header->byte_order == TFAC_KEY_STORE_BYTE_ORDER
+        && header->capacity > 0
+        && header->capacity <= TFAC_KEY_REGISTRY_MAX_CAPACITY
+        && header->used_count <= header->capacity
+        && mapping_size == sizeof(struct tfac_key_store_header) + tfac_key_registry_arrays_size(header->capacity);
+
+    const uint8_t* hash_algos = valid ? mapping + sizeof(struct tfac_key_store_header) + 2 * TFAC_ALIGN_64((size_t)header->capacity * 8 * sizeof(uint32_t)) : NULL;
+    uint32_t free_count = 0;
+
+    // Unlike the checksum, this is always done (and can't be forged around): the hash algos are used as array indices further down the line.
+    // It's just one byte per slot, though, and counts the free slots along the way.
+    for (uint32_t i = 0; valid && i < header->capacity; i++)
+    {
+        if (hash_algos[i] == TFAC_KEY_REGISTRY_FREE)
+        {
+            free_count += i < header->used_count;
+        }
+        else if (hash_algos[i] > TFAC_SHA256)
+        {
+            free_count = UINT32_MAX;
+            break;
+        }
+    }
+
+    if (valid && free_count != UINT32_MAX)
+    {
+        // The sequence numbers and free slot list aren't part of the file: calloc() hands out fresh (and lazily zeroed) pages for large ones, so this doesn't take any longer for bigger key stores.
+        registry = calloc(1, sizeof(struct tfac_key_registry) + (size_t)header->capacity * (sizeof(uint64_t) + sizeof(uint32_t)));
+    }
+
+    if (registry != NULL)
+    {
+        // Mappings are page-aligned, so the arrays right after the (64-byte) header are cache-line aligned too.
+        tfac_key_registry_place_arrays(registry, mapping + sizeof(struct tfac_key_store_header), header->capacity);
+        registry->sequences = (uint64_t*)(registry + 1);
+        registry->free_slots = (uint32_t*)(registry->sequences + header->capacity);
+        registry->free_count = 0;
+
+        // Rebuild the free slot list out of the slots that were unregistered before the registry was saved.
+        for (uint32_t i = 0; i < header->used_count && registry->free_count < free_count; i++)
+        {
+            if (hash_algos[i] == TFAC_KEY_REGISTRY_FREE)
+            {
+                registry->free_slots[registry->free_count++] = i;
+            }
+        }
+
+        registry->used_count = header->used_count;
+        registry->capacity = header->capacity;
+        registry->allocation = registry;
+        registry->mapping = mapping;
+        registry->mapping_size = mapping_size;
+
+        if (!tfac_key_registry_init_lock(registry))
+        {
+            free(registry);
+            registry = NULL;
+        }
+        else if (verify_checksum && tfac_key_store_checksum(registry) != header->checksum)
+        {
+#ifndef _WIN32
+            pthread_mutex_destroy(&registry->lock);
+#endif
+            free(registry);
+            registry = NULL;
+        }
+    }
+
+    if (registry == NULL)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(mapping);
+#else
+        munmap(mapping, mapping_size);
+#endif
+    }
+
+    return registry;
+}
+
+// Checksum over a key delta file's records (see tfac_key_store_checksum()).
+static uint64_t tfac_key_delta_checksum(const struct tfac_key_delta_record* records, const uint32_t record_count)
+{
+    const uint64_t zero_key[2] = { 0, 0 };
+    return tfac_siphash(zero_key, records, (size_t)record_count * sizeof(struct tfac_key_delta_record));
+}
+
+uint8_t tfac_key_registry_save_delta(struct tfac_key_registry* registry, const struct tfac_key_registry* base, const char* path)
+{
+    if (registry == NULL || base == NULL || path == NULL || registry->capacity != base->capacity)
+    {
+        return 0;
+    }
+
+    char* tmp_path;
+    FILE* file = tfac_key_store_create(path, &tmp_path);
+
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    // Only the scan runs with the registry locked (it reads the arrays just once, like copying them would): the records are written out after unlocking.
+    tfac_key_registry_lock(registry);
+
+    // Most deltas are tiny compared to their registries: start out small and grow as needed.
+    uint32_t record_count = 0;
+    uint32_t record_capacity = 64;
+    struct tfac_key_delta_record* records = malloc(record_capacity * sizeof(struct tfac_key_delta_record));
+    uint8_t r = records != NULL;
+
+    for (uint32_t i = 0; r && i < registry->capacity; i++)
+    {
+        const uint8_t changed = registry->hash_algos[i] != base->hash_algos[i]
+            || registry->generations[i] != base->generations[i]
+            || memcmp(registry->inner_states[i], base->inner_states[i], sizeof(registry->inner_states[i])) != 0
+            || memcmp(registry->outer_states[i], base->outer_states[i], sizeof(registry->outer_states[i])) != 0;
+
+        if (!changed)
+        {
+            continue;
+        }
+
+        if (record_count == record_capacity)
+        {
+            struct tfac_key_delta_record* grown = malloc((size_t)record_capacity * 2 * sizeof(struct tfac_key_delta_record));
+
+            if (grown == NULL)
+            {
+                r = 0;
+                break;
+            }
+
+            // Not realloc(): the old records hold secrets, and have to be wiped before they're released.
+            memcpy(grown, records, (size_t)record_count * sizeof(struct tfac_key_delta_record));
+            memset(records, 0x00, (size_t)record_count * sizeof(struct tfac_key_delta_record));
+            free(records);
+
+            records = grown;
+            record_capacity *= 2;
+        }
+
+        struct tfac_key_delta_record* record = &records[record_count++];
+        memset(record, 0x00, sizeof(*record));
+        memcpy(record->inner_state, registry->inner_states[i], sizeof(record->inner_state));
+        memcpy(record->outer_state, registry->outer_states[i], sizeof(record->outer_state));
+        record->index = i;
+        record->hash_algo = registry->hash_algos[i];
+        record->generation = registry->generations[i];
+    }
+
+    tfac_key_registry_unlock(registry);
+
+    if (r)
+    {
+        struct tfac_key_delta_header header;
+        memset(&header, 0x00, sizeof(header));
+        memcpy(header.magic, TFAC_KEY_DELTA_MAGIC, sizeof(header.magic));
+        header.version = TFAC_KEY_DELTA_VERSION;
+        header.record_count = record_count;
+        header.capacity = registry->capacity;
+        header.header_size = sizeof(header);
+        header.byte_order = TFAC_KEY_STORE_BYTE_ORDER;
+        header.record_size = sizeof(struct tfac_key_delta_record);
+        header.checksum = tfac_key_delta_checksum(records, record_count);
+
+        r = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(records, sizeof(struct tfac_key_delta_record), record_count, file) == record_count;
+    }
+
+    if (records != NULL)
+    {
+        memset(records, 0x00, (size_t)record_count * sizeof(struct tfac_key_delta_record));
+        free(records);
+    }
+
+    return tfac_key_store_commit(file, tmp_path, path, r);
+}
+
+// Applies one delta record to the registry (which has to be locked), keeping its free slot list in sync with the slot's new state.
+static void tfac_key_registry_apply_record(struct tfac_key_registry* registry, const struct tfac_key_delta_record* record)
+{
+    const uint32_t index = record->index;
+    uint8_t listed = 0;
+
+    if (index >= registry->used_count)
+    {
+        // The slots that are skipped over become free ones (just like unregistered slots).
+        for (uint32_t i = registry->used_count; i < index; i++)
+        {
+            registry->free_slots[registry->free_count++] = i;
+        }
+
+        registry->used_count = index + 1;
+    }
+    else
+    {
+        listed = registry->hash_algos[index] == TFAC_KEY_REGISTRY_FREE;
+    }
+
+    struct tfac_key key;
+    memcpy(key.inner_state, record->inner_state, sizeof(key.inner_state));
+    memcpy(key.outer_state, record->outer_state, sizeof(key.outer_state));
+    key.hash_algo = (enum tfac_hash_algo)record->hash_algo;
+
+    const uint8_t free_slot = record->hash_algo == TFAC_KEY_REGISTRY_FREE;
+    tfac_key_registry_write(registry, index, free_slot ? NULL : &key, record->generation);
+    memset(&key, 0x00, sizeof(key));
+
+    if (free_slot && !listed)
+    {
+        registry->free_slots[registry->free_count++] = index;
+    }
+    else if (!free_slot && listed)
+    {
+        // Slots are mostly freed (and then taken again) in the same order: search from the end of the list.
+        for (uint32_t i = registry->free_count; i-- > 0;)
+        {
+            if (registry->free_slots[i] == index)
+            {
+                registry->free_slots[i] = registry->free_slots[--registry->free_count];
+                break;
+            }
+        }
+    }
+}
+
+uint8_t tfac_key_registry_apply_delta(struct tfac_key_registry* registry, const char* path)
+{
+    if (registry == NULL || path == NULL)
+    {
+        return 0;
+    }
+
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    struct tfac_key_delta_header header;
+    struct tfac_key_delta_record* records = NULL;
+
+    uint8_t r = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, TFAC_KEY_DELTA_MAGIC, sizeof(header.magic)) == 0
+        && header.version == TFAC_KEY_DELTA_VERSION
+        && header.header_size == sizeof(header)
+        && header.byte_order == TFAC_KEY_STORE_BYTE_ORDER
+        && header.record_size == sizeof(struct tfac_key_delta_record)
+        && header.capacity == registry->capacity
+        && header.record_count <= header.capacity;
+
+    if (r && header.record_count > 0)
+    {
+        records = malloc((size_t)header.record_count * sizeof(struct tfac_key_delta_record));
+        r = records != NULL && fread(records, sizeof(struct tfac_key_delta_record), header.record_count, file) == header.record_count;
+    }
+
+    // Trailing garbage means that this isn't the file that was written by tfac_key_registry_save_delta().
+    r = r && fgetc(file) == EOF;
+    fclose(file);
+
+    r = r && tfac_key_delta_checksum(records, header.record_count) == header.checksum;
+
+    // Check all of the records before applying any of them: a delta is applied either as a whole or not at all.
+    for (uint32_t i = 0; r && i < header.record_count; i++)
+    {
+        r = records[i].index < registry->capacity && records[i].generation != 0 && (records[i].hash_algo <= TFAC_SHA256 || records[i].hash_algo == TFAC_KEY_REGISTRY_FREE);
+    }
+
+    if (r)
+    {
+        // Readers keep going while the delta is applied: they only ever retry reading a slot that is being written at that very moment.
+        tfac_key_registry_lock(registry);
+
+        for (uint32_t i = 0; i < header.record_count; i++)
+        {
+            tfac_key_registry_apply_record(registry, &records[i]);
+        }
+
+        tfac_key_registry_unlock(registry);
+    }
+
+    if (records != NULL)
+    {
+        memset(records, 0x00, (size_t)header.record_count * sizeof(struct tfac_key_delta_record));
+        free(records);
+    }
+
+    return r;
+}
+
+static uint64_t tfac_now_ns()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Computes the tokens of all of the registry's keys for the given step into that step's row (with the multi-lane batch HMAC path).
+static void tfac_token_cache_compute_row(struct tfac_token_cache* cache, const uint64_t step)
+{
+    const size_t row = (size_t)(step % TFAC_TOKEN_CACHE_ROWS);
+    uint64_t* entries = cache->entries + row * cache->capacity;
+
+    // Take the row out of service first: lookups of the step that it held until now miss from here on (that step is out of the verification window by now anyway).
+    tfac_atomic_store(&cache->row_steps[row], UINT64_MAX);
+
+    struct tfac_key keys[TFAC_RAW_MANY_CHUNK_SIZE];
+    uint64_t counters[TFAC_RAW_MANY_CHUNK_SIZE];
+    uint64_t sequences[TFAC_RAW_MANY_CHUNK_SIZE];
+    uint64_t tokens[TFAC_RAW_MANY_CHUNK_SIZE];
+    uint8_t generations[TFAC_RAW_MANY_CHUNK_SIZE];
+
+    // Slots past the used ones have never held a key: their entries are still 0 (and keys registered into them while this runs are computed on demand until the next row).
+    const uint32_t used_count = *(volatile const uint32_t*)&cache->registry->used_count;
+
+    for (uint32_t i = 0; i < used_count; i += TFAC_RAW_MANY_CHUNK_SIZE)
+    {
+        const uint32_t n = TFAC_MIN(used_count - i, TFAC_RAW_MANY_CHUNK_SIZE);
+
+        for (uint32_t j = 0; j < n; j++)
+        {
+            generations[j] = tfac_key_registry_read_slot(cache->registry, i + j, &keys[j], &sequences[j]);
+            counters[j] = step;
+
+            if (generations[j] == 0)
+            {
+                memset(&keys[j], 0x00, sizeof(keys[j]));
+            }
+        }
+
+        tfac_hotp_key_batch(keys, counters, n, cache->digits, tokens);
+
+        for (uint32_t j = 0; j < n; j++)
+        {
+            tfac_atomic_store(&entries[i + j], generations[j] == 0 ? 0 : tokens[j] | (sequences[j] & 0xFFFFFF) << 32 | (uint64_t)generations[j] << 56);
+        }
+    }
+
+    memset(keys, 0x00, sizeof(keys));
+
+    tfac_atomic_store(&cache->row_steps[row], step);
+    tfac_atomic_store(&cache->tokens_computed, tfac_atomic_load(&cache->tokens_computed) + used_count);
+}
+
+void tfac_token_cache_refresh(struct tfac_token_cache* cache, const time_t utc)
+{
+    // Only one thread refreshes at a time: the others (if any) have nothing left to do once it's done.
+    if (cache == NULL || !tfac_atomic_cas(&cache->refreshing, 0, 1))
+    {
+        return;
+    }
+
+    const uint64_t current = (uint64_t)(utc / cache->steps);
+    const uint64_t start = tfac_now_ns();
+    uint64_t rows = 0;
+
+    // The current step first (that's where most tokens are looked up), then the previous and the next one, and then the one after that:
+    // that way, crossing into the next step never leaves a hole in the verification window.
+    const uint64_t wanted[TFAC_TOKEN_CACHE_ROWS] = { current, current - 1, current + 1, current + 2 };
+
+    for (size_t i = 0; i < TFAC_TOKEN_CACHE_ROWS; i++)
+    {
+        if (tfac_atomic_load(&cache->row_steps[wanted[i] % TFAC_TOKEN_CACHE_ROWS]) != wanted[i])
+        {
+            tfac_token_cache_compute_row(cache, wanted[i]);
+            rows++;
+        }
+    }
+
+    if (rows != 0)
+    {
+        tfac_atomic_store(&cache->rows_computed, tfac_atomic_load(&cache->rows_computed) + rows);
+        tfac_atomic_store(&cache->refresh_ns, tfac_atomic_load(&cache->refresh_ns) + (tfac_now_ns() - start));
+    }
+
+    tfac_atomic_cas(&cache->refreshing, 1, 0);
+}
+
+static void tfac_token_cache_run(struct tfac_token_cache* cache)
+{
+    while (!tfac_atomic_load(&cache->stop))
+    {
+        tfac_token_cache_refresh(cache, time(0));
+
+#ifdef _WIN32
+        Sleep(TFAC_TOKEN_CACHE_POLL_MS);
+#else
+        const struct timespec poll_interval = { 0, TFAC_TOKEN_CACHE_POLL_MS * 1000000L };
+        nanosleep(&poll_interval, NULL);
+#endif
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI tfac_token_cache_thread_main(LPVOID cache)
+{
+    tfac_token_cache_run((struct tfac_token_cache*)cache);
+    return 0;
+}
+#else
+static void* tfac_token_cache_thread_main(void* cache)
+{
+    tfac_token_cache_run((struct tfac_token_cache*)cache);
+    return NULL;
+}
+#endif
+
+struct tfac_token_cache* tfac_token_cache_new(const struct tfac_key_registry* registry, const uint8_t digits, const uint8_t steps, const uint8_t background_refresh)
+{
+    // Entries only have room for 32-bit tokens.
+    if (registry == NULL || digits == 0 || digits > 9 || steps == 0)
+    {
+        return NULL;
+    }
+
+    const size_t header_size = TFAC_ALIGN_64(sizeof(struct tfac_token_cache));
+    const size_t counters_size = TFAC_TOKEN_CACHE_COUNTER_STRIPES * sizeof(struct tfac_token_cache_counter);
+
+    // calloc(): the rows' pages are only ever touched for the slots that are in use.
+    void* allocation = calloc(1, 63 + header_size + counters_size + (size_t)TFAC_TOKEN_CACHE_ROWS * registry->capacity * sizeof(uint64_t));
+
+    if (allocation == NULL)
+    {
+        return NULL;
+    }
+
+    struct tfac_token_cache* cache = (struct tfac_token_cache*)(((uintptr_t)allocation + 63) & ~(uintptr_t)63);
+
+    cache->registry = registry;
+    cache->counters = (struct tfac_token_cache_counter*)((uint8_t*)cache + header_size);
+    cache->entries = (uint64_t*)((uint8_t*)cache->counters + counters_size);
+    cache->capacity = registry->capacity;
+    cache->digits = digits;
+    cache->steps = steps;
+    cache->allocation = allocation;
+
+    for (size_t i = 0; i < TFAC_TOKEN_CACHE_ROWS; i++)
+    {
+        cache->row_steps[i] = UINT64_MAX;
+    }
+
+    if (background_refresh)
+    {
+#ifdef _WIN32
+        cache->thread = CreateThread(NULL, 0, tfac_token_cache_thread_main, cache, 0, NULL);
+        cache->thread_started = cache->thread != NULL;
+#else
+        cache->thread_started = pthread_create(&cache->thread, NULL, tfac_token_cache_thread_main, cache) == 0;
+#endif
+
+        if (!cache->thread_started)
+        {
+            free(allocation);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+void tfac_token_cache_free(struct tfac_token_cache* cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    if (cache->thread_started)
+    {
+        tfac_atomic_cas(&cache->stop, 0, 1);
+#ifdef _WIN32
+        WaitForSingleObject(cache->thread, INFINITE);
+        CloseHandle(cache->thread);
+#else
+        pthread_join(cache->thread, NULL);
+#endif
+    }
+
+    // The tokens of the current steps are as good as the secrets for as long as they're valid.
+    memset(cache->entries, 0x00, (size_t)TFAC_TOKEN_CACHE_ROWS * cache->capacity * sizeof(uint64_t));
+
+    free(cache->allocation);
+}
+
+// Looks up the cached token of a slot for the given step: returns 0 if it isn't cached, or if it was computed for a different key (or generation) than tag's.
+static uint8_t tfac_token_cache_lookup(const struct tfac_token_cache* cache, const uint32_t index, const uint64_t tag, const uint64_t step, uint64_t* token)
+{
+    const size_t row = (size_t)(step % TFAC_TOKEN_CACHE_ROWS);
+
+    if (tfac_atomic_load(&cache->row_steps[row]) != step)
+    {
+        return 0;
+    }
+
+    const uint64_t entry = tfac_atomic_load(&cache->entries[row * cache->capacity + index]);
+
+    // The row may have been taken out of service (to be refilled for a later step) right after checking it.
+    if (tfac_atomic_load(&cache->row_steps[row]) != step || (entry & ~(uint64_t)UINT32_MAX) != tag)
+    {
+        return 0;
+    }
+
+    *token = entry & UINT32_MAX;
+    return 1;
+}
+
+static void tfac_token_cache_count(uint64_t* counter)
+{
+    uint64_t n;
+
+    do
+    {
+        n = tfac_atomic_load(counter);
+    } while (!tfac_atomic_cas(counter, n, n + 1));
+}
+
+uint8_t tfac_token_cache_verify_totp(struct tfac_token_cache* cache, const uint32_t handle, const char* totp)
+{
+    if (cache == NULL || totp == NULL || strlen(totp) != cache->digits)
+    {
+        return 0;
+    }
+
+    const uint32_t index = handle & (TFAC_KEY_REGISTRY_MAX_CAPACITY - 1);
+    struct tfac_verifier* verifier = tfac_default_verifier();
+
+    if (verifier == NULL || index >= cache->capacity)
+    {
+        return 0;
+    }
+
+    // The key is still needed for the replay protection fingerprint (and for computing the tokens that aren't cached).
+    struct tfac_key key;
+    uint64_t sequence;
+    const uint8_t generation = tfac_key_registry_read_slot(cache->registry, index, &key, &sequence);
+
+    if (generation == 0 || generation != handle >> TFAC_KEY_REGISTRY_INDEX_BITS)
+    {
+        return 0;
+    }
+
+    const uint64_t tag = (sequence & 0xFFFFFF) << 32 | (uint64_t)generation << 56;
+    const uint64_t tr = strtoull(totp, NULL, 10);
+    const time_t ct = time(0);
+
+    // Same window and order as tfac_match_totp_step(): the current step first, then its neighbours.
+    const uint64_t candidates[3] = { (uint64_t)(ct / cache->steps), (uint64_t)((ct - cache->steps) / cache->steps), (uint64_t)((ct + cache->steps) / cache->steps) };
+
+    uint8_t matched = 0;
+    uint8_t missed = 0;
+    uint64_t step = 0;
+
+    for (size_t i = 0; i < 3 && !matched; i++)
+    {
+        uint64_t token;
+
+        if (!tfac_token_cache_lookup(cache, index, tag, candidates[i], &token))
+        {
+            token = tfac_hotp_key(&key, cache->digits, candidates[i]);
+            missed = 1;
+        }
+
+        matched = token == tr;
+        step = candidates[i];
+    }
+
+    struct tfac_token_cache_counter* counter = &cache->counters[index % TFAC_TOKEN_CACHE_COUNTER_STRIPES];
+    tfac_token_cache_count(missed ? &counter->misses : &counter->hits);
+
+    const uint8_t r = matched && tfac_verifier_accept(verifier, &key, tr, step, cache->steps);
+
+    memset(&key, 0x00, sizeof(key));
+    return r;
+}
+
+struct tfac_token_cache_stats tfac_token_cache_get_stats(const struct tfac_token_cache* cache)
+{
+    struct tfac_token_cache_stats stats;
+    memset(&stats, 0x00, sizeof(stats));
+
+    if (cache == NULL)
+    {
+        return stats;
+    }
+
+    stats.memory = TFAC_ALIGN_64(sizeof(struct tfac_token_cache)) + TFAC_TOKEN_CACHE_COUNTER_STRIPES * sizeof(struct tfac_token_cache_counter) + (size_t)TFAC_TOKEN_CACHE_ROWS * cache->capacity * sizeof(uint64_t);
+
+    for (size_t i = 0; i < TFAC_TOKEN_CACHE_COUNTER_STRIPES; i++)
+    {
+        stats.hits += tfac_atomic_load(&cache->counters[i].hits);
+        stats.misses += tfac_atomic_load(&cache->counters[i].misses);
+    }
+
+    stats.rows_computed = tfac_atomic_load(&cache->rows_computed);
+    stats.tokens_computed = tfac_atomic_load(&cache->tokens_computed);
+    stats.refresh_ns = tfac_atomic_load(&cache->refresh_ns);
+
+    return stats;
 }
 
 static void tfac_dev_urandom(uint8_t* output_buffer, const size_t output_buffer_size)
@@ -114,6 +114,31 @@ struct tfac_secret
     uint8_t secret_key[30];
 };
 
+/**
+ * A pre-processed 2FA secret key, ready for HOTP/TOTP generation. <p>
+ * The HMAC key setup (hashing the secret XOR'ed with the ipad and opad blocks) is done once when initializing this via tfac_key_init() or tfac_key_init_base32(),
+ * and the resulting inner and outer hash states are reused for every token generated with it. <p>
+ * This halves the amount of work needed per token compared to tfac_hotp_raw() and tfac_totp_raw(), so keep these around if you verify tokens for the same secret repeatedly! <p>
+ * Treat instances of this like you would treat the raw secret key (it's just as sensitive).
+ */
+struct tfac_key
+{
+    /**
+     * Hash state after processing the secret key XOR'ed with the HMAC ipad block.
+     */
+    uint32_t inner_state[8];
+
+    /**
+     * Hash state after processing the secret key XOR'ed with the HMAC opad block.
+     */
+    uint32_t outer_state[8];
+
+    /**
+     * The hash algorithm that the above states were computed with.
+     */
+    enum tfac_hash_algo hash_algo;
+};
+
 /**
  * Structure containing TFAC library version information.
  */
@@ -171,6 +196,7 @@ TFAC_API uint64_t tfac_totp_raw(const uint8_t* secret_key, size_t secret_key_len
 
 /**
  * Verifies a TOTP using the given \p secret_key_base32. If the token is validated successfully, it is obliterated and cannot be validated again: further tries will fail.
+ * This is thread-safe: if multiple threads present the same token at the same time, only one of them succeeds.
  * @param secret_key_base32 The 2FA secret (Base32-encoded, NUL-terminated string).
  * @param totp The token to verify.
  * @param digits How many digits the token to validate is supposed to contain.
@@ -180,6 +206,21 @@ TFAC_API uint64_t tfac_totp_raw(const uint8_t* secret_key, size_t secret_key_len
  */
 TFAC_API uint8_t tfac_verify_totp(const char* secret_key_base32, const char* totp, uint8_t digits, uint8_t steps, enum tfac_hash_algo hash_algo);
 
+/**
+ * Verifies a TOTP using the given \p secret_key_base32, with per-credential replay protection as suggested by RFC 6238 (section 5.2) instead of the built-in obliteration table:
+ * a token is only accepted if its time step is newer than the last one that was accepted for this credential. <p>
+ * All it takes is storing one <c>uint64_t</c> per credential (start it out at <c>0</c>). This scales to any amount of users and doesn't hash anything on top of the token itself,
+ * but it also means that once a token was accepted, the ones from the same or earlier steps are rejected (even if they were never used).
+ * @param secret_key_base32 The 2FA secret (Base32-encoded, NUL-terminated string).
+ * @param totp The token to verify.
+ * @param digits How many digits the token to validate is supposed to contain.
+ * @param steps The steps parameter that was used to generate the token.
+ * @param hash_algo The hash algorithm that the token was created with (default is SHA-1: #TFAC_DEFAULT_HASH_ALGO).
+ * @param last_accepted_step The credential's last accepted time step: this is atomically updated on success, so it may be shared between threads (keep it 8-byte aligned).
+ * @return <c>1</c> if the token was valid (and \p last_accepted_step has been moved forward to its step); <c>0</c> if verification failed or if the token's step isn't newer than \p last_accepted_step.
+ */
+TFAC_API uint8_t tfac_verify_totp_step(const char* secret_key_base32, const char* totp, uint8_t digits, uint8_t steps, enum tfac_hash_algo hash_algo, uint64_t* last_accepted_step);
+
 /**
  * Generate an HOTP using a given secret key (which is a base32-encoded, NUL-terminated string).
  * @param secret_key_base32 The base32-encoded, NUL-terminated string containing the secret key to use for generating the token.
@@ -202,6 +243,508 @@ TFAC_API struct tfac_token tfac_hotp(const char* secret_key_base32, uint8_t digi
  */
 TFAC_API uint64_t tfac_hotp_raw(const uint8_t* secret_key, size_t secret_key_length, uint8_t digits, uint64_t counter, enum tfac_hash_algo hash_algo);
 
+/**
+ * Initializes a tfac_key from a raw secret key byte array (does the HMAC key setup once, so that it can be reused for many tokens).
+ * @param secret_key The byte array containing the 2FA secret key.
+ * @param secret_key_length Length of the \p secret_key byte array.
+ * @param hash_algo Which hashing algorithm to use for the <c>HMAC</c>: default is <c>SHA-1</c> (#TFAC_DEFAULT_HASH_ALGO).
+ * @return The initialized tfac_key, ready to be used with tfac_hotp_key(), tfac_totp_key() and tfac_verify_totp_key().
+ */
+TFAC_API struct tfac_key tfac_key_init(const uint8_t* secret_key, size_t secret_key_length, enum tfac_hash_algo hash_algo);
+
+/**
+ * Initializes a tfac_key from a base32-encoded secret key (does the HMAC key setup once, so that it can be reused for many tokens).
+ * @param secret_key_base32 The base32-encoded, NUL-terminated string containing the 2FA secret key.
+ * @param hash_algo Which hashing algorithm to use for the <c>HMAC</c>: default is <c>SHA-1</c> (#TFAC_DEFAULT_HASH_ALGO).
+ * @return The initialized tfac_key, ready to be used with tfac_hotp_key(), tfac_totp_key() and tfac_verify_totp_key().
+ */
+TFAC_API struct tfac_key tfac_key_init_base32(const char* secret_key_base32, enum tfac_hash_algo hash_algo);
+
+/**
+ * Raw HOTP generator function that uses a pre-processed tfac_key (see tfac_hotp_raw() for more details).
+ * @param key The tfac_key to use for generating the token (initialized via tfac_key_init() or tfac_key_init_base32()).
+ * @param digits How many digits should the output token contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param counter The counter value to use for HOTP generation (64-bit unsigned integer).
+ * @return The HOTP token as an unsigned 64-bit integer.
+ */
+TFAC_API uint64_t tfac_hotp_key(const struct tfac_key* key, uint8_t digits, uint64_t counter);
+
+/**
+ * Raw TOTP generator function that uses a pre-processed tfac_key (see tfac_totp_raw() for more details).
+ * @param key The tfac_key to use for generating the token (initialized via tfac_key_init() or tfac_key_init_base32()).
+ * @param digits How many digits should the output token contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param steps The step count: default is 30 seconds (#TFAC_DEFAULT_STEPS).
+ * @param utc The UTC timestamp for which to generate the TOTP. Pass <c>time(0)</c> to generate a currently valid token!
+ * @return The TOTP token as an unsigned 64-bit integer.
+ */
+TFAC_API uint64_t tfac_totp_key(const struct tfac_key* key, uint8_t digits, uint8_t steps, time_t utc);
+
+/**
+ * Computes HOTPs for many keys at once. <p>
+ * On CPUs with AVX2 support, the <c>SHA-1</c> keys are processed eight at a time in parallel (one per SIMD lane),
+ * which is a lot faster than calling tfac_hotp_key() in a loop. With AVX-512F, the same goes for <c>SHA-224</c> and <c>SHA-256</c> keys (sixteen at a time).
+ * On CPUs without these extensions, the keys are simply computed one by one. <p>
+ * Use tfac_key_init() on the raw secrets first to batch what you'd otherwise do with tfac_hotp_raw().
+ * @param keys Array of \p count pre-processed tfac_key instances.
+ * @param counters Array of \p count counter values (<c>counters[i]</c> is used with <c>keys[i]</c>).
+ * @param count How many HOTPs to compute.
+ * @param digits How many digits should the output tokens contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param out Where to write the \p count resulting HOTPs (as unsigned 64-bit integers, just like tfac_hotp_key() returns them).
+ */
+TFAC_API void tfac_hotp_key_batch(const struct tfac_key* keys, const uint64_t* counters, size_t count, uint8_t digits, uint64_t* out);
+
+/**
+ * Computes the TOTPs for many keys at the same point in time (see tfac_hotp_key_batch() for more details).
+ * @param keys Array of \p count pre-processed tfac_key instances.
+ * @param count How many TOTPs to compute.
+ * @param digits How many digits should the output tokens contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param steps The step count: default is 30 seconds (#TFAC_DEFAULT_STEPS).
+ * @param utc The UTC timestamp for which to generate the TOTPs.
+ * @param out Where to write the \p count resulting TOTPs.
+ */
+TFAC_API void tfac_totp_key_batch(const struct tfac_key* keys, size_t count, uint8_t digits, uint8_t steps, time_t utc, uint64_t* out);
+
+/**
+ * Computes HOTPs for many raw secret keys at once (the batched counterpart of tfac_hotp_raw()). <p>
+ * The keys are set up in chunks and then handed to tfac_hotp_key_batch(), so this benefits from the same multi-buffer kernels. <p>
+ * If you compute tokens for the same secrets over and over again, consider keeping their tfac_key instances around instead (see tfac_key_init()).
+ * @param secret_keys Array of \p count pointers to the secret key byte arrays.
+ * @param secret_key_lengths Array of \p count secret key lengths (<c>secret_key_lengths[i]</c> is the length of <c>secret_keys[i]</c>).
+ * @param counters Array of \p count counter values (<c>counters[i]</c> is used with <c>secret_keys[i]</c>).
+ * @param count How many HOTPs to compute.
+ * @param digits How many digits should the output tokens contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param hash_algo Which hashing algorithm to use for the <c>HMAC</c> (the same for the whole batch): default is <c>SHA-1</c> (#TFAC_DEFAULT_HASH_ALGO).
+ * @param out Where to write the \p count resulting HOTPs (as unsigned 64-bit integers, just like tfac_hotp_raw() returns them).
+ */
+TFAC_API void tfac_hotp_raw_many(const uint8_t* const* secret_keys, const size_t* secret_key_lengths, const uint64_t* counters, size_t count, uint8_t digits, enum tfac_hash_algo hash_algo, uint64_t* out);
+
+/**
+ * Computes TOTPs for many raw secret keys at once (the batched counterpart of tfac_totp_raw(): see tfac_hotp_raw_many() for more details).
+ * @param secret_keys Array of \p count pointers to the secret key byte arrays.
+ * @param secret_key_lengths Array of \p count secret key lengths (<c>secret_key_lengths[i]</c> is the length of <c>secret_keys[i]</c>).
+ * @param utcs Array of \p count UTC timestamps for which to generate the TOTPs (<c>utcs[i]</c> is used with <c>secret_keys[i]</c>).
+ * @param count How many TOTPs to compute.
+ * @param digits How many digits should the output tokens contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param steps The step count: default is 30 seconds (#TFAC_DEFAULT_STEPS).
+ * @param hash_algo Which hashing algorithm to use for the <c>HMAC</c> (the same for the whole batch): default is <c>SHA-1</c> (#TFAC_DEFAULT_HASH_ALGO).
+ * @param out Where to write the \p count resulting TOTPs.
+ */
+TFAC_API void tfac_totp_raw_many(const uint8_t* const* secret_keys, const size_t* secret_key_lengths, const time_t* utcs, size_t count, uint8_t digits, uint8_t steps, enum tfac_hash_algo hash_algo, uint64_t* out);
+
+/**
+ * Verifies a TOTP using a pre-processed tfac_key. Just like with tfac_verify_totp(), successfully validated tokens are obliterated and cannot be validated again.
+ * @param key The tfac_key that the token was generated with.
+ * @param totp The token to verify.
+ * @param digits How many digits the token to validate is supposed to contain.
+ * @param steps The steps parameter that was used to generate the token.
+ * @return <c>1</c> if the token was valid; <c>0</c> if verification failed or if the token has already been used.
+ */
+TFAC_API uint8_t tfac_verify_totp_key(const struct tfac_key* key, const char* totp, uint8_t digits, uint8_t steps);
+
+/**
+ * Verifies a TOTP using a pre-processed tfac_key, with per-credential last accepted step replay protection (see tfac_verify_totp_step() for more details).
+ * @param key The tfac_key that the token was generated with.
+ * @param totp The token to verify.
+ * @param digits How many digits the token to validate is supposed to contain.
+ * @param steps The steps parameter that was used to generate the token.
+ * @param last_accepted_step The credential's last accepted time step: this is atomically updated on success, so it may be shared between threads (keep it 8-byte aligned).
+ * @return <c>1</c> if the token was valid (and \p last_accepted_step has been moved forward to its step); <c>0</c> if verification failed or if the token's step isn't newer than \p last_accepted_step.
+ */
+TFAC_API uint8_t tfac_verify_totp_key_step(const struct tfac_key* key, const char* totp, uint8_t digits, uint8_t steps, uint64_t* last_accepted_step);
+
+/**
+ * A TOTP verifier with its own table of used tokens, sized at runtime. <p>
+ * tfac_verify_totp() and tfac_verify_totp_key() share a default one that is allocated on first use (sized via the <c>TFAC_OBLITERATION_TABLE_SIZE</c> pre-processor constant):
+ * create your own if you need more (or less) capacity than that, or if you want to control where its memory comes from.
+ */
+struct tfac_verifier;
+
+/**
+ * Gets how many bytes of memory a tfac_verifier with the given capacity needs (e.g. to provide a buffer for tfac_verifier_init()).
+ * @param capacity How many successful verifications per 30 seconds the verifier should be able to tell apart from replays (more than that, and older tokens start being forgotten early).
+ * @return The needed buffer size in bytes; <c>0</c> if \p capacity is <c>0</c>.
+ */
+TFAC_API size_t tfac_verifier_size(size_t capacity);
+
+/**
+ * Initializes a tfac_verifier inside a caller-provided buffer (no heap allocations are made). The buffer needs to stay around for as long as the verifier is in use.
+ * @param buffer The memory to place the verifier into.
+ * @param buffer_size Size of \p buffer in bytes: needs to be at least <c>tfac_verifier_size(capacity)</c>.
+ * @param capacity How many successful verifications per 30 seconds the verifier should be sized for.
+ * @return The initialized verifier (which lives somewhere inside \p buffer); <c>NULL</c> if \p buffer is <c>NULL</c> or too small, or if \p capacity is <c>0</c>.
+ */
+TFAC_API struct tfac_verifier* tfac_verifier_init(void* buffer, size_t buffer_size, size_t capacity);
+
+/**
+ * Allocates and initializes a new tfac_verifier. Release it with tfac_verifier_free() when you're done.
+ * @param capacity How many successful verifications per 30 seconds the verifier should be sized for.
+ * @param malloc_fn The allocator to get the verifier's memory from (pass <c>NULL</c> for both \p malloc_fn and \p free_fn to use the standard <c>malloc</c> and <c>free</c>).
+ * @param free_fn The function that releases memory obtained from \p malloc_fn.
+ * @return The new verifier; <c>NULL</c> if the allocation failed, if \p capacity is <c>0</c> or if only one of \p malloc_fn and \p free_fn was passed.
+ */
+TFAC_API struct tfac_verifier* tfac_verifier_new(size_t capacity, void* (*malloc_fn)(size_t), void (*free_fn)(void*));
+
+/**
+ * Opens (or creates) a tfac_verifier that lives in a memory-mapped file, so that multiple processes (e.g. prefork workers) share the same used tokens
+ * and those survive restarts too. Every process that opens the same file attaches to the same verifier: a token accepted by one of them is rejected by all others. <p>
+ * The file has a fixed size (its entries expire along with their tokens, so it never grows) and starts with a small versioned header:
+ * files created by a TFAC build with a different layout are rejected rather than misinterpreted.
+ * @param path Path of the verifier file (created if it doesn't exist yet).
+ * @param capacity How many successful verifications per 30 seconds the verifier should be sized for (only used when the file is created: existing files keep their size).
+ * @return The verifier (release it with tfac_verifier_free(), which unmaps the file again); <c>NULL</c> if the file couldn't be opened, created or mapped, or if it isn't a valid verifier file.
+ */
+TFAC_API struct tfac_verifier* tfac_verifier_open(const char* path, size_t capacity);
+
+/**
+ * Opens (or creates) a durable tfac_verifier: it lives in memory, but every accepted token is also appended to a write-ahead log at <c>&lt;path&gt;.wal</c>,
+ * and the used tokens that are logged in there (and in the snapshot at \p path) are loaded back in when the verifier is opened again after a restart or a crash. <p>
+ * Log writes are fsync'ed in batches (group commit): with an \p fsync_interval_ms of <c>0</c>, a token is only accepted once its log record is on disk
+ * (concurrent verifications share their fsyncs); larger intervals trade the last few milliseconds of accepted tokens in case of a crash for far more verifications per second. <p>
+ * With an fsync interval, a background thread writes the records out once it has passed, even if no more verifications come along after them. <p>
+ * Tokens whose log record can't be written are rejected. The log only ever grows until it's compacted: call tfac_verifier_compact() every now and then (e.g. every few minutes from a background thread of yours).
+ * After a failed write, the verifier rejects every token until tfac_verifier_compact() has started a new log.
+ * @param path Path of the snapshot file (the log goes to the same path plus ".wal"; both are created if they don't exist yet). Only one process at a time may use these files!
+ * @param capacity How many successful verifications per 30 seconds the verifier should be sized for.
+ * @param fsync_interval_ms How many milliseconds to batch log writes for at most before fsync'ing them: <c>0</c> waits for the fsync on every accepted token.
+ * @return The verifier (release it with tfac_verifier_free(), which writes out the last log records); <c>NULL</c> if the files couldn't be read or written, or if they aren't valid TFAC snapshots/logs.
+ */
+TFAC_API struct tfac_verifier* tfac_verifier_open_durable(const char* path, size_t capacity, uint32_t fsync_interval_ms);
+
+/**
+ * Writes out and fsyncs the write-ahead log records of a durable verifier (see tfac_verifier_open_durable()) that are still waiting for their fsync interval to pass.
+ * @param verifier The verifier (for non-durable verifiers, this does nothing).
+ * @return <c>1</c> on success; <c>0</c> if \p verifier is <c>NULL</c> or writing the log failed.
+ */
+TFAC_API uint8_t tfac_verifier_sync(struct tfac_verifier* verifier);
+
+/**
+ * Compacts the write-ahead log of a durable verifier (see tfac_verifier_open_durable()): the used tokens that haven't expired yet are written into a new snapshot that atomically replaces the old one, and the log starts over.
+ * Verifications on other threads may carry on in the meantime.
+ * @param verifier The verifier (for non-durable verifiers, this does nothing).
+ * @return <c>1</c> on success; <c>0</c> if \p verifier is <c>NULL</c> or the new snapshot couldn't be written (the previous snapshot and log are still valid then).
+ */
+TFAC_API uint8_t tfac_verifier_compact(struct tfac_verifier* verifier);
+
+/**
+ * Releases a tfac_verifier that was created with tfac_verifier_new(), tfac_verifier_open() or tfac_verifier_open_durable() (verifiers placed into caller-provided buffers with tfac_verifier_init() are left alone).
+ * @param verifier The verifier to free (may be <c>NULL</c>). Make sure that no other thread is still using it!
+ */
+TFAC_API void tfac_verifier_free(struct tfac_verifier* verifier);
+
+/**
+ * Verifies a TOTP using the given \p secret_key_base32 against the used tokens of a specific tfac_verifier (otherwise, this works just like tfac_verify_totp()).
+ * @param verifier The verifier to check and record the used token with.
+ * @param secret_key_base32 The 2FA secret (Base32-encoded, NUL-terminated string).
+ * @param totp The token to verify.
+ * @param digits How many digits the token to validate is supposed to contain.
+ * @param steps The steps parameter that was used to generate the token.
+ * @param hash_algo The hash algorithm that the token was created with (default is SHA-1: #TFAC_DEFAULT_HASH_ALGO).
+ * @return <c>1</c> if the token was valid; <c>0</c> if verification failed or if the token has already been used.
+ */
+TFAC_API uint8_t tfac_verifier_verify_totp(struct tfac_verifier* verifier, const char* secret_key_base32, const char* totp, uint8_t digits, uint8_t steps, enum tfac_hash_algo hash_algo);
+
+/**
+ * Verifies a TOTP using a pre-processed tfac_key against the used tokens of a specific tfac_verifier (otherwise, this works just like tfac_verify_totp_key()).
+ * @param verifier The verifier to check and record the used token with.
+ * @param key The tfac_key that the token was generated with.
+ * @param totp The token to verify.
+ * @param digits How many digits the token to validate is supposed to contain.
+ * @param steps The steps parameter that was used to generate the token.
+ * @return <c>1</c> if the token was valid; <c>0</c> if verification failed or if the token has already been used.
+ */
+TFAC_API uint8_t tfac_verifier_verify_totp_key(struct tfac_verifier* verifier, const struct tfac_key* key, const char* totp, uint8_t digits, uint8_t steps);
+
+/**
+ * Registry of pre-processed keys that are referred to by 32-bit handles: register every secret once, and then generate and verify its tokens by handle. <p>
+ * The keys' HMAC states are kept in one 64-byte aligned array per field (structure-of-arrays), so that a lookup only touches a few cache lines and
+ * batches of handles (see tfac_key_registry_totp_many()) stream through the arrays. The registry has a fixed capacity, and handles of unregistered keys stop working
+ * (until their slot's 8-bit generation counter wraps around after 255 more unregistrations). <p>
+ * Registering, unregistering and replacing keys is thread-safe, and never blocks lookups: those don't take any locks, they just read a slot again
+ * if it's being written at that very moment (so they always see either the old or the new key, never a mix of both).
+ */
+struct tfac_key_registry;
+
+/**
+ * Allocates a new, empty tfac_key_registry. Release it with tfac_key_registry_free() when you're done.
+ * @param capacity How many keys the registry should be able to hold at most (up to <c>2^24</c>: every key takes up 66 bytes).
+ * @return The registry; <c>NULL</c> if \p capacity is <c>0</c> or too large, or if out of memory.
+ */
+TFAC_API struct tfac_key_registry* tfac_key_registry_new(uint32_t capacity);
+
+/**
+ * Saves a tfac_key_registry as a key store file: the pre-processed HMAC states of all of its slots (free or not) in fixed-size records, behind a versioned and checksummed header.
+ * Load it with tfac_key_registry_open(), and the handles that the keys were registered with keep on working. <p>
+ * The file is written next to \p path first and then renamed over it, so that processes opening the key store at the same time never see a half-written one.
+ * Keep in mind that the file is as sensitive as the secrets themselves!
+ * @param registry The registry to save (registering and unregistering keys only has to wait while its arrays are copied, not while the file is written; saving takes as much memory again as the registry while it runs).
+ * @param path Where to write the key store file.
+ * @return <c>1</c> on success; <c>0</c> if the file couldn't be written.
+ */
+TFAC_API uint8_t tfac_key_registry_save(struct tfac_key_registry* registry, const char* path);
+
+/**
+ * Opens a key store file (see tfac_key_registry_save()) as a tfac_key_registry: the file is memory-mapped and tokens are generated and verified straight out of the mapping,
+ * so opening even a key store with millions of keys takes no time at all (unless \p verify_checksum is set), and all of the processes that open it share the same pages in memory. <p>
+ * The mapping is copy-on-write: keys can be registered, unregistered and replaced (or deltas applied, see tfac_key_registry_apply_delta()) just like with any other registry,
+ * but that only ever changes this process' copy of the affected pages, never the file. Save the registry again to persist the changes. Release it with tfac_key_registry_free().
+ * @param path Path of the key store file.
+ * @param verify_checksum Whether to check the checksum of all the keys in the file (which means reading all of it) rather than just the header.
+ * @return The registry; <c>NULL</c> if the file couldn't be opened or mapped, or if it isn't a valid key store file (or was created on a machine with a different byte order).
+ */
+TFAC_API struct tfac_key_registry* tfac_key_registry_open(const char* path, uint8_t verify_checksum);
+
+/**
+ * Wipes all of the registered keys and releases the registry (or unmaps it, if it was opened with tfac_key_registry_open()).
+ * @param registry The registry to free (may be <c>NULL</c>). Make sure that no other thread is still using it!
+ */
+TFAC_API void tfac_key_registry_free(struct tfac_key_registry* registry);
+
+/**
+ * Decodes a base32 secret and registers its key.
+ * @param registry The registry to register the key with.
+ * @param secret_key_base32 The base32 encoded secret.
+ * @param hash_algo The hash algorithm that the key's tokens are going to be generated with.
+ * @return The new key's handle (never <c>0</c>); <c>0</c> if the registry is full (or if any of the arguments are invalid).
+ */
+TFAC_API uint32_t tfac_key_registry_register(struct tfac_key_registry* registry, const char* secret_key_base32, enum tfac_hash_algo hash_algo);
+
+/**
+ * Registers a pre-processed key (see tfac_key_init()).
+ * @param registry The registry to register the key with.
+ * @param key The key to register (it's copied into the registry).
+ * @return The new key's handle (never <c>0</c>); <c>0</c> if the registry is full (or if any of the arguments are invalid).
+ */
+TFAC_API uint32_t tfac_key_registry_register_key(struct tfac_key_registry* registry, const struct tfac_key* key);
+
+/**
+ * Removes a key from the registry (and wipes it): its handle stops working, and its slot is reused for the keys that are registered next.
+ * @param registry The registry.
+ * @param handle The handle of the key to unregister.
+ * @return <c>1</c> if the key was unregistered; <c>0</c> if \p handle wasn't valid.
+ */
+TFAC_API uint8_t tfac_key_registry_unregister(struct tfac_key_registry* registry, uint32_t handle);
+
+/**
+ * Decodes a base32 secret and puts its key in place of the one that \p handle refers to (e.g. to rotate a user's secret): the handle stays the same.
+ * @param registry The registry.
+ * @param handle The handle of the key to replace.
+ * @param secret_key_base32 The new base32 encoded secret.
+ * @param hash_algo The hash algorithm that the new key's tokens are going to be generated with.
+ * @return <c>1</c> if the key was replaced; <c>0</c> if \p handle wasn't valid (or if any of the other arguments are invalid).
+ */
+TFAC_API uint8_t tfac_key_registry_replace(struct tfac_key_registry* registry, uint32_t handle, const char* secret_key_base32, enum tfac_hash_algo hash_algo);
+
+/**
+ * Puts a pre-processed key (see tfac_key_init()) in place of the one that \p handle refers to: the handle stays the same.
+ * @param registry The registry.
+ * @param handle The handle of the key to replace.
+ * @param key The new key (it's copied into the registry).
+ * @return <c>1</c> if the key was replaced; <c>0</c> if \p handle wasn't valid (or if any of the other arguments are invalid).
+ */
+TFAC_API uint8_t tfac_key_registry_replace_key(struct tfac_key_registry* registry, uint32_t handle, const struct tfac_key* key);
+
+/**
+ * Writes the slots in which a registry differs from \p base (keys that were registered, unregistered or replaced since) into a key delta file,
+ * which turns any other copy of \p base into the same registry with tfac_key_registry_apply_delta(). <p>
+ * That's how changes get from one process to many without rewriting the whole key store: open the same key store file twice (once to change, once as the unchanged base),
+ * ship deltas of the former against the latter, and save a new key store file once in a while (which the next deltas are then based on). <p>
+ * The file is written next to \p path first and then renamed over it. Keep in mind that it is as sensitive as the secrets themselves!
+ * @param registry The changed registry (registering, unregistering and replacing keys has to wait until the delta is saved).
+ * @param base The registry that the delta is going to be applied to (e.g. the key store file that \p registry was opened from, opened once more): it has to have the same capacity.
+ * @param path Where to write the key delta file.
+ * @return <c>1</c> on success; <c>0</c> if the registries' capacities differ, or if the file couldn't be written.
+ */
+TFAC_API uint8_t tfac_key_registry_save_delta(struct tfac_key_registry* registry, const struct tfac_key_registry* base, const char* path);
+
+/**
+ * Applies a key delta file (see tfac_key_registry_save_delta()) on top of a registry: every slot in there is overwritten with its state from the delta, one after the other,
+ * while the other threads keep on generating and verifying tokens (lookups of the slots that are being written just read them again). <p>
+ * Deltas are meant for registries that only ever change by applying them: keys that are registered with the registry directly may end up in the same slots as the delta's.
+ * @param registry The registry to apply the delta to (usually opened from the key store file that the delta was saved against).
+ * @param path Path of the key delta file.
+ * @return <c>1</c> if the delta was applied; <c>0</c> if the file couldn't be read, if it's not a valid key delta file, or if it was saved for a registry with a different capacity (nothing is applied then).
+ */
+TFAC_API uint8_t tfac_key_registry_apply_delta(struct tfac_key_registry* registry, const char* path);
+
+/**
+ * Generates an HOTP using a registered key.
+ * @param registry The registry.
+ * @param handle The key's handle.
+ * @param digits How many digits should the output token contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param counter The counter value to use for the HOTP.
+ * @return The HOTP; an all-zero tfac_token (with an empty string) if \p handle isn't valid.
+ */
+TFAC_API struct tfac_token tfac_key_registry_hotp(const struct tfac_key_registry* registry, uint32_t handle, uint8_t digits, uint64_t counter);
+
+/**
+ * Generates a TOTP using a registered key.
+ * @param registry The registry.
+ * @param handle The key's handle.
+ * @param digits How many digits should the output token contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param steps The step count: default is 30 seconds (#TFAC_DEFAULT_STEPS).
+ * @return The TOTP; an all-zero tfac_token (with an empty string) if \p handle isn't valid.
+ */
+TFAC_API struct tfac_token tfac_key_registry_totp(const struct tfac_key_registry* registry, uint32_t handle, uint8_t digits, uint8_t steps);
+
+/**
+ * Verifies a TOTP using a registered key (against the same used tokens as tfac_verify_totp_key(): a token can only ever be validated once).
+ * @param registry The registry.
+ * @param handle The key's handle.
+ * @param totp The token to verify.
+ * @param digits How many digits the token to validate is supposed to contain.
+ * @param steps The steps parameter that was used to generate the token.
+ * @return <c>1</c> if the token was valid; <c>0</c> if verification failed, if the token has already been used, or if \p handle isn't valid.
+ */
+TFAC_API uint8_t tfac_key_registry_verify_totp(const struct tfac_key_registry* registry, uint32_t handle, const char* totp, uint8_t digits, uint8_t steps);
+
+/**
+ * Computes the TOTPs of many registered keys at the same point in time (gathered out of the registry in chunks and handed to tfac_totp_key_batch()).
+ * Sorting the handles first makes the lookups stream through the registry's arrays.
+ * @param registry The registry.
+ * @param handles Array of \p count key handles.
+ * @param count How many TOTPs to compute.
+ * @param digits How many digits should the output tokens contain? If unsure, pass #TFAC_DEFAULT_DIGITS (which is <c>6</c>).
+ * @param steps The step count: default is 30 seconds (#TFAC_DEFAULT_STEPS).
+ * @param utc The UTC timestamp for which to generate the TOTPs.
+ * @param out Where to write the \p count resulting TOTPs (<c>UINT64_MAX</c> for the handles that aren't valid).
+ */
+TFAC_API void tfac_key_registry_totp_many(const struct tfac_key_registry* registry, const uint32_t* handles, size_t count, uint8_t digits, uint8_t steps, time_t utc, uint64_t* out);
+
+/**
+ * Precomputed TOTPs of all of a key registry's keys, for the current time step, its two neighbours and the step after that:
+ * verifying a token with tfac_token_cache_verify_totp() then boils down to looking up the cached tokens and comparing integers, instead of computing up to three HMACs. <p>
+ * The tokens are computed a whole step at a time (with the batched, multi-lane HMAC path), either by a background thread that the cache starts itself,
+ * or by calling tfac_token_cache_refresh() yourself. Keys that are registered, replaced or unregistered after their tokens were computed are never served stale:
+ * their lookups miss, and their tokens are computed on demand (until the next step's tokens have been computed). <p>
+ * Every slot of the registry takes up 32 bytes in the cache (only the pages of the slots that are in use are ever touched, though).
+ */
+struct tfac_token_cache;
+
+/**
+ * Hit and miss counters and refresh costs of a tfac_token_cache.
+ */
+struct tfac_token_cache_stats
+{
+    /**
+     * How many bytes the cache takes up.
+     */
+    size_t memory;
+
+    /**
+     * How many verifications found all of the tokens that they needed in the cache.
+     */
+    uint64_t hits;
+
+    /**
+     * How many verifications had to compute at least one token on demand.
+     */
+    uint64_t misses;
+
+    /**
+     * How many steps' worth of tokens have been computed.
+     */
+    uint64_t rows_computed;
+
+    /**
+     * How many tokens have been computed for those.
+     */
+    uint64_t tokens_computed;
+
+    /**
+     * How long computing them took, in total (in nanoseconds).
+     */
+    uint64_t refresh_ns;
+};
+
+/**
+ * Allocates a token cache for a key registry. Release it with tfac_token_cache_free() before freeing the registry.
+ * @param registry The registry whose keys' tokens should be cached (it has to outlive the cache).
+ * @param digits How many digits the tokens have (at most <c>9</c>).
+ * @param steps The step count: default is 30 seconds (#TFAC_DEFAULT_STEPS).
+ * @param background_refresh Whether to start a thread that computes the tokens of the next steps as the clock moves on (otherwise, call tfac_token_cache_refresh() yourself).
+ * @return The cache (which is empty until it's first refreshed); <c>NULL</c> if any of the arguments are invalid, if out of memory, or if the thread couldn't be started.
+ */
+TFAC_API struct tfac_token_cache* tfac_token_cache_new(const struct tfac_key_registry* registry, uint8_t digits, uint8_t steps, uint8_t background_refresh);
+
+/**
+ * Stops the cache's background refresh thread (if it has one), wipes the cached tokens and releases the cache.
+ * @param cache The cache to free (may be <c>NULL</c>). Make sure that no other thread is still using it!
+ */
+TFAC_API void tfac_token_cache_free(struct tfac_token_cache* cache);
+
+/**
+ * Computes the tokens of the steps around \p utc that aren't cached yet (nothing, most of the time). If another thread is refreshing the cache already, this returns right away.
+ * @param cache The token cache.
+ * @param utc The current UTC timestamp.
+ */
+TFAC_API void tfac_token_cache_refresh(struct tfac_token_cache* cache, time_t utc);
+
+/**
+ * Verifies a TOTP using a registered key and its cached tokens (against the same used tokens as tfac_key_registry_verify_totp(): a token can only ever be validated once).
+ * @param cache The token cache.
+ * @param handle The key's handle (in the cache's registry).
+ * @param totp The token to verify (with as many digits as the cache was created for).
+ * @return <c>1</c> if the token was valid; <c>0</c> if verification failed, if the token has already been used, or if \p handle isn't valid.
+ */
+TFAC_API uint8_t tfac_token_cache_verify_totp(struct tfac_token_cache* cache, uint32_t handle, const char* totp);
+
+/**
+ * Gets a token cache's memory usage, hit and miss counters, and how much computing its tokens has cost so far.
+ * @param cache The token cache.
+ * @return The token cache's stats (all zero if \p cache is <c>NULL</c>).
+ */
+TFAC_API struct tfac_token_cache_stats tfac_token_cache_get_stats(const struct tfac_token_cache* cache);
+
+/**
+ * Enables or disables the hardware accelerated hash function implementations (e.g. the Intel SHA extensions). <p>
+ * By default, TFAC checks once at startup which instruction set extensions the CPU supports and uses the fastest available implementation,
+ * unless the <c>TFAC_FORCE_PORTABLE</c> environment variable is set (to anything other than <c>0</c>), in which case it sticks to the portable C code. <p>
+ * This is mostly useful for testing and benchmarking: don't call this while other threads are generating or verifying tokens!
+ * @param enabled <c>0</c> to force the portable C implementations; anything else to use the fastest implementation that the CPU supports.
+ * @return <c>1</c> if hardware acceleration is now in use; <c>0</c> if the portable implementations are used.
+ */
+TFAC_API uint8_t tfac_set_hardware_acceleration(uint8_t enabled);
+
+/**
+ * Hit and miss counters of the key cache (see tfac_set_key_cache_size()).
+ */
+struct tfac_key_cache_stats
+{
+    /**
+     * How many entries the key cache has (<c>0</c> if it's disabled).
+     */
+    size_t entries;
+
+    /**
+     * How many lookups found their secret's key in the cache.
+     */
+    uint64_t hits;
+
+    /**
+     * How many lookups had to decode their secret (and then cached its key).
+     */
+    uint64_t misses;
+};
+
+/**
+ * Enables (or resizes, or disables) the key cache: a bounded cache of the decoded base32 secrets and their pre-processed HMAC states, keyed by the secret string.
+ * With it, tfac_hotp(), tfac_totp(), tfac_verify_totp() and the other functions that take a base32 secret only decode and pre-process a secret the first time they see it
+ * (just like if you had kept its tfac_key around yourself). <p>
+ * The cache is disabled by default, unless TFAC was compiled with the <c>TFAC_KEY_CACHE_SIZE</c> pre-processor constant set to the number of entries that it should have.
+ * Every entry takes up about 112 bytes. Secrets are mapped to sets of four entries: once a set is full, its least recently used key makes room for the next one. Keep in mind that enabling this keeps (pre-processed) secrets in memory for longer. <p>
+ * Resizing drops (and wipes) all of the cached keys, as well as the hit and miss counters. The old cache is freed before this returns: so don't call this while other threads
+ * are generating or verifying tokens with base32 secrets (tfac_hotp(), tfac_totp(), tfac_verify_totp() and the like), or calling this function too!
+ * @param entries How many keys to cache at most (rounded up to the next power of two): <c>0</c> disables the key cache.
+ * @return <c>1</c> on success; <c>0</c> if the cache couldn't be allocated (it's disabled then).
+ */
+TFAC_API uint8_t tfac_set_key_cache_size(size_t entries);
+
+/**
+ * Gets the key cache's hit and miss counters (e.g. to figure out whether it's big enough for your number of active secrets).
+ * @return The key cache stats (all zero if the key cache is disabled).
+ */
+TFAC_API struct tfac_key_cache_stats tfac_get_key_cache_stats();
+
 /**
  * Gets the current TFAC library version number.
  * @return A tfac_version_number instance containing raw numbers as well as a nicely formatted string (in the format of \c MAJOR.MINOR.HOTFIX ).
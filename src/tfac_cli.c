@@ -20,6 +20,75 @@
 
 #include "tfac.h"
 
+// Reads one base32 secret per line out of secrets_path, and writes them into a key store file (see tfac_key_registry_save()).
+// The handles of the keys are printed to stdout, one per line, in the same order as the secrets.
+static int build_key_store(const char* secrets_path, const char* key_store_path, const enum tfac_hash_algo hash_algo)
+{
+    FILE* secrets = fopen(secrets_path, "r");
+
+    if (secrets == NULL)
+    {
+        fprintf(stderr, "Couldn't open \"%s\"!\n", secrets_path);
+        return -1;
+    }
+
+    char line[512];
+    uint32_t count = 0;
+
+    while (fgets(line, sizeof(line), secrets) != NULL)
+    {
+        count += line[strspn(line, " \t\r\n")] != '\0';
+    }
+
+    struct tfac_key_registry* registry = tfac_key_registry_new(count > 0 ? count : 1);
+
+    if (registry == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate a key registry for %u secrets!\n", count);
+        fclose(secrets);
+        return -1;
+    }
+
+    rewind(secrets);
+
+    int r = 0;
+    uint32_t line_number = 0;
+
+    while (r == 0 && fgets(line, sizeof(line), secrets) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        line_number++;
+
+        if (line[strspn(line, " \t")] == '\0')
+        {
+            continue;
+        }
+
+        const uint32_t handle = tfac_key_registry_register(registry, line, hash_algo);
+
+        if (handle == 0)
+        {
+            fprintf(stderr, "Couldn't register the secret on line %u!\n", line_number);
+            r = -1;
+            break;
+        }
+
+        printf("%u\n", handle);
+    }
+
+    memset(line, 0x00, sizeof(line));
+    fclose(secrets);
+
+    if (r == 0 && !tfac_key_registry_save(registry, key_store_path))
+    {
+        fprintf(stderr, "Couldn't write \"%s\"!\n", key_store_path);
+        r = -1;
+    }
+
+    tfac_key_registry_free(registry);
+    return r;
+}
+
 int main(int argc, char* argv[])
 {
     if (argc < 2)
@@ -31,9 +100,15 @@ int main(int argc, char* argv[])
     if (argc == 2 && strcmp(argv[1], "--help") == 0)
     {
         printf("\n TFAC CLI instructions:\n\n tfac_cli <2fa_secret_base32> [digits] [steps] [hash_algo] \n\n Default step count is 30 seconds using 6 digits and hash algo \"0\" (SHA-1).\n");
+        printf("\n tfac_cli --build-keystore <secrets_file> <key_store_file> [hash_algo] \n\n Writes the base32 secrets in <secrets_file> (one per line) into a key store file for tfac_key_registry_open(), and prints their handles (one per line, in the same order).\n");
         return 0;
     }
 
+    if (argc >= 4 && strcmp(argv[1], "--build-keystore") == 0)
+    {
+        return build_key_store(argv[2], argv[3], argc >= 5 ? (enum tfac_hash_algo)strtoul(argv[4], NULL, 10) : TFAC_DEFAULT_HASH_ALGO);
+    }
+
     if (argc == 2 && strcmp(argv[1], "--version") == 0)
     {
         struct tfac_version_number v = tfac_get_version_number();
@@ -0,0 +1,129 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "tfac_cpu.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef TFAC_X86
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static void tfac_cpuid(const uint32_t leaf, const uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex(r, (int)leaf, (int)subleaf);
+    regs[0] = (uint32_t)r[0];
+    regs[1] = (uint32_t)r[1];
+    regs[2] = (uint32_t)r[2];
+    regs[3] = (uint32_t)r[3];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t tfac_xgetbv()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+uint32_t tfac_cpu_detect_features()
+{
+    uint32_t features = 0;
+    uint32_t regs[4];
+
+    tfac_cpuid(0, 0, regs);
+    const uint32_t max_leaf = regs[0];
+
+    if (max_leaf < 7)
+    {
+        return 0;
+    }
+
+    tfac_cpuid(1, 0, regs);
+    const uint32_t leaf1_ecx = regs[2];
+
+    tfac_cpuid(7, 0, regs);
+    const uint32_t leaf7_ebx = regs[1];
+
+    const int sse41 = (leaf1_ecx >> 19) & 1;
+    const int osxsave = (leaf1_ecx >> 27) & 1;
+
+    if (sse41 && ((leaf7_ebx >> 29) & 1))
+    {
+        features |= TFAC_CPU_SHA_NI;
+    }
+
+    if (!osxsave)
+    {
+        return features;
+    }
+
+    // The OS needs to save/restore the wider registers on context switches too (XMM|YMM, and opmask|ZMM for AVX-512).
+    const uint64_t xcr0 = tfac_xgetbv();
+
+    if ((xcr0 & 0x06) == 0x06 && ((leaf7_ebx >> 5) & 1))
+    {
+        features |= TFAC_CPU_AVX2;
+    }
+
+    if ((xcr0 & 0xE6) == 0xE6 && ((leaf7_ebx >> 16) & 1))
+    {
+        features |= TFAC_CPU_AVX512F;
+    }
+
+    return features;
+}
+
+#else
+
+uint32_t tfac_cpu_detect_features()
+{
+    return 0;
+}
+
+#endif // TFAC_X86
+
+uint32_t tfac_cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    return system_info.dwNumberOfProcessors > 0 ? (uint32_t)system_info.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+#else
+    return 1;
+#endif
+}
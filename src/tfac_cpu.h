@@ -0,0 +1,118 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/**
+ * @file tfac_cpu.h
+ * @author Raphael Beck
+ * @brief CPU feature detection and hardware accelerated hash kernels (internal header: not part of the public TFAC API).
+ */
+
+#ifndef TFAC_CPU_H
+#define TFAC_CPU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if !defined(TFAC_NO_HARDWARE_ACCELERATION) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define TFAC_X86 1
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TFAC_TARGET(x) __attribute__((target(x)))
+#else
+#define TFAC_TARGET(x)
+#endif
+
+/**
+ * The CPU supports the Intel SHA extensions (as well as SSE4.1, which the SHA-NI kernels need too).
+ */
+#define TFAC_CPU_SHA_NI (1U << 0)
+
+/**
+ * The CPU and OS support AVX2.
+ */
+#define TFAC_CPU_AVX2 (1U << 1)
+
+/**
+ * The CPU and OS support AVX-512F.
+ */
+#define TFAC_CPU_AVX512F (1U << 2)
+
+/**
+ * Queries the CPU (via <c>cpuid</c>) for the instruction set extensions that TFAC has kernels for.
+ * @return Bitmask of <c>TFAC_CPU_*</c> flags; <c>0</c> on non-x86 platforms or if TFAC was built with <c>TFAC_NO_HARDWARE_ACCELERATION</c>.
+ */
+uint32_t tfac_cpu_detect_features();
+
+/**
+ * Gets the number of online logical CPUs (e.g. to size per-core data structures with).
+ * @return The number of CPUs; <c>1</c> if it can't be determined.
+ */
+uint32_t tfac_cpu_count();
+
+#ifdef TFAC_X86
+
+/**
+ * SHA-1 compression function using the Intel SHA extensions.
+ * @param state The 5-word hash state to update.
+ * @param block The 64-byte block to hash.
+ */
+void tfac_sha1_compress_sha_ni(uint32_t* state, const uint8_t* block);
+
+/**
+ * SHA-256 (and SHA-224) compression function using the Intel SHA extensions.
+ * @param state The 8-word hash state to update.
+ * @param block The 64-byte block to hash.
+ */
+void tfac_sha256_compress_sha_ni(uint32_t* state, const uint8_t* block);
+
+/**
+ * Computes eight independent single-block-message HMAC-SHA1 digests (HOTP style: the message is an 8-byte big-endian counter) in parallel using AVX2.
+ * @param inner_states The eight (5-word) SHA-1 midstates after processing the HMAC ipad block, one per lane.
+ * @param outer_states The eight (5-word) SHA-1 midstates after processing the HMAC opad block, one per lane.
+ * @param counters The eight counters to authenticate.
+ * @param digests Where to write the eight resulting digests (as native-endian SHA-1 state words).
+ */
+void tfac_hmac_sha1_x8_avx2(const uint32_t* const* inner_states, const uint32_t* const* outer_states, const uint64_t* counters, uint32_t (*digests)[5]);
+
+/**
+ * Sixteen independent SHA-256 (or SHA-224) compression function invocations in parallel using AVX-512F.
+ * @param states The sixteen 8-word hash states to update.
+ * @param blocks The sixteen 64-byte blocks to hash (<c>blocks[i]</c> goes into <c>states[i]</c>).
+ */
+void tfac_sha256_compress_x16_avx512(uint32_t* const* states, const uint8_t* const* blocks);
+
+/**
+ * Computes sixteen independent HMAC-SHA256 (or HMAC-SHA224) digests of 8-byte big-endian counters in parallel using AVX-512F.
+ * @param inner_states The sixteen (8-word) midstates after processing the HMAC ipad block, one per lane.
+ * @param outer_states The sixteen (8-word) midstates after processing the HMAC opad block, one per lane.
+ * @param counters The sixteen counters to authenticate.
+ * @param digest_words The digest length in 32-bit words: <c>7</c> for SHA-224, <c>8</c> for SHA-256.
+ * @param digests Where to write the sixteen resulting digests (as native-endian hash state words: only the first \p digest_words of each are part of the digest).
+ */
+void tfac_hmac_sha256_x16_avx512(const uint32_t* const* inner_states, const uint32_t* const* outer_states, const uint64_t* counters, size_t digest_words, uint32_t (*digests)[8]);
+
+#endif // TFAC_X86
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // TFAC_CPU_H
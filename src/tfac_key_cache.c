@@ -0,0 +1,161 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tfac_key_cache.h"
+
+// The sets live right after the cache itself (plus up to 63 bytes of padding to align them).
+struct tfac_key_cache* tfac_key_cache_new(const size_t entry_count, const uint8_t hash_key[32])
+{
+    if (entry_count == 0 || entry_count > SIZE_MAX / 2 / sizeof(struct tfac_key_cache_set))
+    {
+        return NULL;
+    }
+
+    size_t n = 1;
+
+    while (n * TFAC_KEY_CACHE_WAYS < entry_count)
+    {
+        n <<= 1;
+    }
+
+    struct tfac_key_cache* cache = malloc(sizeof(struct tfac_key_cache) + 63 + n * sizeof(struct tfac_key_cache_set));
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(cache->hash_keys, hash_key, sizeof(cache->hash_keys));
+    cache->set_count = n;
+    cache->sets = (struct tfac_key_cache_set*)(((uintptr_t)(cache + 1) + 63) & ~(uintptr_t)63);
+
+    memset(cache->sets, 0x00, n * sizeof(struct tfac_key_cache_set));
+
+    return cache;
+}
+
+void tfac_key_cache_free(struct tfac_key_cache* cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    // The sets hold decoded secrets: don't leave them lying around on the heap.
+    memset(cache->sets, 0x00, cache->set_count * sizeof(struct tfac_key_cache_set));
+    memset(cache->hash_keys, 0x00, sizeof(cache->hash_keys));
+
+    free(cache);
+}
+
+static void tfac_key_cache_lock(struct tfac_key_cache_set* set)
+{
+    // Sets are only ever locked for as long as it takes to scan their tags and copy a key in or out.
+    while (!tfac_atomic_cas(&set->lock, 0, 1))
+    {
+    }
+}
+
+static void tfac_key_cache_unlock(struct tfac_key_cache_set* set)
+{
+    tfac_atomic_cas(&set->lock, 1, 0);
+}
+
+struct tfac_key tfac_key_cache_get(struct tfac_key_cache* cache, const char* secret_key_base32, const enum tfac_hash_algo hash_algo)
+{
+    const size_t length = strlen(secret_key_base32);
+
+    // The hash algorithm goes into the tags too (via the keys), so that the same secret can be cached for several algorithms.
+    uint64_t hash_keys[2][2];
+    memcpy(hash_keys, cache->hash_keys, sizeof(hash_keys));
+    hash_keys[0][1] ^= (uint64_t)hash_algo;
+    hash_keys[1][1] ^= (uint64_t)hash_algo;
+
+    const uint64_t tag0 = tfac_siphash(hash_keys[0], secret_key_base32, length);
+    const uint64_t tag1 = tfac_siphash(hash_keys[1], secret_key_base32, length);
+
+    memset(hash_keys, 0x00, sizeof(hash_keys));
+
+    struct tfac_key_cache_set* set = &cache->sets[tag0 & (cache->set_count - 1)];
+    struct tfac_key key;
+
+    tfac_key_cache_lock(set);
+
+    for (size_t i = 0; i < TFAC_KEY_CACHE_WAYS; i++)
+    {
+        if (set->last_used[i] != 0 && set->tags[i][0] == tag0 && set->tags[i][1] == tag1)
+        {
+            key = set->keys[i];
+            set->last_used[i] = ++set->clock;
+            set->hits++;
+            tfac_key_cache_unlock(set);
+            return key;
+        }
+    }
+
+    set->misses++;
+    tfac_key_cache_unlock(set);
+
+    // Decode outside of the lock: other threads looking up the same secret in the meantime just miss too.
+    key = tfac_key_init_base32(secret_key_base32, hash_algo);
+
+    tfac_key_cache_lock(set);
+
+    size_t victim = 0;
+
+    for (size_t i = 0; i < TFAC_KEY_CACHE_WAYS; i++)
+    {
+        // One of those other threads may have cached it already.
+        if (set->last_used[i] != 0 && set->tags[i][0] == tag0 && set->tags[i][1] == tag1)
+        {
+            victim = i;
+            break;
+        }
+
+        if (set->last_used[i] < set->last_used[victim])
+        {
+            victim = i;
+        }
+    }
+
+    set->keys[victim] = key;
+    set->tags[victim][0] = tag0;
+    set->tags[victim][1] = tag1;
+    set->last_used[victim] = ++set->clock;
+
+    tfac_key_cache_unlock(set);
+
+    return key;
+}
+
+void tfac_key_cache_count(struct tfac_key_cache* cache, uint64_t* hits, uint64_t* misses)
+{
+    *hits = 0;
+    *misses = 0;
+
+    for (size_t i = 0; i < cache->set_count; i++)
+    {
+        struct tfac_key_cache_set* set = &cache->sets[i];
+
+        tfac_key_cache_lock(set);
+        *hits += set->hits;
+        *misses += set->misses;
+        tfac_key_cache_unlock(set);
+    }
+}
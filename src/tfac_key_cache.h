@@ -0,0 +1,139 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/**
+ * @file tfac_key_cache.h
+ * @author Raphael Beck
+ * @brief Bounded cache of decoded base32 secrets and their HMAC midstates (internal header: not part of the public TFAC API).
+ */
+
+#ifndef TFAC_KEY_CACHE_H
+#define TFAC_KEY_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "tfac.h"
+#include "tfac_replay.h"
+
+/**
+ * How many keys a set of the key cache holds (secrets are mapped to a set, and can go into any one of its entries).
+ */
+#define TFAC_KEY_CACHE_WAYS 4
+
+/**
+ * A set of cached keys. The header (lock, counters and tags) is all that a lookup scans: only the key that it hits is read from the rest of the set.
+ */
+struct TFAC_CACHE_ALIGNED tfac_key_cache_set
+{
+    /**
+     * Spinlock guarding everything else in the set: <c>0</c> or <c>1</c>.
+     */
+    uint64_t lock;
+
+    /**
+     * Counts up with every lookup in this set: that's what #last_used is stamped with.
+     */
+    uint64_t clock;
+
+    /**
+     * How many lookups found their key in this set.
+     */
+    uint64_t hits;
+
+    /**
+     * How many lookups in this set had to decode their key.
+     */
+    uint64_t misses;
+
+    /**
+     * Two independently keyed SipHashes of the base32 secret (and hash algorithm) that each key was decoded from
+     * (128 bits: nobody can make two secrets collide without the cache's hash keys).
+     */
+    uint64_t tags[TFAC_KEY_CACHE_WAYS][2];
+
+    /**
+     * When each entry was last looked up (<c>0</c> = it's empty): the least recently used one is replaced.
+     */
+    uint64_t last_used[TFAC_KEY_CACHE_WAYS];
+
+    /**
+     * The cached keys.
+     */
+    struct tfac_key keys[TFAC_KEY_CACHE_WAYS];
+};
+
+/**
+ * Set-associative cache of tfac_key instances, keyed by base32 secret string and hash algorithm. Lookups are thread-safe.
+ */
+struct tfac_key_cache
+{
+    /**
+     * The two SipHash keys that the tags are computed with (random per cache).
+     */
+    uint64_t hash_keys[2][2];
+
+    /**
+     * How many sets there are (a power of two).
+     */
+    size_t set_count;
+
+    /**
+     * The 64-byte aligned sets.
+     */
+    struct tfac_key_cache_set* sets;
+};
+
+/**
+ * Allocates a new, empty key cache.
+ * @param entry_count How many keys to cache at most (rounded up to a power of two number of #TFAC_KEY_CACHE_WAYS sized sets).
+ * @param hash_key 32 random bytes to key the tags with.
+ * @return The key cache (release it with tfac_key_cache_free()); <c>NULL</c> if \p entry_count is <c>0</c> or out of memory.
+ */
+struct tfac_key_cache* tfac_key_cache_new(size_t entry_count, const uint8_t hash_key[32]);
+
+/**
+ * Wipes the cached keys and releases the cache. Make sure that no other thread is still using it!
+ * @param cache The cache to free (may be <c>NULL</c>).
+ */
+void tfac_key_cache_free(struct tfac_key_cache* cache);
+
+/**
+ * Looks up the key for a base32 secret, or decodes it (and caches it) if it's not in the cache yet.
+ * @param cache The key cache.
+ * @param secret_key_base32 The base32 encoded secret.
+ * @param hash_algo The hash algorithm to initialize the key for.
+ * @return The same tfac_key that <c>tfac_key_init_base32(secret_key_base32, hash_algo)</c> returns.
+ */
+struct tfac_key tfac_key_cache_get(struct tfac_key_cache* cache, const char* secret_key_base32, enum tfac_hash_algo hash_algo);
+
+/**
+ * Adds up the cache's hit and miss counters.
+ * @param cache The key cache.
+ * @param hits Where to write the total number of hits.
+ * @param misses Where to write the total number of misses.
+ */
+void tfac_key_cache_count(struct tfac_key_cache* cache, uint64_t* hits, uint64_t* misses);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // TFAC_KEY_CACHE_H
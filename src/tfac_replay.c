@@ -0,0 +1,248 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <string.h>
+
+#include "tfac_replay.h"
+
+// Slot layout: the upper 40 bits hold the fingerprint, the lower 24 bits the epoch that it was written for.
+// 24 bits are enough to tell older from newer epochs for 2^23 epochs (that's 8 years with 30-second epochs).
+#define TFAC_REPLAY_EPOCH_BITS 24
+#define TFAC_REPLAY_EPOCH_MASK ((UINT64_C(1) << TFAC_REPLAY_EPOCH_BITS) - 1)
+
+#define tfac_rotl64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+#define TFAC_SIPROUND(v0, v1, v2, v3)                                                                                                                                                                                                                          \
+    do                                                                                                                                                                                                                                                         \
+    {                                                                                                                                                                                                                                                          \
+        v0 += v1;                                                                                                                                                                                                                                              \
+        v1 = tfac_rotl64(v1, 13);                                                                                                                                                                                                                              \
+        v1 ^= v0;                                                                                                                                                                                                                                              \
+        v0 = tfac_rotl64(v0, 32);                                                                                                                                                                                                                              \
+        v2 += v3;                                                                                                                                                                                                                                              \
+        v3 = tfac_rotl64(v3, 16);                                                                                                                                                                                                                              \
+        v3 ^= v2;                                                                                                                                                                                                                                              \
+        v0 += v3;                                                                                                                                                                                                                                              \
+        v3 = tfac_rotl64(v3, 21);                                                                                                                                                                                                                              \
+        v3 ^= v0;                                                                                                                                                                                                                                              \
+        v2 += v1;                                                                                                                                                                                                                                              \
+        v1 = tfac_rotl64(v1, 17);                                                                                                                                                                                                                              \
+        v1 ^= v2;                                                                                                                                                                                                                                              \
+        v2 = tfac_rotl64(v2, 32);                                                                                                                                                                                                                              \
+    } while (0)
+
+static inline uint64_t tfac_load_le64(const uint8_t* p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+// Whether the slot value belongs to an epoch older than the given one (or the slot has never been used at all): such slots are free to be reused.
+static int tfac_replay_slot_is_free(const uint64_t value, const uint64_t epoch)
+{
+    const uint64_t age = (epoch - value) & TFAC_REPLAY_EPOCH_MASK;
+    return value == 0 || (age != 0 && age < (UINT64_C(1) << (TFAC_REPLAY_EPOCH_BITS - 1)));
+}
+
+void tfac_replay_init(struct tfac_replay_table* table, uint64_t* slots, const size_t slot_count, const uint32_t epoch_length)
+{
+    const size_t buckets_per_generation = slot_count / TFAC_REPLAY_GENERATIONS / TFAC_REPLAY_BUCKET_SLOTS;
+
+    table->slots_offset = (int64_t)((intptr_t)slots - (intptr_t)table);
+    table->buckets_per_generation = buckets_per_generation > UINT32_MAX ? UINT32_MAX : (uint32_t)buckets_per_generation;
+    table->epoch_length = epoch_length == 0 ? TFAC_REPLAY_EPOCH : epoch_length;
+    memset(table->epochs, 0x00, sizeof(table->epochs));
+    memset(table->key, 0x00, sizeof(table->key));
+    table->key_state = 0;
+
+    memset(slots, 0x00, (size_t)table->buckets_per_generation * TFAC_REPLAY_GENERATIONS * TFAC_REPLAY_BUCKET_SLOTS * sizeof(uint64_t));
+}
+
+uint8_t tfac_replay_has_key(const struct tfac_replay_table* table)
+{
+    return tfac_atomic_load(&table->key_state) == 2;
+}
+
+void tfac_replay_set_key(struct tfac_replay_table* table, const uint8_t key[16])
+{
+    if (tfac_atomic_cas(&table->key_state, 0, 1))
+    {
+        table->key[0] = tfac_load_le64(key);
+        table->key[1] = tfac_load_le64(key + 8);
+
+        // Publish the key (the CAS is a full barrier for the two stores above).
+        tfac_atomic_cas(&table->key_state, 1, 2);
+        return;
+    }
+
+    // Somebody else is setting the key right now: wait for theirs to become visible, so that no thread ever fingerprints with a half-written key.
+    while (tfac_atomic_load(&table->key_state) != 2)
+    {
+    }
+}
+
+uint64_t tfac_siphash(const uint64_t key[2], const void* data, const size_t length)
+{
+    const uint8_t* in = (const uint8_t*)data;
+    const uint64_t k0 = key[0];
+    const uint64_t k1 = key[1];
+
+    uint64_t v0 = k0 ^ UINT64_C(0x736f6d6570736575);
+    uint64_t v1 = k1 ^ UINT64_C(0x646f72616e646f6d);
+    uint64_t v2 = k0 ^ UINT64_C(0x6c7967656e657261);
+    uint64_t v3 = k1 ^ UINT64_C(0x7465646279746573);
+
+    const size_t blocks = length / 8;
+
+    for (size_t i = 0; i < blocks; i++, in += 8)
+    {
+        const uint64_t m = tfac_load_le64(in);
+        v3 ^= m;
+        TFAC_SIPROUND(v0, v1, v2, v3);
+        TFAC_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    // The last block holds the remaining bytes (if any) and the message length in its top byte.
+    uint64_t b = (uint64_t)length << 56;
+
+    for (size_t i = 0; i < (length & 7); i++)
+    {
+        b |= (uint64_t)in[i] << (8 * i);
+    }
+
+    v3 ^= b;
+    TFAC_SIPROUND(v0, v1, v2, v3);
+    TFAC_SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xFF;
+    TFAC_SIPROUND(v0, v1, v2, v3);
+    TFAC_SIPROUND(v0, v1, v2, v3);
+    TFAC_SIPROUND(v0, v1, v2, v3);
+    TFAC_SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t tfac_replay_fingerprint(const struct tfac_replay_table* table, const void* data, const size_t length)
+{
+    return tfac_siphash(table->key, data, length);
+}
+
+uint8_t tfac_replay_check_and_insert(struct tfac_replay_table* table, const uint64_t fingerprint, const uint64_t expires)
+{
+    if (table->buckets_per_generation == 0)
+    {
+        return 1;
+    }
+
+    // Tokens are grouped by when they expire rather than by their time step, so that tokens with different steps parameters can share the table.
+    // This only depends on the token itself: concurrent verifications of the same token always end up in the same generation.
+    const uint64_t epoch = (expires + table->epoch_length - 1) / table->epoch_length;
+
+    // Move the epoch's generation on to it if it's still holding an older epoch: that expires all of the generation's entries in one go.
+    uint64_t* generation_epoch = &table->epochs[epoch % TFAC_REPLAY_GENERATIONS];
+
+    for (uint64_t current = tfac_atomic_load(generation_epoch); current != epoch; current = tfac_atomic_load(generation_epoch))
+    {
+        if (current > epoch)
+        {
+            return 0;
+        }
+
+        tfac_atomic_cas(generation_epoch, current, epoch);
+    }
+
+    uint64_t value = (fingerprint & ~TFAC_REPLAY_EPOCH_MASK) | (epoch & TFAC_REPLAY_EPOCH_MASK);
+
+    if (value == 0)
+    {
+        value = UINT64_C(1) << TFAC_REPLAY_EPOCH_BITS;
+    }
+
+    // The upper half of the fingerprint picks the home bucket (multiply-shift instead of a division), the lowest fingerprint bits the slot to overwrite if need be.
+    const size_t generation_slots = (size_t)table->buckets_per_generation * TFAC_REPLAY_BUCKET_SLOTS;
+    const size_t home = (size_t)(((value >> 32) * table->buckets_per_generation) >> 32) * TFAC_REPLAY_BUCKET_SLOTS;
+    const size_t probe_slots = TFAC_REPLAY_PROBE_BUCKETS * TFAC_REPLAY_BUCKET_SLOTS < generation_slots ? TFAC_REPLAY_PROBE_BUCKETS * TFAC_REPLAY_BUCKET_SLOTS : generation_slots;
+
+    uint64_t* generation = (uint64_t*)((uint8_t*)table + table->slots_offset) + (epoch % TFAC_REPLAY_GENERATIONS) * generation_slots;
+    uint64_t* victim = generation + home + ((value >> TFAC_REPLAY_EPOCH_BITS) % TFAC_REPLAY_BUCKET_SLOTS);
+
+    for (;;)
+    {
+        uint64_t victim_value = 0;
+        size_t index = home;
+
+        // Wrapping around by hand: a modulo by the (runtime) generation size would cost a division per probed slot.
+        for (size_t i = 0; i < probe_slots; i++, index = index + 1 == generation_slots ? 0 : index + 1)
+        {
+            uint64_t* slot = generation + index;
+            const uint64_t current = tfac_atomic_load(slot);
+
+            if (current == value)
+            {
+                return 0;
+            }
+
+            if (tfac_replay_slot_is_free(current, epoch))
+            {
+                // Within an epoch, slots are taken front to back and only ever freed all at once (when the generation moves on),
+                // so every thread inserting the same fingerprint races for this very slot.
+                if (tfac_atomic_cas(slot, current, value))
+                {
+                    return 1;
+                }
+
+                if (tfac_atomic_load(slot) == value)
+                {
+                    return 0;
+                }
+
+                continue;
+            }
+
+            if (slot == victim && (current & TFAC_REPLAY_EPOCH_MASK) == (epoch & TFAC_REPLAY_EPOCH_MASK))
+            {
+                victim_value = current;
+            }
+        }
+
+        // Probe sequence full without our fingerprint in it: overwrite the victim slot, unless somebody else got there first (then re-check all of it).
+        if (victim_value != 0 && tfac_atomic_cas(victim, victim_value, value))
+        {
+            return 1;
+        }
+
+        // Slots holding a newer epoch than ours can only show up once our generation has moved on: then the token has expired anyway.
+        if (tfac_atomic_load(generation_epoch) != epoch)
+        {
+            return 0;
+        }
+    }
+}
+
+uint8_t tfac_replay_advance_step(uint64_t* last_accepted_step, const uint64_t step)
+{
+    for (uint64_t current = tfac_atomic_load(last_accepted_step); current < step; current = tfac_atomic_load(last_accepted_step))
+    {
+        if (tfac_atomic_cas(last_accepted_step, current, step))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/**
+ * @file tfac_replay.h
+ * @author Raphael Beck
+ * @brief Replay protection store for verified TOTPs (internal header: not part of the public TFAC API).
+ */
+
+#ifndef TFAC_REPLAY_H
+#define TFAC_REPLAY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * How many fingerprint slots make up one bucket of the replay table (8 x 64-bit = one cache line).
+ */
+#define TFAC_REPLAY_BUCKET_SLOTS 8
+
+/**
+ * How many consecutive buckets a fingerprint may be placed in (starting at its home bucket) before it has to evict somebody else's.
+ */
+#define TFAC_REPLAY_PROBE_BUCKETS 4
+
+/**
+ * Default length (in seconds) of the time slices that a replay table groups used tokens by (according to when they expire). <p>
+ * A table's epoch length must be at least as long as the largest TOTP steps parameter of the tokens that it holds, otherwise generations could be recycled before all of their tokens have expired
+ * (more precisely: <c>(TFAC_REPLAY_GENERATIONS - 1) * epoch_length</c> needs to cover three time steps, which is the verification window).
+ */
+#ifndef TFAC_REPLAY_EPOCH
+#define TFAC_REPLAY_EPOCH 30
+#endif
+
+/**
+ * How many epochs the replay table keeps apart: the three ones that the tokens of a verification window expire in, plus the one that is about to be recycled.
+ */
+#ifndef TFAC_REPLAY_GENERATIONS
+#define TFAC_REPLAY_GENERATIONS 4
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TFAC_CACHE_ALIGNED __declspec(align(64))
+#else
+#define TFAC_CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// Volatile accesses have acquire/release semantics with MSVC (/volatile:ms, the default on x86 and x64).
+#define tfac_atomic_load(p) (*(volatile uint64_t*)(p))
+#define tfac_atomic_cas(p, expected, desired) ((uint64_t)_InterlockedCompareExchange64((volatile __int64*)(p), (__int64)(desired), (__int64)(expected)) == (expected))
+#define tfac_atomic_store(p, v) (*(volatile uint64_t*)(p) = (v))
+#define tfac_atomic_fence() _ReadWriteBarrier()
+#else
+#define tfac_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define tfac_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define tfac_atomic_fence() __atomic_thread_fence(__ATOMIC_ACQ_REL)
+static inline int tfac_atomic_cas(uint64_t* p, uint64_t expected, const uint64_t desired)
+{
+    return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+/**
+ * Lock-free set of used token fingerprints, grouped by when the tokens expire. <p>
+ * Time is sliced into epochs of <c>epoch_length</c> seconds, and the slots are split into #TFAC_REPLAY_GENERATIONS generations:
+ * tokens that expire within epoch <c>e</c> live in generation <c>e % TFAC_REPLAY_GENERATIONS</c>.
+ * Every slot is tagged with the epoch that it was written for, so when a generation moves on to a newer epoch, all of its old entries expire at once
+ * (just by bumping the generation's epoch: nothing needs to be cleared). <p>
+ * Within a generation, every fingerprint has a home bucket (a cache line of #TFAC_REPLAY_BUCKET_SLOTS 64-bit slots) and claims the first free slot
+ * from there on with a single compare-and-swap: that way, two threads presenting the same token at the same time can never both succeed. <p>
+ * Only if all #TFAC_REPLAY_PROBE_BUCKETS buckets are taken (more tokens per epoch than the table was sized for) does a fingerprint overwrite one of its home bucket's slots.
+ */
+struct tfac_replay_table
+{
+    /**
+     * Where the fingerprint slots are (<c>TFAC_REPLAY_GENERATIONS * buckets_per_generation * TFAC_REPLAY_BUCKET_SLOTS</c> of them), in bytes relative to the table itself:
+     * that way, a table and its slots can live in memory that several processes map at different addresses.
+     */
+    int64_t slots_offset;
+
+    /**
+     * How many buckets each generation has.
+     */
+    uint32_t buckets_per_generation;
+
+    /**
+     * Length of an epoch in seconds (see #TFAC_REPLAY_EPOCH).
+     */
+    uint32_t epoch_length;
+
+    /**
+     * The epoch that each generation currently holds the used tokens of.
+     */
+    uint64_t epochs[TFAC_REPLAY_GENERATIONS];
+
+    /**
+     * Secret SipHash key that the fingerprints are computed with (random per process, so that nobody can craft tokens that collide on purpose).
+     */
+    uint64_t key[2];
+
+    /**
+     * Whether #key has been set yet: <c>0</c> = no, <c>1</c> = being set right now, <c>2</c> = yes.
+     */
+    uint64_t key_state;
+};
+
+/**
+ * Initializes a replay table on top of caller-provided memory.
+ * @param table The replay table to initialize.
+ * @param slots Memory for \p slot_count fingerprint slots (this is zeroed out here; ideally 64-byte aligned, so that every bucket is exactly one cache line).
+ * If the table is shared between processes, this must be in the same shared memory mapping as the table.
+ * @param slot_count How many slots there are (rounded down to a multiple of <c>TFAC_REPLAY_GENERATIONS * TFAC_REPLAY_BUCKET_SLOTS</c>).
+ * @param epoch_length Length of an epoch in seconds: at least the largest steps parameter of the tokens that will be checked against this table (<c>0</c> means #TFAC_REPLAY_EPOCH).
+ */
+void tfac_replay_init(struct tfac_replay_table* table, uint64_t* slots, size_t slot_count, uint32_t epoch_length);
+
+/**
+ * Checks whether the replay table's fingerprint key has been set already.
+ * @param table The replay table.
+ * @return <c>1</c> if it has (and can be used for fingerprinting); <c>0</c> if not.
+ */
+uint8_t tfac_replay_has_key(const struct tfac_replay_table* table);
+
+/**
+ * Sets the replay table's fingerprint key, unless another thread has already done so (the first key wins: every thread fingerprints with the same key afterwards).
+ * @param table The replay table.
+ * @param key 16 random bytes.
+ */
+void tfac_replay_set_key(struct tfac_replay_table* table, const uint8_t key[16]);
+
+/**
+ * SipHash-2-4: a fast keyed hash whose outputs can't be predicted (or made to collide on purpose) without the key.
+ * @param key The 128-bit key (as two little-endian 64-bit words).
+ * @param data The data to hash.
+ * @param length How many bytes there are in \p data.
+ * @return The 64-bit hash.
+ */
+uint64_t tfac_siphash(const uint64_t key[2], const void* data, size_t length);
+
+/**
+ * Computes the fingerprint of a used token (SipHash-2-4 with the table's key): cheap enough to run on every verification, and not predictable without the key.
+ * @param table The replay table (its key must have been set with tfac_replay_set_key() before).
+ * @param data The data that identifies the used token (e.g. its key, raw number and time step).
+ * @param length How many bytes there are in \p data.
+ * @return The 64-bit fingerprint to pass to tfac_replay_check_and_insert().
+ */
+uint64_t tfac_replay_fingerprint(const struct tfac_replay_table* table, const void* data, size_t length);
+
+/**
+ * Atomically checks whether the given fingerprint is already in the replay table, and inserts it if it's not. This is safe to call from multiple threads at once.
+ * @param table The replay table.
+ * @param fingerprint The fingerprint of the used token to check and insert (see tfac_replay_fingerprint()).
+ * @param expires The UTC timestamp from which on the token isn't accepted anymore anyway (the end of its verification window): its entry can be forgotten afterwards.
+ * @return <c>1</c> if the fingerprint was new (and has now been inserted); <c>0</c> if it was already in there (which means that the token is being replayed)
+ * or if \p expires is so long ago that its generation has already been recycled for a newer epoch.
+ */
+uint8_t tfac_replay_check_and_insert(struct tfac_replay_table* table, uint64_t fingerprint, uint64_t expires);
+
+/**
+ * Atomically moves a credential's last accepted time step forward to \p step (RFC 6238 section 5.2 style replay protection: no table needed at all).
+ * @param last_accepted_step The credential's last accepted step (8-byte aligned: this may be shared between threads).
+ * @param step The time step of the token that is being verified.
+ * @return <c>1</c> if \p step was newer than the last accepted step (which is now \p step); <c>0</c> if it wasn't (replayed or older token).
+ */
+uint8_t tfac_replay_advance_step(uint64_t* last_accepted_step, uint64_t step);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // TFAC_REPLAY_H
@@ -0,0 +1,163 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Multi-buffer HMAC-SHA1: eight independent HOTP computations side by side, one per 32-bit AVX2 lane.
+// Every HOTP's inner and outer hash is exactly one padded block on top of the key's precomputed midstates,
+// so there is no per-lane length bookkeeping to do: all eight lanes always run in lockstep.
+// Only ever called if tfac_cpu_detect_features() reported TFAC_CPU_AVX2.
+
+#include "tfac_cpu.h"
+
+#ifdef TFAC_X86
+
+#include <immintrin.h>
+
+#define TFAC_SHA1_X8_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+#define TFAC_SHA1_X8_SCHED(i) (w[(i)&15] = TFAC_SHA1_X8_ROTL(_mm256_xor_si256(_mm256_xor_si256(w[((i) + 13) & 15], w[((i) + 8) & 15]), _mm256_xor_si256(w[((i) + 2) & 15], w[(i)&15])), 1))
+
+#define TFAC_SHA1_X8_ROUND(f, k, wi)                                                                                                                                                                                                                           \
+    t = _mm256_add_epi32(_mm256_add_epi32(TFAC_SHA1_X8_ROTL(a, 5), (f)), _mm256_add_epi32(_mm256_add_epi32(e, (k)), (wi)));                                                                                                                                    \
+    e = d;                                                                                                                                                                                                                                                     \
+    d = c;                                                                                                                                                                                                                                                     \
+    c = TFAC_SHA1_X8_ROTL(b, 30);                                                                                                                                                                                                                              \
+    b = a;                                                                                                                                                                                                                                                     \
+    a = t;
+
+#define TFAC_SHA1_X8_CH(b, c, d) _mm256_xor_si256((d), _mm256_and_si256((b), _mm256_xor_si256((c), (d))))
+#define TFAC_SHA1_X8_PARITY(b, c, d) _mm256_xor_si256(_mm256_xor_si256((b), (c)), (d))
+#define TFAC_SHA1_X8_MAJ(b, c, d) _mm256_or_si256(_mm256_and_si256((b), (c)), _mm256_and_si256((d), _mm256_or_si256((b), (c))))
+
+/*
+ * One SHA-1 compression on eight lanes at once.
+ * The message schedule w is consumed (overwritten) in place.
+ */
+TFAC_TARGET("avx2")
+static inline void tfac_sha1_x8_compress(__m256i state[5], __m256i w[16])
+{
+    const __m256i k0 = _mm256_set1_epi32(0x5A827999);
+    const __m256i k1 = _mm256_set1_epi32(0x6ED9EBA1);
+    const __m256i k2 = _mm256_set1_epi32((int)0x8F1BBCDC);
+    const __m256i k3 = _mm256_set1_epi32((int)0xCA62C1D6);
+
+    __m256i a = state[0];
+    __m256i b = state[1];
+    __m256i c = state[2];
+    __m256i d = state[3];
+    __m256i e = state[4];
+    __m256i t;
+
+    int i = 0;
+
+    for (; i < 16; i++)
+    {
+        TFAC_SHA1_X8_ROUND(TFAC_SHA1_X8_CH(b, c, d), k0, w[i])
+    }
+
+    for (; i < 20; i++)
+    {
+        TFAC_SHA1_X8_ROUND(TFAC_SHA1_X8_CH(b, c, d), k0, TFAC_SHA1_X8_SCHED(i))
+    }
+
+    for (; i < 40; i++)
+    {
+        TFAC_SHA1_X8_ROUND(TFAC_SHA1_X8_PARITY(b, c, d), k1, TFAC_SHA1_X8_SCHED(i))
+    }
+
+    for (; i < 60; i++)
+    {
+        TFAC_SHA1_X8_ROUND(TFAC_SHA1_X8_MAJ(b, c, d), k2, TFAC_SHA1_X8_SCHED(i))
+    }
+
+    for (; i < 80; i++)
+    {
+        TFAC_SHA1_X8_ROUND(TFAC_SHA1_X8_PARITY(b, c, d), k3, TFAC_SHA1_X8_SCHED(i))
+    }
+
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+}
+
+TFAC_TARGET("avx2")
+static inline __m256i tfac_sha1_x8_gather(const uint32_t* const* states, const int word)
+{
+    return _mm256_set_epi32((int)states[7][word], (int)states[6][word], (int)states[5][word], (int)states[4][word], (int)states[3][word], (int)states[2][word], (int)states[1][word], (int)states[0][word]);
+}
+
+TFAC_TARGET("avx2")
+void tfac_hmac_sha1_x8_avx2(const uint32_t* const* inner_states, const uint32_t* const* outer_states, const uint64_t* counters, uint32_t (*digests)[5])
+{
+    __m256i inner[5];
+    __m256i outer[5];
+    __m256i w[16];
+
+    for (int i = 0; i < 5; i++)
+    {
+        inner[i] = tfac_sha1_x8_gather(inner_states, i);
+        outer[i] = tfac_sha1_x8_gather(outer_states, i);
+    }
+
+    // Inner hash: the 8-byte big-endian counter, then padding for a 64 + 8 byte message.
+    w[0] = _mm256_set_epi32((int)(counters[7] >> 32), (int)(counters[6] >> 32), (int)(counters[5] >> 32), (int)(counters[4] >> 32), (int)(counters[3] >> 32), (int)(counters[2] >> 32), (int)(counters[1] >> 32), (int)(counters[0] >> 32));
+    w[1] = _mm256_set_epi32((int)counters[7], (int)counters[6], (int)counters[5], (int)counters[4], (int)counters[3], (int)counters[2], (int)counters[1], (int)counters[0]);
+    w[2] = _mm256_set1_epi32((int)0x80000000);
+
+    for (int i = 3; i < 15; i++)
+    {
+        w[i] = _mm256_setzero_si256();
+    }
+
+    w[15] = _mm256_set1_epi32((64 + 8) * 8);
+
+    tfac_sha1_x8_compress(inner, w);
+
+    // Outer hash: the 20-byte inner digest, then padding for a 64 + 20 byte message.
+    for (int i = 0; i < 5; i++)
+    {
+        w[i] = inner[i];
+    }
+
+    w[5] = _mm256_set1_epi32((int)0x80000000);
+
+    for (int i = 6; i < 15; i++)
+    {
+        w[i] = _mm256_setzero_si256();
+    }
+
+    w[15] = _mm256_set1_epi32((64 + 20) * 8);
+
+    tfac_sha1_x8_compress(outer, w);
+
+    uint32_t words[5][8];
+
+    for (int i = 0; i < 5; i++)
+    {
+        _mm256_storeu_si256((__m256i*)words[i], outer[i]);
+    }
+
+    for (int lane = 0; lane < 8; lane++)
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            digests[lane][i] = words[i][lane];
+        }
+    }
+}
+
+#endif // TFAC_X86
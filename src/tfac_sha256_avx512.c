@@ -0,0 +1,216 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Multi-buffer SHA-256/SHA-224: sixteen independent compressions side by side, one per 32-bit AVX-512 lane.
+// Same idea as the AVX2 SHA-1 engine in tfac_sha1_avx2.c: HOTP's inner and outer hashes are exactly one padded block each,
+// so all sixteen lanes always run in lockstep on top of their keys' precomputed midstates.
+// Only ever called if tfac_cpu_detect_features() reported TFAC_CPU_AVX512F.
+
+#include "tfac_cpu.h"
+
+#ifdef TFAC_X86
+
+#include <immintrin.h>
+
+#include "picohash.h"
+
+// 0x96 = a ^ b ^ c, 0xCA = a ? b : c (Ch), 0xE8 = majority of a, b and c (Maj).
+#define TFAC_SHA256_X16_XOR3(a, b, c) _mm512_ternarylogic_epi32((a), (b), (c), 0x96)
+#define TFAC_SHA256_X16_CH(e, f, g) _mm512_ternarylogic_epi32((e), (f), (g), 0xCA)
+#define TFAC_SHA256_X16_MAJ(a, b, c) _mm512_ternarylogic_epi32((a), (b), (c), 0xE8)
+
+#define TFAC_SHA256_X16_S0(x) TFAC_SHA256_X16_XOR3(_mm512_ror_epi32((x), 2), _mm512_ror_epi32((x), 13), _mm512_ror_epi32((x), 22))
+#define TFAC_SHA256_X16_S1(x) TFAC_SHA256_X16_XOR3(_mm512_ror_epi32((x), 6), _mm512_ror_epi32((x), 11), _mm512_ror_epi32((x), 25))
+#define TFAC_SHA256_X16_G0(x) TFAC_SHA256_X16_XOR3(_mm512_ror_epi32((x), 7), _mm512_ror_epi32((x), 18), _mm512_srli_epi32((x), 3))
+#define TFAC_SHA256_X16_G1(x) TFAC_SHA256_X16_XOR3(_mm512_ror_epi32((x), 17), _mm512_ror_epi32((x), 19), _mm512_srli_epi32((x), 10))
+
+#define TFAC_SHA256_X16_SCHED(i) (w[(i)&15] = _mm512_add_epi32(_mm512_add_epi32(TFAC_SHA256_X16_G1(w[((i) + 14) & 15]), w[((i) + 9) & 15]), _mm512_add_epi32(TFAC_SHA256_X16_G0(w[((i) + 1) & 15]), w[(i)&15])))
+
+#define TFAC_SHA256_X16_ROUND(i, wi)                                                                                                                                                                                                                           \
+    t1 = _mm512_add_epi32(_mm512_add_epi32(_mm512_add_epi32(h, TFAC_SHA256_X16_S1(e)), TFAC_SHA256_X16_CH(e, f, g)), _mm512_add_epi32(_mm512_set1_epi32((int)_picohash_sha256_K[(i)]), (wi)));                                                                 \
+    t2 = _mm512_add_epi32(TFAC_SHA256_X16_S0(a), TFAC_SHA256_X16_MAJ(a, b, c));                                                                                                                                                                                \
+    h = g;                                                                                                                                                                                                                                                     \
+    g = f;                                                                                                                                                                                                                                                     \
+    f = e;                                                                                                                                                                                                                                                     \
+    e = _mm512_add_epi32(d, t1);                                                                                                                                                                                                                               \
+    d = c;                                                                                                                                                                                                                                                     \
+    c = b;                                                                                                                                                                                                                                                     \
+    b = a;                                                                                                                                                                                                                                                     \
+    a = _mm512_add_epi32(t1, t2);
+
+/*
+ * One SHA-256 compression on sixteen lanes at once.
+ * The message schedule w is consumed (overwritten) in place.
+ */
+TFAC_TARGET("avx512f")
+static inline void tfac_sha256_x16_compress(__m512i state[8], __m512i w[16])
+{
+    __m512i a = state[0];
+    __m512i b = state[1];
+    __m512i c = state[2];
+    __m512i d = state[3];
+    __m512i e = state[4];
+    __m512i f = state[5];
+    __m512i g = state[6];
+    __m512i h = state[7];
+    __m512i t1, t2;
+
+    int i = 0;
+
+    for (; i < 16; i++)
+    {
+        TFAC_SHA256_X16_ROUND(i, w[i])
+    }
+
+    for (; i < 64; i++)
+    {
+        TFAC_SHA256_X16_ROUND(i, TFAC_SHA256_X16_SCHED(i))
+    }
+
+    state[0] = _mm512_add_epi32(state[0], a);
+    state[1] = _mm512_add_epi32(state[1], b);
+    state[2] = _mm512_add_epi32(state[2], c);
+    state[3] = _mm512_add_epi32(state[3], d);
+    state[4] = _mm512_add_epi32(state[4], e);
+    state[5] = _mm512_add_epi32(state[5], f);
+    state[6] = _mm512_add_epi32(state[6], g);
+    state[7] = _mm512_add_epi32(state[7], h);
+}
+
+// Transposes word i of sixteen separate 8-word states into one vector (and back).
+
+TFAC_TARGET("avx512f")
+static inline void tfac_sha256_x16_load_states(__m512i out[8], const uint32_t* const* states)
+{
+    uint32_t words[8][16];
+
+    for (int lane = 0; lane < 16; lane++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            words[i][lane] = states[lane][i];
+        }
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        out[i] = _mm512_loadu_si512(words[i]);
+    }
+}
+
+TFAC_TARGET("avx512f")
+static inline void tfac_sha256_x16_store_states(uint32_t (*out)[8], const __m512i states[8])
+{
+    uint32_t words[8][16];
+
+    for (int i = 0; i < 8; i++)
+    {
+        _mm512_storeu_si512(words[i], states[i]);
+    }
+
+    for (int lane = 0; lane < 16; lane++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            out[lane][i] = words[i][lane];
+        }
+    }
+}
+
+TFAC_TARGET("avx512f")
+void tfac_sha256_compress_x16_avx512(uint32_t* const* states, const uint8_t* const* blocks)
+{
+    __m512i state[8];
+    __m512i w[16];
+    uint32_t words[16][16];
+
+    for (int lane = 0; lane < 16; lane++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            words[i][lane] = _picohash_load_be32(blocks[lane] + i * 4);
+        }
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = _mm512_loadu_si512(words[i]);
+    }
+
+    tfac_sha256_x16_load_states(state, (const uint32_t* const*)states);
+    tfac_sha256_x16_compress(state, w);
+
+    uint32_t out[16][8];
+    tfac_sha256_x16_store_states(out, state);
+
+    for (int lane = 0; lane < 16; lane++)
+    {
+        memcpy(states[lane], out[lane], sizeof(out[lane]));
+    }
+}
+
+TFAC_TARGET("avx512f")
+void tfac_hmac_sha256_x16_avx512(const uint32_t* const* inner_states, const uint32_t* const* outer_states, const uint64_t* counters, const size_t digest_words, uint32_t (*digests)[8])
+{
+    __m512i inner[8];
+    __m512i outer[8];
+    __m512i w[16];
+
+    uint32_t counter_words[2][16];
+
+    for (int lane = 0; lane < 16; lane++)
+    {
+        counter_words[0][lane] = (uint32_t)(counters[lane] >> 32);
+        counter_words[1][lane] = (uint32_t)counters[lane];
+    }
+
+    tfac_sha256_x16_load_states(inner, inner_states);
+    tfac_sha256_x16_load_states(outer, outer_states);
+
+    // Inner hash: the 8-byte big-endian counter, then padding for a 64 + 8 byte message.
+    w[0] = _mm512_loadu_si512(counter_words[0]);
+    w[1] = _mm512_loadu_si512(counter_words[1]);
+    w[2] = _mm512_set1_epi32((int)0x80000000);
+
+    for (int i = 3; i < 15; i++)
+    {
+        w[i] = _mm512_setzero_si512();
+    }
+
+    w[15] = _mm512_set1_epi32((64 + 8) * 8);
+
+    tfac_sha256_x16_compress(inner, w);
+
+    // Outer hash: the inner digest (7 words for SHA-224, 8 for SHA-256), then padding for a 64 + digest length byte message.
+    for (size_t i = 0; i < digest_words; i++)
+    {
+        w[i] = inner[i];
+    }
+
+    w[digest_words] = _mm512_set1_epi32((int)0x80000000);
+
+    for (size_t i = digest_words + 1; i < 15; i++)
+    {
+        w[i] = _mm512_setzero_si512();
+    }
+
+    w[15] = _mm512_set1_epi32((int)(64 + digest_words * 4) * 8);
+
+    tfac_sha256_x16_compress(outer, w);
+    tfac_sha256_x16_store_states(digests, outer);
+}
+
+#endif // TFAC_X86
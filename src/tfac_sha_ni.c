@@ -0,0 +1,201 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// SHA-1 and SHA-256 compression functions using the Intel SHA extensions.
+// These follow the structure of Intel's reference code ("Intel SHA Extensions", Gulley et al., 2013).
+// Only ever called if tfac_cpu_detect_features() reported TFAC_CPU_SHA_NI.
+
+#include "tfac_cpu.h"
+
+#ifdef TFAC_X86
+
+#include <immintrin.h>
+
+#include "picohash.h"
+
+/*
+ * Four SHA-1 rounds in the steady state: consume message word group m0 while
+ * the schedule for the upcoming groups (m1..m3) is computed alongside.
+ */
+#define TFAC_SHA1_NI_QUAD(e_in, e_out, m0, m1, m2, m3, f)                                                                                                                                                                                                      \
+    e_in = _mm_sha1nexte_epu32(e_in, m0);                                                                                                                                                                                                                      \
+    e_out = abcd;                                                                                                                                                                                                                                              \
+    m1 = _mm_sha1msg2_epu32(m1, m0);                                                                                                                                                                                                                           \
+    abcd = _mm_sha1rnds4_epu32(abcd, e_in, f);                                                                                                                                                                                                                 \
+    m3 = _mm_sha1msg1_epu32(m3, m0);                                                                                                                                                                                                                           \
+    m2 = _mm_xor_si128(m2, m0);
+
+TFAC_TARGET("sha,sse4.1")
+void tfac_sha1_compress_sha_ni(uint32_t* state, const uint8_t* block)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    __m128i e1;
+
+    const __m128i abcd_save = abcd;
+    const __m128i e0_save = e0;
+
+    __m128i msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 0)), mask);
+    __m128i msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16)), mask);
+    __m128i msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 32)), mask);
+    __m128i msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 48)), mask);
+
+    // Rounds 0-3
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    // Rounds 4-7
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    // Rounds 8-11
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    // Rounds 12-15
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    // Rounds 16-67
+    TFAC_SHA1_NI_QUAD(e0, e1, msg0, msg1, msg2, msg3, 0)
+    TFAC_SHA1_NI_QUAD(e1, e0, msg1, msg2, msg3, msg0, 1)
+    TFAC_SHA1_NI_QUAD(e0, e1, msg2, msg3, msg0, msg1, 1)
+    TFAC_SHA1_NI_QUAD(e1, e0, msg3, msg0, msg1, msg2, 1)
+    TFAC_SHA1_NI_QUAD(e0, e1, msg0, msg1, msg2, msg3, 1)
+    TFAC_SHA1_NI_QUAD(e1, e0, msg1, msg2, msg3, msg0, 1)
+    TFAC_SHA1_NI_QUAD(e0, e1, msg2, msg3, msg0, msg1, 2)
+    TFAC_SHA1_NI_QUAD(e1, e0, msg3, msg0, msg1, msg2, 2)
+    TFAC_SHA1_NI_QUAD(e0, e1, msg0, msg1, msg2, msg3, 2)
+    TFAC_SHA1_NI_QUAD(e1, e0, msg1, msg2, msg3, msg0, 2)
+    TFAC_SHA1_NI_QUAD(e0, e1, msg2, msg3, msg0, msg1, 2)
+    TFAC_SHA1_NI_QUAD(e1, e0, msg3, msg0, msg1, msg2, 3)
+    TFAC_SHA1_NI_QUAD(e0, e1, msg0, msg1, msg2, msg3, 3)
+
+    // Rounds 68-71
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    // Rounds 72-75
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    // Rounds 76-79
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+/*
+ * Four SHA-256 rounds on the (already expanded) message words in m0, while
+ * the schedule for the next group (m1) is finished and the one after that (m3, the previous group) is started.
+ */
+#define TFAC_SHA256_NI_QUAD(i, m0, m1, m3)                                                                                                                                                                                                                     \
+    msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i*)(_picohash_sha256_K + (i))));                                                                                                                                                                      \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                                                                                                                                                                                                       \
+    m1 = _mm_sha256msg2_epu32(_mm_add_epi32(m1, _mm_alignr_epi8(m0, m3, 4)), m0);                                                                                                                                                                              \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));                                                                                                                                                                              \
+    m3 = _mm_sha256msg1_epu32(m3, m0);
+
+TFAC_TARGET("sha,sse4.1")
+void tfac_sha256_compress_sha_ni(uint32_t* state, const uint8_t* block)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // Rearrange the state from ABCD/EFGH into the ABEF/CDGH layout that sha256rnds2 wants.
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    const __m128i abef_save = state0;
+    const __m128i cdgh_save = state1;
+
+    __m128i msg;
+    __m128i msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 0)), mask);
+    __m128i msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16)), mask);
+    __m128i msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 32)), mask);
+    __m128i msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 48)), mask);
+
+    // Rounds 0-3
+    msg = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*)(_picohash_sha256_K + 0)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+    // Rounds 4-7
+    msg = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*)(_picohash_sha256_K + 4)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+    msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+    // Rounds 8-11
+    msg = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*)(_picohash_sha256_K + 8)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+    msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+    // Rounds 12-59
+    TFAC_SHA256_NI_QUAD(12, msg3, msg0, msg2)
+    TFAC_SHA256_NI_QUAD(16, msg0, msg1, msg3)
+    TFAC_SHA256_NI_QUAD(20, msg1, msg2, msg0)
+    TFAC_SHA256_NI_QUAD(24, msg2, msg3, msg1)
+    TFAC_SHA256_NI_QUAD(28, msg3, msg0, msg2)
+    TFAC_SHA256_NI_QUAD(32, msg0, msg1, msg3)
+    TFAC_SHA256_NI_QUAD(36, msg1, msg2, msg0)
+    TFAC_SHA256_NI_QUAD(40, msg2, msg3, msg1)
+    TFAC_SHA256_NI_QUAD(44, msg3, msg0, msg2)
+    TFAC_SHA256_NI_QUAD(48, msg0, msg1, msg3)
+    TFAC_SHA256_NI_QUAD(52, msg1, msg2, msg0)
+    TFAC_SHA256_NI_QUAD(56, msg2, msg3, msg1)
+
+    // Rounds 60-63
+    msg = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*)(_picohash_sha256_K + 60)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+
+    // ...and back from ABEF/CDGH to ABCD/EFGH.
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#endif // TFAC_X86
@@ -0,0 +1,556 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tfac_wal.h"
+#include "tfac_replay.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#define TFAC_WAL_LOG_MAGIC "TFACWAL"
+#define TFAC_WAL_SNAPSHOT_MAGIC "TFACSNP"
+#define TFAC_WAL_VERSION 1
+
+#define TFAC_WAL_EXPIRES_MASK ((UINT64_C(1) << 40) - 1)
+
+// The background flusher sleeps this long at most between checks (so that closing the log never waits for a long fsync interval).
+#define TFAC_WAL_FLUSH_POLL_MS 100
+
+// Header of both the log and the snapshot file (the records follow right after it, in host byte order: these files aren't meant to be moved between machines).
+struct tfac_wal_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint8_t key[16];
+};
+
+static void tfac_wal_yield()
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+// Creates (or truncates) a file for writing that only its owner can read: the headers hold the fingerprint key, with which anyone could craft colliding entries.
+static FILE* tfac_wal_create(const char* path)
+{
+#ifdef _WIN32
+    return fopen(path, "wb");
+#else
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE* file = fd != -1 && fchmod(fd, 0600) == 0 ? fdopen(fd, "wb") : NULL;
+
+    if (fd != -1 && file == NULL)
+    {
+        close(fd);
+    }
+
+    return file;
+#endif
+}
+
+static uint64_t tfac_wal_now_ms()
+{
+#ifdef _WIN32
+    return (uint64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static void tfac_wal_sleep_ms(const uint64_t ms)
+{
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    const struct timespec duration = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000L };
+    nanosleep(&duration, NULL);
+#endif
+}
+
+static uint8_t tfac_wal_fsync(FILE* file)
+{
+    if (fflush(file) != 0)
+    {
+        return 0;
+    }
+
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+static void tfac_wal_spin_lock(uint64_t* lock)
+{
+    while (!tfac_atomic_cas(lock, 0, 1))
+    {
+        tfac_wal_yield();
+    }
+}
+
+static void tfac_wal_unlock(uint64_t* lock)
+{
+    tfac_atomic_cas(lock, 1, 0);
+}
+
+static uint64_t tfac_wal_check_bits(const uint64_t fingerprint, const uint64_t meta)
+{
+    return (((fingerprint ^ (meta & ((UINT64_C(1) << 48) - 1))) * UINT64_C(0x9E3779B97F4A7C15)) >> 48) << 48;
+}
+
+static struct tfac_wal_record tfac_wal_make_record(const uint64_t fingerprint, const uint64_t expires, const uint8_t steps)
+{
+    struct tfac_wal_record record;
+    record.fingerprint = fingerprint;
+    record.meta = (expires & TFAC_WAL_EXPIRES_MASK) | ((uint64_t)steps << 40);
+    record.meta |= tfac_wal_check_bits(record.fingerprint, record.meta);
+    return record;
+}
+
+static uint8_t tfac_wal_write_header(FILE* file, const char* magic, const uint8_t key[16])
+{
+    struct tfac_wal_file_header header;
+    memset(&header, 0x00, sizeof(header));
+    memcpy(header.magic, magic, sizeof(header.magic));
+    memcpy(header.key, key, sizeof(header.key));
+    header.version = TFAC_WAL_VERSION;
+    header.record_size = sizeof(struct tfac_wal_record);
+
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+// Reads a snapshot or log file's header (files that don't exist or whose header was never fully written count as empty):
+// returns 0 if the file isn't what it should be, or if its key doesn't match the one that was read before.
+static uint8_t tfac_wal_read_header(FILE* file, const char* magic, uint8_t key[16], uint8_t* have_key)
+{
+    struct tfac_wal_file_header header;
+
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1)
+    {
+        return 1;
+    }
+
+    if (memcmp(header.magic, magic, sizeof(header.magic)) != 0 || header.version != TFAC_WAL_VERSION || header.record_size != sizeof(struct tfac_wal_record))
+    {
+        return 0;
+    }
+
+    if (*have_key)
+    {
+        return memcmp(header.key, key, sizeof(header.key)) == 0;
+    }
+
+    memcpy(key, header.key, sizeof(header.key));
+    *have_key = 1;
+    return 1;
+}
+
+// Reads the records of a snapshot or log file up to the first torn one, and passes the unexpired ones on.
+static void tfac_wal_read_records(const char* path, const char* magic, const uint8_t key[16], const uint64_t now, void (*fn)(void* ctx, const struct tfac_wal_record* record), void* ctx)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        return;
+    }
+
+    uint8_t file_key[16];
+    uint8_t have_key = 0;
+
+    if (tfac_wal_read_header(file, magic, file_key, &have_key) && have_key && memcmp(file_key, key, sizeof(file_key)) == 0)
+    {
+        struct tfac_wal_record records[256];
+        size_t n;
+
+        while ((n = fread(records, sizeof(struct tfac_wal_record), sizeof(records) / sizeof(records[0]), file)) > 0)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                if ((records[i].meta & ~((UINT64_C(1) << 48) - 1)) != tfac_wal_check_bits(records[i].fingerprint, records[i].meta))
+                {
+                    fclose(file);
+                    return;
+                }
+
+                if ((records[i].meta & TFAC_WAL_EXPIRES_MASK) > now)
+                {
+                    fn(ctx, &records[i]);
+                }
+            }
+        }
+    }
+
+    fclose(file);
+}
+
+// Writes out the appended records and tells their waiters how that went (the caller holds the writing flag).
+static uint8_t tfac_wal_write(struct tfac_wal* wal)
+{
+    tfac_wal_spin_lock(&wal->lock);
+
+    struct tfac_wal_record* records = wal->records;
+    uint64_t** waiters = wal->waiters;
+    const size_t record_count = wal->record_count;
+
+    wal->records = wal->writing_records;
+    wal->writing_records = records;
+    wal->waiters = wal->writing_waiters;
+    wal->writing_waiters = waiters;
+    wal->record_count = 0;
+
+    tfac_wal_unlock(&wal->lock);
+
+    if (record_count == 0)
+    {
+        return tfac_atomic_load(&wal->failed) == 0;
+    }
+
+    const uint64_t last_sync_ms = tfac_atomic_load(&wal->last_sync_ms);
+
+    // A failed write may have left a torn record behind, and loading stops at that: appending more records after it would only lose them, so the log stays failed until it's compacted.
+    const uint8_t r = tfac_atomic_load(&wal->failed) == 0 && wal->log != NULL && fwrite(records, sizeof(struct tfac_wal_record), record_count, wal->log) == record_count && tfac_wal_fsync(wal->log);
+
+    if (r)
+    {
+        tfac_atomic_cas(&wal->last_sync_ms, last_sync_ms, tfac_wal_now_ms());
+    }
+    else
+    {
+        tfac_atomic_cas(&wal->failed, 0, 1);
+    }
+
+    for (size_t i = 0; i < record_count; i++)
+    {
+        if (waiters[i] != NULL)
+        {
+            tfac_atomic_store(waiters[i], r ? 1 : 2);
+        }
+    }
+
+    return r;
+}
+
+// Batched mode: writes out the buffered records once they're due, whether or not any more appends come along to do that.
+static void tfac_wal_flush_run(struct tfac_wal* wal)
+{
+    while (!tfac_atomic_load(&wal->stop))
+    {
+        const uint64_t due = tfac_atomic_load(&wal->last_sync_ms) + wal->fsync_interval_ms;
+        const uint64_t now = tfac_wal_now_ms();
+
+        if (now >= due && tfac_atomic_cas(&wal->writing, 0, 1))
+        {
+            tfac_wal_write(wal);
+            tfac_wal_unlock(&wal->writing);
+        }
+
+        const uint64_t wait_ms = now >= due ? wal->fsync_interval_ms : due - now;
+        tfac_wal_sleep_ms(wait_ms < TFAC_WAL_FLUSH_POLL_MS ? wait_ms : TFAC_WAL_FLUSH_POLL_MS);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI tfac_wal_flush_thread_main(LPVOID wal)
+{
+    tfac_wal_flush_run((struct tfac_wal*)wal);
+    return 0;
+}
+#else
+static void* tfac_wal_flush_thread_main(void* wal)
+{
+    tfac_wal_flush_run((struct tfac_wal*)wal);
+    return NULL;
+}
+#endif
+
+uint8_t tfac_wal_open(struct tfac_wal* wal, const char* path, const uint32_t fsync_interval_ms, uint8_t key[16])
+{
+    memset(wal, 0x00, sizeof(struct tfac_wal));
+
+    const size_t path_length = strlen(path);
+
+    wal->snapshot_path = malloc(path_length + 1);
+    wal->log_path = malloc(path_length + 5);
+    wal->records = malloc(TFAC_WAL_BUFFER_RECORDS * sizeof(struct tfac_wal_record));
+    wal->writing_records = malloc(TFAC_WAL_BUFFER_RECORDS * sizeof(struct tfac_wal_record));
+    wal->waiters = malloc(TFAC_WAL_BUFFER_RECORDS * sizeof(uint64_t*));
+    wal->writing_waiters = malloc(TFAC_WAL_BUFFER_RECORDS * sizeof(uint64_t*));
+    wal->fsync_interval_ms = fsync_interval_ms;
+    wal->last_sync_ms = tfac_wal_now_ms();
+
+    if (wal->snapshot_path == NULL || wal->log_path == NULL || wal->records == NULL || wal->writing_records == NULL || wal->waiters == NULL || wal->writing_waiters == NULL)
+    {
+        tfac_wal_close(wal);
+        return 0;
+    }
+
+    memcpy(wal->snapshot_path, path, path_length + 1);
+    memcpy(wal->log_path, path, path_length);
+    memcpy(wal->log_path + path_length, ".wal", 5);
+
+    FILE* snapshot = fopen(wal->snapshot_path, "rb");
+    FILE* log = fopen(wal->log_path, "rb");
+
+    uint8_t have_key = 0;
+    const uint8_t valid = tfac_wal_read_header(snapshot, TFAC_WAL_SNAPSHOT_MAGIC, wal->key, &have_key) && tfac_wal_read_header(log, TFAC_WAL_LOG_MAGIC, wal->key, &have_key);
+
+    if (snapshot != NULL)
+    {
+        fclose(snapshot);
+    }
+
+    if (log != NULL)
+    {
+        fclose(log);
+    }
+
+    if (!valid)
+    {
+        tfac_wal_close(wal);
+        return 0;
+    }
+
+    if (have_key)
+    {
+        memcpy(key, wal->key, sizeof(wal->key));
+    }
+    else
+    {
+        memcpy(wal->key, key, sizeof(wal->key));
+    }
+
+    if (fsync_interval_ms != 0)
+    {
+#ifdef _WIN32
+        wal->flusher = CreateThread(NULL, 0, tfac_wal_flush_thread_main, wal, 0, NULL);
+        wal->flusher_started = wal->flusher != NULL;
+#else
+        wal->flusher_started = pthread_create(&wal->flusher, NULL, tfac_wal_flush_thread_main, wal) == 0;
+#endif
+
+        if (!wal->flusher_started)
+        {
+            tfac_wal_close(wal);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+struct tfac_wal_load_ctx
+{
+    tfac_wal_load_fn load;
+    void* user;
+};
+
+static void tfac_wal_load_record(void* ctx, const struct tfac_wal_record* record)
+{
+    const struct tfac_wal_load_ctx* load_ctx = (const struct tfac_wal_load_ctx*)ctx;
+    load_ctx->load(load_ctx->user, record->fingerprint, record->meta & TFAC_WAL_EXPIRES_MASK, (uint8_t)(record->meta >> 40));
+}
+
+uint8_t tfac_wal_load(struct tfac_wal* wal, tfac_wal_load_fn load, void* user)
+{
+    const uint64_t now = (uint64_t)time(0);
+
+    struct tfac_wal_load_ctx ctx;
+    ctx.load = load;
+    ctx.user = user;
+
+    tfac_wal_read_records(wal->snapshot_path, TFAC_WAL_SNAPSHOT_MAGIC, wal->key, now, &tfac_wal_load_record, &ctx);
+    tfac_wal_read_records(wal->log_path, TFAC_WAL_LOG_MAGIC, wal->key, now, &tfac_wal_load_record, &ctx);
+
+    return tfac_wal_compact(wal);
+}
+
+uint8_t tfac_wal_sync(struct tfac_wal* wal)
+{
+    tfac_wal_spin_lock(&wal->writing);
+    const uint8_t r = tfac_wal_write(wal);
+    tfac_wal_unlock(&wal->writing);
+
+    return r;
+}
+
+uint8_t tfac_wal_append(struct tfac_wal* wal, const uint64_t fingerprint, const uint64_t expires, const uint8_t steps)
+{
+    const struct tfac_wal_record record = tfac_wal_make_record(fingerprint, expires, steps);
+
+    // Synchronous mode: whoever writes out the batch that our record ends up in reports here whether it made it to disk.
+    uint64_t written = 0;
+
+    tfac_wal_spin_lock(&wal->lock);
+
+    // Buffer full: write it out first (or wait for whoever is already doing so).
+    while (wal->record_count == TFAC_WAL_BUFFER_RECORDS)
+    {
+        tfac_wal_unlock(&wal->lock);
+        tfac_wal_sync(wal);
+        tfac_wal_spin_lock(&wal->lock);
+    }
+
+    wal->records[wal->record_count] = record;
+    wal->waiters[wal->record_count++] = wal->fsync_interval_ms == 0 ? &written : NULL;
+
+    tfac_wal_unlock(&wal->lock);
+
+    // By the time we get to write, our record has either been written by the thread before us, or it's in the batch that we write now.
+    // Either way, all of the records that were appended in the meantime go out with the same fsync (group commit).
+    if (wal->fsync_interval_ms == 0)
+    {
+        while (tfac_atomic_load(&written) == 0)
+        {
+            tfac_wal_sync(wal);
+        }
+
+        return tfac_atomic_load(&written) == 1;
+    }
+
+    // Batched mode: write once the interval has passed, unless somebody else is already on it.
+    if (tfac_wal_now_ms() - tfac_atomic_load(&wal->last_sync_ms) >= wal->fsync_interval_ms && tfac_atomic_cas(&wal->writing, 0, 1))
+    {
+        tfac_wal_write(wal);
+        tfac_wal_unlock(&wal->writing);
+    }
+
+    return tfac_atomic_load(&wal->failed) == 0;
+}
+
+static void tfac_wal_compact_record(void* ctx, const struct tfac_wal_record* record)
+{
+    fwrite(record, sizeof(struct tfac_wal_record), 1, (FILE*)ctx);
+}
+
+uint8_t tfac_wal_compact(struct tfac_wal* wal)
+{
+    tfac_wal_spin_lock(&wal->writing);
+
+    // Whatever is still buffered goes into the old log first (or is dropped with it, if that one has failed already).
+    tfac_wal_write(wal);
+
+    // The new snapshot is written next to the old one and then renamed over it, so that there's always a valid snapshot on disk.
+    // Crashing before the log is started over merely leaves its records in both files: loading them twice does no harm.
+    const size_t tmp_path_length = strlen(wal->snapshot_path) + 5;
+    char* tmp_path = malloc(tmp_path_length);
+    FILE* tmp = NULL;
+
+    if (tmp_path != NULL)
+    {
+        snprintf(tmp_path, tmp_path_length, "%s.tmp", wal->snapshot_path);
+        tmp = tfac_wal_create(tmp_path);
+    }
+
+    uint8_t r = tmp != NULL && tfac_wal_write_header(tmp, TFAC_WAL_SNAPSHOT_MAGIC, wal->key);
+
+    if (r)
+    {
+        const uint64_t now = (uint64_t)time(0);
+
+        tfac_wal_read_records(wal->snapshot_path, TFAC_WAL_SNAPSHOT_MAGIC, wal->key, now, &tfac_wal_compact_record, tmp);
+        tfac_wal_read_records(wal->log_path, TFAC_WAL_LOG_MAGIC, wal->key, now, &tfac_wal_compact_record, tmp);
+
+        r = !ferror(tmp) && tfac_wal_fsync(tmp);
+    }
+
+    if (tmp != NULL)
+    {
+        fclose(tmp);
+    }
+
+    if (r)
+    {
+#ifdef _WIN32
+        r = MoveFileExA(tmp_path, wal->snapshot_path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        r = rename(tmp_path, wal->snapshot_path) == 0;
+#endif
+    }
+    else if (tmp_path != NULL)
+    {
+        remove(tmp_path);
+    }
+
+    if (r)
+    {
+        if (wal->log != NULL)
+        {
+            fclose(wal->log);
+        }
+
+        wal->log = tfac_wal_create(wal->log_path);
+        r = wal->log != NULL && tfac_wal_write_header(wal->log, TFAC_WAL_LOG_MAGIC, wal->key) && tfac_wal_fsync(wal->log);
+
+        if (r)
+        {
+            tfac_atomic_cas(&wal->failed, 1, 0);
+        }
+    }
+
+    free(tmp_path);
+    tfac_wal_unlock(&wal->writing);
+
+    return r;
+}
+
+void tfac_wal_close(struct tfac_wal* wal)
+{
+    if (wal->flusher_started)
+    {
+        tfac_atomic_cas(&wal->stop, 0, 1);
+#ifdef _WIN32
+        WaitForSingleObject(wal->flusher, INFINITE);
+        CloseHandle(wal->flusher);
+#else
+        pthread_join(wal->flusher, NULL);
+#endif
+    }
+
+    if (wal->log != NULL)
+    {
+        tfac_wal_sync(wal);
+        fclose(wal->log);
+    }
+
+    free(wal->snapshot_path);
+    free(wal->log_path);
+    free(wal->records);
+    free(wal->writing_records);
+    free(wal->waiters);
+    free(wal->writing_waiters);
+
+    memset(wal, 0x00, sizeof(struct tfac_wal));
+}
@@ -0,0 +1,224 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/**
+ * @file tfac_wal.h
+ * @author Raphael Beck
+ * @brief Write-ahead log and snapshots of accepted token fingerprints (internal header: not part of the public TFAC API).
+ */
+
+#ifndef TFAC_WAL_H
+#define TFAC_WAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/**
+ * How many records are buffered in memory at most before they are written out (regardless of the fsync interval).
+ */
+#ifndef TFAC_WAL_BUFFER_RECORDS
+#define TFAC_WAL_BUFFER_RECORDS 4096
+#endif
+
+/**
+ * One accepted token, as written to the log and the snapshot (16 bytes on disk).
+ */
+struct tfac_wal_record
+{
+    /**
+     * The token's replay fingerprint.
+     */
+    uint64_t fingerprint;
+
+    /**
+     * Bits 0-39: when the token expires (UTC seconds); bits 40-47: the steps parameter that it was verified with; bits 48-63: check bits (to detect torn writes).
+     */
+    uint64_t meta;
+};
+
+/**
+ * Called for every record that is loaded from the snapshot and the log.
+ * @param user The user pointer that was passed to tfac_wal_load().
+ * @param fingerprint The token's replay fingerprint.
+ * @param expires When the token expires (UTC seconds).
+ * @param steps The steps parameter that the token was verified with.
+ */
+typedef void (*tfac_wal_load_fn)(void* user, uint64_t fingerprint, uint64_t expires, uint8_t steps);
+
+/**
+ * Durable log of accepted tokens: records are appended to <c>&lt;path&gt;.wal</c> and fsync'ed in batches (group commit);
+ * compaction writes the ones that haven't expired yet into a snapshot at <c>&lt;path&gt;</c> and starts the log over. <p>
+ * Appending is thread-safe. Only one thread at a time writes and fsyncs (or compacts): the others keep on appending to the in-memory buffer in the meantime. <p>
+ * With an fsync interval, a background thread also writes out the buffered records once the interval has passed, so that they don't wait for the next append when things go quiet.
+ */
+struct tfac_wal
+{
+    /**
+     * Path of the snapshot file (the log's path is the same plus ".wal").
+     */
+    char* snapshot_path;
+
+    /**
+     * Path of the log file.
+     */
+    char* log_path;
+
+    /**
+     * The open log file.
+     */
+    FILE* log;
+
+    /**
+     * The fingerprint key that the records were computed with (stored in the file headers: it has to stay the same across restarts).
+     */
+    uint8_t key[16];
+
+    /**
+     * Spinlock guarding #records and #record_count.
+     */
+    uint64_t lock;
+
+    /**
+     * Whether a thread is currently writing out records (or compacting): <c>0</c> or <c>1</c>.
+     */
+    uint64_t writing;
+
+    /**
+     * Records appended since the last write.
+     */
+    struct tfac_wal_record* records;
+
+    /**
+     * For each of the #records: where to report whether it made it to disk (<c>1</c>) or not (<c>2</c>), or <c>NULL</c> if nobody waits for it.
+     */
+    uint64_t** waiters;
+
+    /**
+     * How many records there are in #records.
+     */
+    size_t record_count;
+
+    /**
+     * The records that are being written right now (swapped with #records).
+     */
+    struct tfac_wal_record* writing_records;
+
+    /**
+     * The waiters of the #writing_records (swapped with #waiters).
+     */
+    uint64_t** writing_waiters;
+
+    /**
+     * How often to fsync at most (in milliseconds): <c>0</c> means on every append.
+     */
+    uint32_t fsync_interval_ms;
+
+    /**
+     * When the log was last fsync'ed (milliseconds on a monotonic clock).
+     */
+    uint64_t last_sync_ms;
+
+    /**
+     * Whether the background flusher should stop: <c>0</c> or <c>1</c>.
+     */
+    uint64_t stop;
+
+    /**
+     * Whether the background flusher is running (only with an fsync interval).
+     */
+    uint8_t flusher_started;
+
+    /**
+     * The background flusher thread.
+     */
+#ifdef _WIN32
+    void* flusher;
+#else
+    pthread_t flusher;
+#endif
+
+    /**
+     * Set once writing the log has failed. The log may end in a torn record then, and loading stops at the first one of those:
+     * so nothing more is written to it (all of the records appended in the meantime are dropped) until tfac_wal_compact() starts a new log.
+     */
+    uint64_t failed;
+};
+
+/**
+ * Opens (or creates) the snapshot and log at \p path and reads the fingerprint key from their headers. Load the records in there with tfac_wal_load() afterwards.
+ * @param wal The tfac_wal to initialize.
+ * @param path Path of the snapshot (the log goes to the same path plus ".wal").
+ * @param fsync_interval_ms How often to fsync at most (in milliseconds): <c>0</c> fsyncs on every append.
+ * @param key The fingerprint key: if there is a snapshot or log already, this is overwritten with the one that's stored in there; otherwise, it's the key that new files are created with.
+ * @return <c>1</c> on success; <c>0</c> if the files couldn't be read, or if they aren't valid TFAC snapshots/logs (or belong to different keys).
+ */
+uint8_t tfac_wal_open(struct tfac_wal* wal, const char* path, uint32_t fsync_interval_ms, uint8_t key[16]);
+
+/**
+ * Loads all of the unexpired records from the snapshot and the log, and then compacts them (so that the log starts out empty and without any torn writes at its end).
+ * @param wal The tfac_wal (opened with tfac_wal_open()).
+ * @param load Called for every unexpired record.
+ * @param user Passed on to \p load.
+ * @return <c>1</c> on success; <c>0</c> if the new snapshot or log couldn't be written.
+ */
+uint8_t tfac_wal_load(struct tfac_wal* wal, tfac_wal_load_fn load, void* user);
+
+/**
+ * Appends a record to the log (group commit: it's written and fsync'ed together with the others once the fsync interval has passed, or right away if that is <c>0</c>).
+ * @param wal The tfac_wal.
+ * @param fingerprint The accepted token's replay fingerprint.
+ * @param expires When the token expires (UTC seconds).
+ * @param steps The steps parameter that the token was verified with.
+ * @return With an fsync interval of <c>0</c>: <c>1</c> once the record is on disk; <c>0</c> if the write that it was part of failed.
+ * Otherwise: <c>1</c> if the record was appended (and written, if it was due); <c>0</c> if writing the log has failed.
+ */
+uint8_t tfac_wal_append(struct tfac_wal* wal, uint64_t fingerprint, uint64_t expires, uint8_t steps);
+
+/**
+ * Writes and fsyncs all of the appended records right away.
+ * @param wal The tfac_wal.
+ * @return <c>1</c> on success; <c>0</c> if writing or fsyncing the log failed (now or before, and the log wasn't compacted since).
+ */
+uint8_t tfac_wal_sync(struct tfac_wal* wal);
+
+/**
+ * Writes all of the unexpired records into a new snapshot (atomically replacing the old one) and starts the log over.
+ * This is also how a log recovers from a failed write: the records that are on disk up to there are kept, and the new log can be written to again.
+ * @param wal The tfac_wal.
+ * @return <c>1</c> on success; <c>0</c> if something failed (the old snapshot and log are still valid then).
+ */
+uint8_t tfac_wal_compact(struct tfac_wal* wal);
+
+/**
+ * Stops the background flusher, syncs the log one last time and releases everything.
+ * @param wal The tfac_wal to close.
+ */
+void tfac_wal_close(struct tfac_wal* wal);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // TFAC_WAL_H
@@ -0,0 +1,964 @@
+/*
+   Copyright 2020 Raphael Beck
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/tfac.h"
+#include "../src/tfac_cpu.h"
+#include "../src/tfac_replay.h"
+#include "../src/picohash.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define tfac_bench_cycles() __rdtsc()
+#else
+#define tfac_bench_cycles() 0
+#endif
+
+static double tfac_bench_now()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+// Keeps the optimizer from throwing away the benchmarked work.
+static volatile uint64_t tfac_bench_sink = 0;
+
+static void bench_sha1_throughput()
+{
+    static uint8_t message[1024 * 1024];
+    memset(message, 0xA5, sizeof(message));
+
+    const size_t sizes[] = { 8, 64, 1024, sizeof(message) };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        const size_t size = sizes[s];
+        const size_t iterations = (size_t)(64 * 1024 * 1024) / (size + 64);
+
+        uint8_t digest[PICOHASH_SHA1_DIGEST_LENGTH];
+        picohash_ctx_t ctx;
+
+        const double start = tfac_bench_now();
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            picohash_init_sha1(&ctx);
+            picohash_update(&ctx, message, size);
+            picohash_final(&ctx, digest);
+            tfac_bench_sink += digest[0];
+        }
+
+        const double elapsed = tfac_bench_now() - start;
+        printf("SHA-1 %8zu bytes: %10.1f MB/s  %10.1f ns/hash\n", size, (double)(size * iterations) / elapsed / 1e6, elapsed * 1e9 / (double)iterations);
+    }
+}
+
+static void bench_compression_function(const char* name, void (*compress)(uint32_t*, const uint8_t*))
+{
+    const size_t iterations = 1000000;
+
+    uint8_t block[64];
+    memset(block, 0x5A, sizeof(block));
+
+    uint32_t state[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+
+    const double start = tfac_bench_now();
+    uint64_t cycles = tfac_bench_cycles();
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        compress(state, block);
+    }
+
+    cycles = tfac_bench_cycles() - cycles;
+    const double elapsed = tfac_bench_now() - start;
+
+    tfac_bench_sink += state[0];
+    printf("%-34s %8.1f ns/block  %8.1f cycles/block\n", name, elapsed * 1e9 / (double)iterations, (double)cycles / (double)iterations);
+}
+
+static void bench_compression()
+{
+#ifdef PICOHASH_COMPACT
+    bench_compression_function("SHA-1 compression (compact):", &_picohash_sha1_compress);
+    bench_compression_function("SHA-256 compression (compact):", &_picohash_sha256_compress);
+#else
+    bench_compression_function("SHA-1 compression (unrolled):", &_picohash_sha1_compress);
+    bench_compression_function("SHA-256 compression (unrolled):", &_picohash_sha256_compress);
+#endif
+
+#ifdef TFAC_X86
+    if (tfac_cpu_detect_features() & TFAC_CPU_SHA_NI)
+    {
+        bench_compression_function("SHA-1 compression (SHA-NI):", &tfac_sha1_compress_sha_ni);
+        bench_compression_function("SHA-256 compression (SHA-NI):", &tfac_sha256_compress_sha_ni);
+    }
+#endif
+}
+
+static void bench_hotp()
+{
+    const struct tfac_secret secret = tfac_generate_secret();
+    const size_t iterations = 1000000;
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        double start = tfac_bench_now();
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            tfac_bench_sink += tfac_hotp_raw(secret.secret_key, 20, TFAC_DEFAULT_DIGITS, i, (enum tfac_hash_algo)hash_algo);
+        }
+
+        const double raw = tfac_bench_now() - start;
+
+        const struct tfac_key key = tfac_key_init(secret.secret_key, 20, (enum tfac_hash_algo)hash_algo);
+        start = tfac_bench_now();
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            tfac_bench_sink += tfac_hotp_key(&key, TFAC_DEFAULT_DIGITS, i);
+        }
+
+        const double keyed = tfac_bench_now() - start;
+        printf("HOTP algo %d: tfac_hotp_raw %8.1f ns/token  tfac_hotp_key %8.1f ns/token\n", hash_algo, raw * 1e9 / (double)iterations, keyed * 1e9 / (double)iterations);
+    }
+}
+
+static void bench_key_cache()
+{
+    const size_t secret_count = 1024;
+    const size_t iterations = 1000000;
+
+    struct tfac_secret* secrets = malloc(secret_count * sizeof(struct tfac_secret));
+
+    if (secrets == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < secret_count; i++)
+    {
+        secrets[i] = tfac_generate_secret();
+    }
+
+    double start = tfac_bench_now();
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        tfac_bench_sink += tfac_hotp(secrets[i % secret_count].secret_key_base32, TFAC_DEFAULT_DIGITS, i, TFAC_SHA1).number;
+    }
+
+    const double uncached = tfac_bench_now() - start;
+
+    tfac_set_key_cache_size(4 * secret_count);
+    start = tfac_bench_now();
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        tfac_bench_sink += tfac_hotp(secrets[i % secret_count].secret_key_base32, TFAC_DEFAULT_DIGITS, i, TFAC_SHA1).number;
+    }
+
+    const double cached = tfac_bench_now() - start;
+    const struct tfac_key_cache_stats stats = tfac_get_key_cache_stats();
+    tfac_set_key_cache_size(0);
+
+    printf("tfac_hotp, %zu secrets: uncached %8.1f ns/token  key cache %8.1f ns/token (%llu hits, %llu misses)\n", secret_count, uncached * 1e9 / (double)iterations, cached * 1e9 / (double)iterations, (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+
+    free(secrets);
+}
+
+static void bench_key_registry()
+{
+    const uint32_t key_count = 1 << 20;
+    const time_t utc = time(0);
+
+    struct tfac_key_registry* registry = tfac_key_registry_new(key_count);
+    uint32_t* handles = malloc(key_count * sizeof(uint32_t));
+    uint64_t* out = malloc(key_count * sizeof(uint64_t));
+
+    if (registry == NULL || handles == NULL || out == NULL)
+    {
+        tfac_key_registry_free(registry);
+        free(handles);
+        free(out);
+        return;
+    }
+
+    uint8_t secret[20] = { 0x00 };
+    double start = tfac_bench_now();
+
+    for (uint32_t i = 0; i < key_count; i++)
+    {
+        memcpy(secret, &i, sizeof(i));
+        const struct tfac_key key = tfac_key_init(secret, sizeof(secret), TFAC_SHA1);
+        handles[i] = tfac_key_registry_register_key(registry, &key);
+    }
+
+    const double setup = tfac_bench_now() - start;
+
+    // Random order (every handle once) versus handles sorted by slot.
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    start = tfac_bench_now();
+
+    for (uint32_t i = 0; i < key_count; i++)
+    {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        tfac_bench_sink += tfac_key_registry_hotp(registry, handles[x & (key_count - 1)], TFAC_DEFAULT_DIGITS, (uint64_t)(utc / TFAC_DEFAULT_STEPS)).number;
+    }
+
+    const double single = tfac_bench_now() - start;
+    start = tfac_bench_now();
+
+    tfac_key_registry_totp_many(registry, handles, key_count, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, utc, out);
+
+    const double many = tfac_bench_now() - start;
+    tfac_bench_sink += out[key_count - 1];
+
+    printf("Key registry x%u: tfac_key_registry_hotp (random handles) %8.1f ns/token  tfac_key_registry_totp_many %8.1f ns/token\n", key_count, single * 1e9 / key_count, many * 1e9 / key_count);
+
+    // Starting up from a key store file instead of setting up every key again.
+    const char* path = "tfac_bench_keys.bin";
+
+    if (tfac_key_registry_save(registry, path))
+    {
+        start = tfac_bench_now();
+        struct tfac_key_registry* opened = tfac_key_registry_open(path, 0);
+        const double open = tfac_bench_now() - start;
+
+        tfac_key_registry_free(opened);
+
+        start = tfac_bench_now();
+        opened = tfac_key_registry_open(path, 1);
+        const double open_verified = tfac_bench_now() - start;
+
+        tfac_key_registry_free(opened);
+        remove(path);
+
+        printf("Key store x%u: register all keys %8.1f ms  tfac_key_registry_open %8.3f ms (%8.1f ms with checksum)\n", key_count, setup * 1e3, open * 1e3, open_verified * 1e3);
+    }
+
+    tfac_key_registry_free(registry);
+    free(handles);
+    free(out);
+}
+
+static void bench_hotp_batch()
+{
+    static struct tfac_key keys[4096];
+    static uint64_t counters[4096];
+    static uint64_t out[4096];
+
+    const size_t rounds = 256;
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        for (size_t i = 0; i < 4096; i++)
+        {
+            const struct tfac_secret secret = tfac_generate_secret();
+            keys[i] = tfac_key_init(secret.secret_key, 20, (enum tfac_hash_algo)hash_algo);
+            counters[i] = i;
+        }
+
+        double start = tfac_bench_now();
+
+        for (size_t r = 0; r < rounds; r++)
+        {
+            for (size_t i = 0; i < 4096; i++)
+            {
+                tfac_bench_sink += tfac_hotp_key(&keys[i], TFAC_DEFAULT_DIGITS, counters[i] + r);
+            }
+        }
+
+        const double single = tfac_bench_now() - start;
+        start = tfac_bench_now();
+
+        for (size_t r = 0; r < rounds; r++)
+        {
+            tfac_hotp_key_batch(keys, counters, 4096, TFAC_DEFAULT_DIGITS, out);
+            tfac_bench_sink += out[r];
+        }
+
+        const double batch = tfac_bench_now() - start;
+        printf("HOTP algo %d x4096: tfac_hotp_key %8.1f ns/token  tfac_hotp_key_batch %8.1f ns/token\n", hash_algo, single * 1e9 / (double)(rounds * 4096), batch * 1e9 / (double)(rounds * 4096));
+    }
+}
+
+static void bench_hotp_raw_many()
+{
+    static uint8_t secrets[4096][20];
+    static const uint8_t* secret_keys[4096];
+    static size_t secret_key_lengths[4096];
+    static uint64_t counters[4096];
+    static uint64_t out[4096];
+
+    const size_t rounds = 64;
+
+    for (size_t i = 0; i < 4096; i++)
+    {
+        const struct tfac_secret secret = tfac_generate_secret();
+        memcpy(secrets[i], secret.secret_key, sizeof(secrets[i]));
+
+        secret_keys[i] = secrets[i];
+        secret_key_lengths[i] = sizeof(secrets[i]);
+        counters[i] = i;
+    }
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        double start = tfac_bench_now();
+
+        for (size_t r = 0; r < rounds; r++)
+        {
+            for (size_t i = 0; i < 4096; i++)
+            {
+                tfac_bench_sink += tfac_hotp_raw(secret_keys[i], secret_key_lengths[i], TFAC_DEFAULT_DIGITS, counters[i] + r, (enum tfac_hash_algo)hash_algo);
+            }
+        }
+
+        const double single = tfac_bench_now() - start;
+        start = tfac_bench_now();
+
+        for (size_t r = 0; r < rounds; r++)
+        {
+            tfac_hotp_raw_many(secret_keys, secret_key_lengths, counters, 4096, TFAC_DEFAULT_DIGITS, (enum tfac_hash_algo)hash_algo, out);
+            tfac_bench_sink += out[r];
+        }
+
+        const double many = tfac_bench_now() - start;
+        printf("HOTP algo %d x4096: tfac_hotp_raw %8.1f ns/token  tfac_hotp_raw_many %8.1f ns/token\n", hash_algo, single * 1e9 / (double)(rounds * 4096), many * 1e9 / (double)(rounds * 4096));
+    }
+}
+
+// A used token as the replay check used to store it: SHA-256 of the token and of the secret.
+struct bench_replay_sha256_entry
+{
+    uint8_t used_token_sha256[32];
+    uint8_t key_sha256[32];
+};
+
+// The replay check as it used to be: walk the whole ring of used tokens.
+static uint8_t bench_replay_linear_check_and_insert(struct bench_replay_sha256_entry* ring, const uint32_t capacity, uint32_t* next, const struct bench_replay_sha256_entry* entry)
+{
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        if (memcmp(entry->used_token_sha256, ring[i].used_token_sha256, sizeof(entry->used_token_sha256)) == 0 && memcmp(entry->key_sha256, ring[i].key_sha256, sizeof(entry->key_sha256)) == 0)
+        {
+            return 0;
+        }
+    }
+
+    ring[*next] = *entry;
+    *next = (*next + 1) % capacity;
+    return 1;
+}
+
+// Hashing every benchmarked entry with SHA-256 would drown out the replay check itself: spread the counter over the leading bytes with a multiplicative hash instead.
+static void bench_replay_entry_from_counter(struct bench_replay_sha256_entry* entry, const uint64_t n)
+{
+    const uint64_t h = n * 0x9E3779B97F4A7C15ULL;
+    memcpy(entry->used_token_sha256, &h, sizeof(h));
+    memcpy(entry->used_token_sha256 + sizeof(h), &n, sizeof(n));
+}
+
+#define bench_replay_fingerprint_from_counter(n) ((uint64_t)(n)*0x9E3779B97F4A7C15ULL)
+
+static void bench_replay_table()
+{
+    const uint32_t capacities[] = { 4096, 65536, 1048576 };
+
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++)
+    {
+        const uint32_t capacity = capacities[c];
+
+        struct bench_replay_sha256_entry* ring = calloc(capacity, sizeof(struct bench_replay_sha256_entry));
+        uint64_t* slots = calloc((size_t)capacity * 2 * TFAC_REPLAY_GENERATIONS, sizeof(uint64_t));
+
+        if (ring == NULL || slots == NULL)
+        {
+            free(ring);
+            free(slots);
+            continue;
+        }
+
+        struct tfac_replay_table table;
+        tfac_replay_init(&table, slots, (size_t)capacity * 2 * TFAC_REPLAY_GENERATIONS, TFAC_REPLAY_EPOCH);
+
+        // Fill both up first. The table holds up to capacity tokens per time step: move on to the next step every capacity tokens.
+        struct bench_replay_sha256_entry entry;
+        memset(&entry, 0x00, sizeof(entry));
+
+        uint32_t ring_next = 0;
+        uint64_t n = 0;
+
+        for (; n < capacity; n++)
+        {
+            bench_replay_entry_from_counter(&entry, n);
+
+            ring[ring_next] = entry;
+            ring_next = (ring_next + 1) % capacity;
+            tfac_replay_check_and_insert(&table, bench_replay_fingerprint_from_counter(n), n / capacity * TFAC_REPLAY_EPOCH);
+        }
+
+        // The linear scan gets slow quickly: scale its iterations down with the capacity.
+        const size_t linear_iterations = capacity >= (1 << 20) ? 16 : (size_t)(1 << 24) / capacity;
+        const size_t hashed_iterations = 1000000;
+
+        double start = tfac_bench_now();
+
+        for (size_t i = 0; i < linear_iterations; i++, n++)
+        {
+            bench_replay_entry_from_counter(&entry, n);
+            tfac_bench_sink += bench_replay_linear_check_and_insert(ring, capacity, &ring_next, &entry);
+        }
+
+        const double linear = tfac_bench_now() - start;
+        start = tfac_bench_now();
+
+        for (size_t i = 0; i < hashed_iterations; i++, n++)
+        {
+            tfac_bench_sink += tfac_replay_check_and_insert(&table, bench_replay_fingerprint_from_counter(n), n / capacity * TFAC_REPLAY_EPOCH);
+        }
+
+        const double hashed = tfac_bench_now() - start;
+        printf("Replay check x%-8u linear scan %12.1f ns/check  hashed table %8.1f ns/check\n", capacity, linear * 1e9 / (double)linear_iterations, hashed * 1e9 / (double)hashed_iterations);
+
+        free(ring);
+        free(slots);
+    }
+}
+
+static void bench_replay_fingerprint()
+{
+    const struct tfac_secret secret = tfac_generate_secret();
+    const struct tfac_key key = tfac_key_init(secret.secret_key, sizeof(secret.secret_key), TFAC_SHA1);
+    const size_t iterations = 1000000;
+
+    uint8_t replay_key[16] = { 0x00 };
+
+    struct tfac_replay_table table;
+    uint64_t slots[TFAC_REPLAY_GENERATIONS * TFAC_REPLAY_BUCKET_SLOTS];
+    tfac_replay_init(&table, slots, sizeof(slots) / sizeof(slots[0]), TFAC_REPLAY_EPOCH);
+    tfac_replay_set_key(&table, replay_key);
+
+    // What a successful verification used to hash: SHA-256 of the token number and SHA-256 of the key.
+    struct bench_replay_sha256_entry entry;
+    picohash_ctx_t ctx;
+
+    double start = tfac_bench_now();
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        picohash_init_sha256(&ctx);
+        picohash_update(&ctx, &i, sizeof(i));
+        picohash_final(&ctx, entry.used_token_sha256);
+        picohash_init_sha256(&ctx);
+        picohash_update(&ctx, key.inner_state, sizeof(key.inner_state));
+        picohash_update(&ctx, key.outer_state, sizeof(key.outer_state));
+        picohash_final(&ctx, entry.key_sha256);
+        tfac_bench_sink += entry.used_token_sha256[0] ^ entry.key_sha256[0];
+    }
+
+    const double sha256 = tfac_bench_now() - start;
+
+    // What it hashes now: SipHash over the key midstates, token number and time step.
+    uint8_t used_token[sizeof(key.inner_state) + sizeof(key.outer_state) + 2 * sizeof(uint64_t)];
+    memcpy(used_token, key.inner_state, sizeof(key.inner_state));
+    memcpy(used_token + sizeof(key.inner_state), key.outer_state, sizeof(key.outer_state));
+
+    start = tfac_bench_now();
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        memcpy(used_token + sizeof(key.inner_state) + sizeof(key.outer_state), &i, sizeof(i));
+        tfac_bench_sink += tfac_replay_fingerprint(&table, used_token, sizeof(used_token));
+    }
+
+    const double siphash = tfac_bench_now() - start;
+    printf("Replay fingerprint: 2x SHA-256 %8.1f ns/token  SipHash-2-4 %8.1f ns/token\n", sha256 * 1e9 / (double)iterations, siphash * 1e9 / (double)iterations);
+}
+
+#define BENCH_REPLAY_MAX_THREADS 32
+#define BENCH_REPLAY_CHECKS_PER_THREAD 1000000
+
+static struct tfac_replay_table bench_replay_concurrent_table;
+
+static void bench_replay_concurrent_thread(const size_t thread)
+{
+    // Half of the checks are replays of the previous token (by the same thread), like a login form that is submitted twice.
+    for (uint64_t i = 0; i < BENCH_REPLAY_CHECKS_PER_THREAD; i++)
+    {
+        tfac_bench_sink += tfac_replay_check_and_insert(&bench_replay_concurrent_table, bench_replay_fingerprint_from_counter(((uint64_t)thread << 40) | (i / 2)), i / 65536 * TFAC_REPLAY_EPOCH);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI bench_replay_concurrent_thread_main(LPVOID arg)
+{
+    bench_replay_concurrent_thread((size_t)arg);
+    return 0;
+}
+#else
+static void* bench_replay_concurrent_thread_main(void* arg)
+{
+    bench_replay_concurrent_thread((size_t)arg);
+    return NULL;
+}
+#endif
+
+static void bench_replay_table_concurrency()
+{
+    const size_t slot_count = (size_t)1 << 22;
+    uint64_t* slots = calloc(slot_count, sizeof(uint64_t));
+
+    if (slots == NULL)
+    {
+        return;
+    }
+
+    for (size_t thread_count = 1; thread_count <= BENCH_REPLAY_MAX_THREADS; thread_count *= 2)
+    {
+        tfac_replay_init(&bench_replay_concurrent_table, slots, slot_count, TFAC_REPLAY_EPOCH);
+
+        const double start = tfac_bench_now();
+
+#ifdef _WIN32
+        HANDLE threads[BENCH_REPLAY_MAX_THREADS];
+
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            threads[i] = CreateThread(NULL, 0, bench_replay_concurrent_thread_main, (LPVOID)i, 0, NULL);
+        }
+
+        WaitForMultipleObjects((DWORD)thread_count, threads, TRUE, INFINITE);
+
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            CloseHandle(threads[i]);
+        }
+#else
+        pthread_t threads[BENCH_REPLAY_MAX_THREADS];
+
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            pthread_create(&threads[i], NULL, bench_replay_concurrent_thread_main, (void*)i);
+        }
+
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+#endif
+
+        const double elapsed = tfac_bench_now() - start;
+        printf("Replay check, %2zu threads: %8.1f M checks/s\n", thread_count, (double)(thread_count * BENCH_REPLAY_CHECKS_PER_THREAD) / elapsed / 1e6);
+    }
+
+    free(slots);
+}
+
+#define BENCH_DURABLE_THREADS 8
+#define BENCH_DURABLE_SECONDS 1.0
+
+static struct tfac_verifier* bench_durable_verifier_instance;
+static volatile uint64_t bench_durable_accepted[BENCH_DURABLE_THREADS];
+
+static void bench_durable_thread(const size_t thread)
+{
+    // Every verification uses a secret of its own, so that every token is accepted (and logged).
+    uint8_t secret[20] = { 0x00 };
+    char totp[16];
+    uint64_t accepted = 0;
+
+    const double end = tfac_bench_now() + BENCH_DURABLE_SECONDS;
+
+    for (uint64_t i = 0; (i & 63) != 0 || tfac_bench_now() < end; i++)
+    {
+        const uint64_t n = ((uint64_t)thread << 48) | i;
+        memcpy(secret, &n, sizeof(n));
+
+        const struct tfac_key key = tfac_key_init(secret, sizeof(secret), TFAC_SHA1);
+        snprintf(totp, sizeof(totp), "%06llu", (unsigned long long)tfac_totp_key(&key, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, time(0)));
+
+        accepted += tfac_verifier_verify_totp_key(bench_durable_verifier_instance, &key, totp, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    }
+
+    bench_durable_accepted[thread] = accepted;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI bench_durable_thread_main(LPVOID arg)
+{
+    bench_durable_thread((size_t)arg);
+    return 0;
+}
+#else
+static void* bench_durable_thread_main(void* arg)
+{
+    bench_durable_thread((size_t)arg);
+    return NULL;
+}
+#endif
+
+static void bench_durable_verifier_run(const char* name)
+{
+    const double start = tfac_bench_now();
+
+#ifdef _WIN32
+    HANDLE threads[BENCH_DURABLE_THREADS];
+
+    for (size_t i = 0; i < BENCH_DURABLE_THREADS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, bench_durable_thread_main, (LPVOID)i, 0, NULL);
+    }
+
+    WaitForMultipleObjects(BENCH_DURABLE_THREADS, threads, TRUE, INFINITE);
+
+    for (size_t i = 0; i < BENCH_DURABLE_THREADS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[BENCH_DURABLE_THREADS];
+
+    for (size_t i = 0; i < BENCH_DURABLE_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, bench_durable_thread_main, (void*)i);
+    }
+
+    for (size_t i = 0; i < BENCH_DURABLE_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+
+    const double elapsed = tfac_bench_now() - start;
+
+    uint64_t accepted = 0;
+
+    for (size_t i = 0; i < BENCH_DURABLE_THREADS; i++)
+    {
+        accepted += bench_durable_accepted[i];
+    }
+
+    printf("Verifier, %d threads, %-22s %10.0f verifications/s\n", BENCH_DURABLE_THREADS, name, (double)accepted / elapsed);
+}
+
+static void bench_durable_verifier()
+{
+    const char* path = "tfac_bench_verifier.snapshot";
+    const char* log_path = "tfac_bench_verifier.snapshot.wal";
+    const uint32_t fsync_intervals_ms[] = { 0, 1, 10, 100 };
+
+    bench_durable_verifier_instance = tfac_verifier_new(1 << 22, NULL, NULL);
+    bench_durable_verifier_run("in memory:");
+    tfac_verifier_free(bench_durable_verifier_instance);
+
+    for (size_t i = 0; i < sizeof(fsync_intervals_ms) / sizeof(fsync_intervals_ms[0]); i++)
+    {
+        remove(path);
+        remove(log_path);
+
+        bench_durable_verifier_instance = tfac_verifier_open_durable(path, 1 << 22, fsync_intervals_ms[i]);
+
+        if (bench_durable_verifier_instance == NULL)
+        {
+            printf("Verifier: couldn't create %s\n", path);
+            return;
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "fsync every %3u ms:", fsync_intervals_ms[i]);
+
+        bench_durable_verifier_run(name);
+        tfac_verifier_free(bench_durable_verifier_instance);
+    }
+
+    remove(path);
+    remove(log_path);
+}
+
+#define BENCH_ENROLLMENT_KEYS (1 << 18)
+#define BENCH_ENROLLMENT_BATCHES 4096
+#define BENCH_ENROLLMENT_BATCH_SIZE 256
+
+static struct tfac_key_registry* bench_enrollment_registry;
+static uint32_t bench_enrollment_handles[BENCH_ENROLLMENT_KEYS];
+static uint64_t bench_enrollment_done;
+static volatile uint64_t bench_enrollment_writes;
+
+static void bench_enrollment_writer()
+{
+    // Enroll new keys into the empty half of the registry (and unregister them again once it's full), and rotate the existing ones' secrets on the side.
+    uint8_t secret[20] = { 0x00 };
+    uint32_t enrolled[BENCH_ENROLLMENT_KEYS / 2];
+    uint32_t enrolled_count = 0;
+    uint64_t writes = 0;
+
+    for (uint32_t i = 0; !tfac_atomic_load(&bench_enrollment_done); i++)
+    {
+        memcpy(secret, &i, sizeof(i));
+        const struct tfac_key key = tfac_key_init(secret, sizeof(secret), TFAC_SHA1);
+
+        if (enrolled_count == BENCH_ENROLLMENT_KEYS / 2)
+        {
+            while (enrolled_count > 0)
+            {
+                tfac_key_registry_unregister(bench_enrollment_registry, enrolled[--enrolled_count]);
+            }
+        }
+
+        enrolled[enrolled_count++] = tfac_key_registry_register_key(bench_enrollment_registry, &key);
+        tfac_key_registry_replace_key(bench_enrollment_registry, bench_enrollment_handles[i & (BENCH_ENROLLMENT_KEYS / 2 - 1)], &key);
+        writes += 2;
+    }
+
+    bench_enrollment_writes = writes;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI bench_enrollment_thread_main(LPVOID arg)
+{
+    (void)arg;
+    bench_enrollment_writer();
+    return 0;
+}
+#else
+static void* bench_enrollment_thread_main(void* arg)
+{
+    (void)arg;
+    bench_enrollment_writer();
+    return NULL;
+}
+#endif
+
+// Times batches of lookups of random handles: returns the mean, and writes the slowest batch's time per token into *worst (both in ns/token).
+static double bench_enrollment_lookups(double* worst)
+{
+    const uint64_t counter = (uint64_t)(time(0) / TFAC_DEFAULT_STEPS);
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    double total = 0;
+
+    *worst = 0;
+
+    for (size_t b = 0; b < BENCH_ENROLLMENT_BATCHES; b++)
+    {
+        const double start = tfac_bench_now();
+
+        for (size_t i = 0; i < BENCH_ENROLLMENT_BATCH_SIZE; i++)
+        {
+            x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+            tfac_bench_sink += tfac_key_registry_hotp(bench_enrollment_registry, bench_enrollment_handles[x & (BENCH_ENROLLMENT_KEYS / 2 - 1)], TFAC_DEFAULT_DIGITS, counter).number;
+        }
+
+        const double elapsed = tfac_bench_now() - start;
+        total += elapsed;
+
+        if (elapsed > *worst)
+        {
+            *worst = elapsed;
+        }
+    }
+
+    *worst *= 1e9 / BENCH_ENROLLMENT_BATCH_SIZE;
+    return total * 1e9 / ((double)BENCH_ENROLLMENT_BATCHES * BENCH_ENROLLMENT_BATCH_SIZE);
+}
+
+static void bench_key_registry_enrollment()
+{
+    bench_enrollment_registry = tfac_key_registry_new(BENCH_ENROLLMENT_KEYS);
+
+    if (bench_enrollment_registry == NULL)
+    {
+        return;
+    }
+
+    uint8_t secret[20] = { 0xFF };
+
+    for (uint32_t i = 0; i < BENCH_ENROLLMENT_KEYS / 2; i++)
+    {
+        memcpy(secret + 4, &i, sizeof(i));
+        const struct tfac_key key = tfac_key_init(secret, sizeof(secret), TFAC_SHA1);
+        bench_enrollment_handles[i] = tfac_key_registry_register_key(bench_enrollment_registry, &key);
+    }
+
+    double worst_idle, worst_burst;
+    const double idle = bench_enrollment_lookups(&worst_idle);
+
+    bench_enrollment_done = 0;
+    const double start = tfac_bench_now();
+
+#ifdef _WIN32
+    HANDLE writer = CreateThread(NULL, 0, bench_enrollment_thread_main, NULL, 0, NULL);
+    const double burst = bench_enrollment_lookups(&worst_burst);
+    tfac_atomic_cas(&bench_enrollment_done, 0, 1);
+    WaitForSingleObject(writer, INFINITE);
+    CloseHandle(writer);
+#else
+    pthread_t writer;
+    pthread_create(&writer, NULL, bench_enrollment_thread_main, NULL);
+    const double burst = bench_enrollment_lookups(&worst_burst);
+    tfac_atomic_cas(&bench_enrollment_done, 0, 1);
+    pthread_join(writer, NULL);
+#endif
+
+    const double elapsed = tfac_bench_now() - start;
+
+    printf("Key registry lookups, idle:                %8.1f ns/token (slowest batch %8.1f ns/token)\n", idle, worst_idle);
+    printf("Key registry lookups, enrollment burst:    %8.1f ns/token (slowest batch %8.1f ns/token, %10.0f writes/s)\n", burst, worst_burst, (double)bench_enrollment_writes / elapsed);
+
+    tfac_key_registry_free(bench_enrollment_registry);
+}
+
+static void bench_token_cache()
+{
+    const uint32_t key_count = 1 << 18;
+    const uint32_t login_count = 1 << 16;
+
+    struct tfac_key_registry* registry = tfac_key_registry_new(key_count);
+    uint32_t* handles = malloc(key_count * sizeof(uint32_t));
+    uint64_t* tokens = malloc(key_count * sizeof(uint64_t));
+
+    if (registry == NULL || handles == NULL || tokens == NULL)
+    {
+        tfac_key_registry_free(registry);
+        free(handles);
+        free(tokens);
+        return;
+    }
+
+    uint8_t secret[20] = { 0x42 };
+
+    for (uint32_t i = 0; i < key_count; i++)
+    {
+        memcpy(secret, &i, sizeof(i));
+        const struct tfac_key key = tfac_key_init(secret, sizeof(secret), TFAC_SHA1);
+        handles[i] = tfac_key_registry_register_key(registry, &key);
+    }
+
+    struct tfac_token_cache* cache = tfac_token_cache_new(registry, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, 0);
+
+    if (cache == NULL)
+    {
+        tfac_key_registry_free(registry);
+        free(handles);
+        free(tokens);
+        return;
+    }
+
+    tfac_token_cache_refresh(cache, time(0));
+
+    // Logins: every user presents the right token (once), half of them through the registry and the other half through the token cache.
+    tfac_key_registry_totp_many(registry, handles, login_count, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, time(0), tokens);
+
+    char totp[16];
+    uint64_t accepted = 0;
+    double start = tfac_bench_now();
+
+    for (uint32_t i = 0; i < login_count / 2; i++)
+    {
+        snprintf(totp, sizeof(totp), "%06llu", (unsigned long long)tokens[i]);
+        accepted += tfac_key_registry_verify_totp(registry, handles[i], totp, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    }
+
+    const double uncached = tfac_bench_now() - start;
+    start = tfac_bench_now();
+
+    for (uint32_t i = login_count / 2; i < login_count; i++)
+    {
+        snprintf(totp, sizeof(totp), "%06llu", (unsigned long long)tokens[i]);
+        accepted += tfac_token_cache_verify_totp(cache, handles[i], totp);
+    }
+
+    const double cached = tfac_bench_now() - start;
+    tfac_bench_sink += accepted;
+
+    // Wrong tokens: all three steps of the window are compared (and nothing is marked as used).
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    start = tfac_bench_now();
+
+    for (uint32_t i = 0; i < login_count; i++)
+    {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        tfac_bench_sink += tfac_key_registry_verify_totp(registry, handles[x & (key_count - 1)], "000000", TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    }
+
+    const double uncached_wrong = tfac_bench_now() - start;
+    start = tfac_bench_now();
+
+    for (uint32_t i = 0; i < login_count; i++)
+    {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        tfac_bench_sink += tfac_token_cache_verify_totp(cache, handles[x & (key_count - 1)], "000000");
+    }
+
+    const double cached_wrong = tfac_bench_now() - start;
+    const struct tfac_token_cache_stats stats = tfac_token_cache_get_stats(cache);
+
+    printf("Token cache x%u: valid tokens: registry %8.1f ns/verification  cache %8.1f ns/verification (%llu of %u accepted)\n", key_count, uncached * 2e9 / login_count, cached * 2e9 / login_count, (unsigned long long)accepted, login_count);
+    printf("Token cache x%u: wrong tokens: registry %8.1f ns/verification  cache %8.1f ns/verification\n", key_count, uncached_wrong * 1e9 / login_count, cached_wrong * 1e9 / login_count);
+    printf("Token cache x%u: %6.1f MiB, %llu hits, %llu misses, refresh %8.1f ms/step (%6.1f ns/token)\n", key_count, (double)stats.memory / (1024 * 1024), (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+        (double)stats.refresh_ns / 1e6 / (double)stats.rows_computed, (double)stats.refresh_ns / (double)stats.tokens_computed);
+
+    tfac_token_cache_free(cache);
+    tfac_key_registry_free(registry);
+    free(handles);
+    free(tokens);
+}
+
+int main(void)
+{
+    printf("TFAC %s benchmarks\n\n", tfac_get_version_number().string);
+
+    bench_compression();
+    bench_sha1_throughput();
+    bench_hotp();
+    bench_key_cache();
+    bench_key_registry();
+    bench_key_registry_enrollment();
+    bench_token_cache();
+    bench_hotp_batch();
+    bench_hotp_raw_many();
+    bench_replay_fingerprint();
+    bench_replay_table();
+    bench_replay_table_concurrency();
+    bench_durable_verifier();
+
+    return 0;
+}
@@ -24,15 +24,31 @@
 
 #include "acutest.h"
 #include "../src/tfac.h"
+#include "../src/tfac_cpu.h"
+#include "../src/tfac_replay.h"
+#include "../src/tfac_wal.h"
+#include "../src/picohash.h"
 
 #if defined(_WIN32)
 #include <windows.h>
 #define tfac_tests_sleep Sleep
 #else
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #define tfac_tests_sleep(t) sleep((t / 1000))
 #endif
 
+static void tests_random_bytes(uint8_t* output_buffer, const size_t output_buffer_size)
+{
+    // The secrets are random bytes: just borrow them.
+    for (size_t i = 0; i < output_buffer_size; i += sizeof(((struct tfac_secret*)0)->secret_key))
+    {
+        const struct tfac_secret s = tfac_generate_secret();
+        memcpy(output_buffer + i, s.secret_key, output_buffer_size - i < sizeof(s.secret_key) ? output_buffer_size - i : sizeof(s.secret_key));
+    }
+}
+
 /* A test case that does nothing and succeeds. */
 static void null_test_success()
 {
@@ -128,38 +144,1467 @@ static void totp_validate_expired_token_fails_except_allowed_error_margin()
     TEST_CHECK(tfac_verify_totp(s2.secret_key_base32, t2_2.string, TFAC_DEFAULT_DIGITS, 1, TFAC_SHA1));
 }
 
-static void hotp_generates_correctly_and_validates_correctly()
+static void totp_key_verification_accepts_neighbouring_steps_only()
+{
+    const uint8_t steps = 255;
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        const struct tfac_secret s1 = tfac_generate_secret();
+        const struct tfac_key k1 = tfac_key_init(s1.secret_key, sizeof(s1.secret_key), (enum tfac_hash_algo)hash_algo);
+
+        const time_t utc = time(0);
+        char previous[32], next[32], too_old[32], too_new[32];
+
+        snprintf(previous, sizeof(previous), "%08llu", (unsigned long long)tfac_totp_key(&k1, 8, steps, utc - steps));
+        snprintf(next, sizeof(next), "%08llu", (unsigned long long)tfac_totp_key(&k1, 8, steps, utc + steps));
+        snprintf(too_old, sizeof(too_old), "%08llu", (unsigned long long)tfac_totp_key(&k1, 8, steps, utc - 2 * steps));
+        snprintf(too_new, sizeof(too_new), "%08llu", (unsigned long long)tfac_totp_key(&k1, 8, steps, utc + 2 * steps));
+
+        TEST_CHECK(!tfac_verify_totp_key(&k1, too_old, 8, steps));
+        TEST_CHECK(!tfac_verify_totp_key(&k1, too_new, 8, steps));
+        TEST_CHECK(tfac_verify_totp_key(&k1, previous, 8, steps));
+        TEST_CHECK(tfac_verify_totp_key(&k1, next, 8, steps));
+        TEST_CHECK(!tfac_verify_totp_key(&k1, previous, 8, steps));
+        TEST_CHECK(!tfac_verify_totp_key(&k1, next, 8, steps));
+    }
+}
+
+static void totp_last_accepted_step_verification_only_moves_forward()
+{
+    const uint8_t steps = 255;
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        const struct tfac_secret s1 = tfac_generate_secret();
+        const struct tfac_key k1 = tfac_key_init(s1.secret_key, sizeof(s1.secret_key), (enum tfac_hash_algo)hash_algo);
+
+        const time_t utc = time(0);
+        char previous[32], current[32], next[32];
+
+        snprintf(previous, sizeof(previous), "%08llu", (unsigned long long)tfac_totp_key(&k1, 8, steps, utc - steps));
+        snprintf(current, sizeof(current), "%08llu", (unsigned long long)tfac_totp_key(&k1, 8, steps, utc));
+        snprintf(next, sizeof(next), "%08llu", (unsigned long long)tfac_totp_key(&k1, 8, steps, utc + steps));
+
+        uint64_t last_accepted_step = 0;
+
+        TEST_CHECK(tfac_verify_totp_key_step(&k1, previous, 8, steps, &last_accepted_step));
+        TEST_CHECK(last_accepted_step == (uint64_t)((utc - steps) / steps));
+        TEST_CHECK(!tfac_verify_totp_key_step(&k1, previous, 8, steps, &last_accepted_step));
+
+        TEST_CHECK(tfac_verify_totp_key_step(&k1, current, 8, steps, &last_accepted_step));
+        TEST_CHECK(!tfac_verify_totp_key_step(&k1, current, 8, steps, &last_accepted_step));
+        TEST_CHECK(!tfac_verify_totp_key_step(&k1, previous, 8, steps, &last_accepted_step));
+
+        TEST_CHECK(tfac_verify_totp_key_step(&k1, next, 8, steps, &last_accepted_step));
+        TEST_CHECK(!tfac_verify_totp_key_step(&k1, next, 8, steps, &last_accepted_step));
+        TEST_CHECK(last_accepted_step == (uint64_t)((utc + steps) / steps));
+
+        // Independent of the obliteration table: the same token is still good for a credential with its own (older) last accepted step.
+        uint64_t other_last_accepted_step = 0;
+        TEST_CHECK(tfac_verify_totp_step(s1.secret_key_base32, current, 8, steps, (enum tfac_hash_algo)hash_algo, &other_last_accepted_step));
+        TEST_CHECK(!tfac_verify_totp_step(s1.secret_key_base32, current, 8, steps, (enum tfac_hash_algo)hash_algo, &other_last_accepted_step));
+        TEST_CHECK(!tfac_verify_totp_step(s1.secret_key_base32, "1234567", 8, steps, (enum tfac_hash_algo)hash_algo, &other_last_accepted_step));
+    }
+}
+
+static size_t tests_verifier_allocations = 0;
+
+static void* tests_verifier_malloc(size_t size)
+{
+    tests_verifier_allocations++;
+    return malloc(size);
+}
+
+static void tests_verifier_free(void* ptr)
+{
+    tests_verifier_allocations--;
+    free(ptr);
+}
+
+static void verifiers_keep_track_of_used_tokens_independently()
+{
+    TEST_CHECK(tfac_verifier_size(0) == 0);
+    TEST_CHECK(tfac_verifier_size(64) > 64 * 2 * sizeof(uint64_t));
+    TEST_CHECK(tfac_verifier_new(0, NULL, NULL) == NULL);
+    TEST_CHECK(tfac_verifier_new(64, &tests_verifier_malloc, NULL) == NULL);
+
+    uint8_t too_small[64];
+    TEST_CHECK(tfac_verifier_init(too_small, sizeof(too_small), 64) == NULL);
+
+    const size_t buffer_size = tfac_verifier_size(64);
+    uint8_t* buffer = malloc(buffer_size + 1);
+    TEST_ASSERT(buffer != NULL);
+
+    // Deliberately misaligned: the verifier has to find its own cache line inside the buffer.
+    struct tfac_verifier* v1 = tfac_verifier_init(buffer + 1, buffer_size, 64);
+    struct tfac_verifier* v2 = tfac_verifier_new(64, &tests_verifier_malloc, &tests_verifier_free);
+
+    TEST_ASSERT(v1 != NULL);
+    TEST_ASSERT(v2 != NULL);
+    TEST_CHECK(tests_verifier_allocations == 1);
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        const struct tfac_secret s1 = tfac_generate_secret();
+        const struct tfac_key k1 = tfac_key_init(s1.secret_key, sizeof(s1.secret_key), (enum tfac_hash_algo)hash_algo);
+
+        const struct tfac_token t1 = tfac_totp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo);
+
+        char long_step_token[32];
+        snprintf(long_step_token, sizeof(long_step_token), "%06llu", (unsigned long long)tfac_totp_key(&k1, TFAC_DEFAULT_DIGITS, 255, time(0)));
+
+        // Each verifier only knows about its own used tokens.
+        TEST_CHECK(tfac_verifier_verify_totp(v1, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo));
+        TEST_CHECK(!tfac_verifier_verify_totp(v1, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo));
+        TEST_CHECK(tfac_verifier_verify_totp_key(v2, &k1, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+        TEST_CHECK(!tfac_verifier_verify_totp_key(v2, &k1, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+        TEST_CHECK(tfac_verify_totp(s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo));
+        TEST_CHECK(!tfac_verify_totp(s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo));
+
+        // Tokens with long steps are tracked as well (in a table of their own).
+        TEST_CHECK(tfac_verifier_verify_totp_key(v1, &k1, long_step_token, TFAC_DEFAULT_DIGITS, 255));
+        TEST_CHECK(!tfac_verifier_verify_totp_key(v1, &k1, long_step_token, TFAC_DEFAULT_DIGITS, 255));
+    }
+
+    TEST_CHECK(!tfac_verifier_verify_totp(NULL, "ABCDEFGH", "123456", TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+
+    tfac_verifier_free(v2);
+    tfac_verifier_free(v1);
+    tfac_verifier_free(NULL);
+    TEST_CHECK(tests_verifier_allocations == 0);
+
+    free(buffer);
+}
+
+static void sharded_verifiers_accept_each_token_once()
+{
+    const size_t capacities[] = { 1, 7, 4096 };
+
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++)
+    {
+        struct tfac_verifier* verifier = tfac_verifier_new(capacities[c], NULL, NULL);
+        TEST_ASSERT(verifier != NULL);
+
+        // Tokens of many different keys end up in all of the shards: every one of them is accepted exactly once (as long as the verifier isn't over capacity).
+        const size_t count = capacities[c] < 512 ? capacities[c] : 512;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const struct tfac_secret secret = tfac_generate_secret();
+            const struct tfac_key key = tfac_key_init(secret.secret_key, sizeof(secret.secret_key), TFAC_SHA1);
+
+            char token[32];
+            snprintf(token, sizeof(token), "%06llu", (unsigned long long)tfac_totp_key(&key, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, time(0)));
+
+            TEST_CHECK(tfac_verifier_verify_totp_key(verifier, &key, token, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+            TEST_CHECK(!tfac_verifier_verify_totp_key(verifier, &key, token, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+        }
+
+        tfac_verifier_free(verifier);
+    }
+}
+
+static void file_backed_verifiers_share_used_tokens()
 {
+    const char* path = "tfac_tests_verifier.bin";
+    remove(path);
+
+    // Two mappings of the same file (at different addresses) behave just like two worker processes.
+    struct tfac_verifier* v1 = tfac_verifier_open(path, 256);
+    struct tfac_verifier* v2 = tfac_verifier_open(path, 256);
+
+    TEST_ASSERT(v1 != NULL);
+    TEST_ASSERT(v2 != NULL);
+
     const struct tfac_secret s1 = tfac_generate_secret();
-    const struct tfac_token t1 = tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, 123, TFAC_DEFAULT_HASH_ALGO);
-    const struct tfac_token t2 = tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, 123, TFAC_DEFAULT_HASH_ALGO);
+    const struct tfac_token t1 = tfac_totp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO);
 
-    TEST_CHECK(t1.number == t2.number);
-    TEST_CHECK(strcmp(t1.string, t2.string) == 0);
+    TEST_CHECK(tfac_verifier_verify_totp(v1, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    TEST_CHECK(!tfac_verifier_verify_totp(v2, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+
+    tfac_verifier_free(v1);
+    tfac_verifier_free(v2);
+
+    // After a restart, the used tokens are still there (even if the capacity asked for has changed: the file keeps its own).
+    v1 = tfac_verifier_open(path, 1024);
+    TEST_ASSERT(v1 != NULL);
+    TEST_CHECK(!tfac_verifier_verify_totp(v1, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    tfac_verifier_free(v1);
+
+    // Files that aren't verifier files are left alone.
+    FILE* file = fopen(path, "wb");
+    TEST_ASSERT(file != NULL);
+    fputs("definitely not a TFAC verifier", file);
+    fclose(file);
+
+    TEST_CHECK(tfac_verifier_open(path, 256) == NULL);
+    TEST_CHECK(tfac_verifier_open(NULL, 256) == NULL);
+    TEST_CHECK(tfac_verifier_open(path, 0) == NULL);
+
+    remove(path);
 }
 
-static void hotp_validate_wrong_token_fails()
+static void durable_verifiers_remember_used_tokens_across_restarts()
 {
+    const char* path = "tfac_tests_verifier.snapshot";
+    const char* log_path = "tfac_tests_verifier.snapshot.wal";
+    remove(path);
+    remove(log_path);
+
     const struct tfac_secret s1 = tfac_generate_secret();
-    const struct tfac_token t1_1 = tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, 123, TFAC_DEFAULT_HASH_ALGO);
-    const struct tfac_token t1_2 = tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, 124, TFAC_DEFAULT_HASH_ALGO);
+    const struct tfac_secret s2 = tfac_generate_secret();
+    const struct tfac_token t1 = tfac_totp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO);
+    const struct tfac_token t2 = tfac_totp(s2.secret_key_base32, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO);
+
+    struct tfac_verifier* verifier = tfac_verifier_open_durable(path, 256, 0);
+    TEST_ASSERT(verifier != NULL);
+    TEST_CHECK(tfac_verifier_verify_totp(verifier, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    TEST_CHECK(!tfac_verifier_verify_totp(verifier, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    tfac_verifier_free(verifier);
+
+    // A crash in the middle of a log write leaves a torn record at the end of the log: that one is ignored, the ones before it are not.
+    FILE* file = fopen(log_path, "ab");
+    TEST_ASSERT(file != NULL);
+    fputs("torn", file);
+    fclose(file);
+
+    verifier = tfac_verifier_open_durable(path, 256, 100);
+    TEST_ASSERT(verifier != NULL);
+    TEST_CHECK(!tfac_verifier_verify_totp(verifier, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    TEST_CHECK(tfac_verifier_verify_totp(verifier, s2.secret_key_base32, t2.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    TEST_CHECK(tfac_verifier_sync(verifier));
+
+    // Compaction moves the unexpired tokens into the snapshot.
+    TEST_CHECK(tfac_verifier_compact(verifier));
+    tfac_verifier_free(verifier);
+
+#ifndef _WIN32
+    // Both files hold the fingerprint key in their headers: nobody but their owner gets to read them.
+    struct stat file_info;
+    TEST_ASSERT(stat(path, &file_info) == 0);
+    TEST_CHECK((file_info.st_mode & 0777) == 0600);
+    TEST_ASSERT(stat(log_path, &file_info) == 0);
+    TEST_CHECK((file_info.st_mode & 0777) == 0600);
+#endif
+
+    verifier = tfac_verifier_open_durable(path, 256, 0);
+    TEST_ASSERT(verifier != NULL);
+    TEST_CHECK(!tfac_verifier_verify_totp(verifier, s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    TEST_CHECK(!tfac_verifier_verify_totp(verifier, s2.secret_key_base32, t2.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    tfac_verifier_free(verifier);
+
+    // Non-durable verifiers have nothing to sync or compact.
+    verifier = tfac_verifier_new(256, NULL, NULL);
+    TEST_CHECK(tfac_verifier_sync(verifier));
+    TEST_CHECK(tfac_verifier_compact(verifier));
+    tfac_verifier_free(verifier);
+
+    TEST_CHECK(!tfac_verifier_sync(NULL));
+    TEST_CHECK(!tfac_verifier_compact(NULL));
+
+    // Files that aren't TFAC snapshots are left alone.
+    file = fopen(path, "wb");
+    TEST_ASSERT(file != NULL);
+    fputs("definitely not a TFAC snapshot, but long enough to have a header", file);
+    fclose(file);
+
+    TEST_CHECK(tfac_verifier_open_durable(path, 256, 0) == NULL);
+    TEST_CHECK(tfac_verifier_open_durable(NULL, 256, 0) == NULL);
+
+    remove(path);
+    remove(log_path);
+}
+
+#define WAL_FAILURE_THREADS 4
+#define WAL_FAILURE_APPENDS 64
+
+static struct tfac_wal wal_failure_wal;
+static size_t wal_failure_accepted[WAL_FAILURE_THREADS];
+static uint64_t wal_failure_loaded[4];
+static size_t wal_failure_loaded_count;
+
+static void wal_failure_thread(const size_t thread)
+{
+    for (size_t i = 0; i < WAL_FAILURE_APPENDS; i++)
+    {
+        wal_failure_accepted[thread] += tfac_wal_append(&wal_failure_wal, 100 + thread * WAL_FAILURE_APPENDS + i, (uint64_t)time(0) + 3600, TFAC_DEFAULT_STEPS);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI wal_failure_thread_main(LPVOID arg)
+{
+    wal_failure_thread((size_t)arg);
+    return 0;
+}
+#else
+static void* wal_failure_thread_main(void* arg)
+{
+    wal_failure_thread((size_t)arg);
+    return NULL;
+}
+#endif
+
+static void wal_failure_load(void* user, const uint64_t fingerprint, const uint64_t expires, const uint8_t steps)
+{
+    (void)user;
+    (void)expires;
+    (void)steps;
+
+    if (wal_failure_loaded_count < sizeof(wal_failure_loaded) / sizeof(wal_failure_loaded[0]))
+    {
+        wal_failure_loaded[wal_failure_loaded_count] = fingerprint;
+    }
+
+    wal_failure_loaded_count++;
+}
+
+static void wal_never_reports_failed_writes_as_written()
+{
+    const char* path = "tfac_tests_wal.snapshot";
+    const char* log_path = "tfac_tests_wal.snapshot.wal";
+    remove(path);
+    remove(log_path);
+
+    const uint64_t expires = (uint64_t)time(0) + 3600;
+    uint8_t key[16] = { 0 };
+
+    TEST_ASSERT(tfac_wal_open(&wal_failure_wal, path, 0, key));
+    TEST_ASSERT(tfac_wal_load(&wal_failure_wal, &wal_failure_load, NULL));
+    TEST_CHECK(tfac_wal_append(&wal_failure_wal, 1, expires, TFAC_DEFAULT_STEPS));
+
+    // Every write to a read-only stream fails: none of the appenders whose records were in those batches may be told that they're on disk.
+    fclose(wal_failure_wal.log);
+    wal_failure_wal.log = fopen(log_path, "rb");
+    TEST_ASSERT(wal_failure_wal.log != NULL);
+
+    memset(wal_failure_accepted, 0x00, sizeof(wal_failure_accepted));
+
+#ifdef _WIN32
+    HANDLE threads[WAL_FAILURE_THREADS];
+
+    for (size_t i = 0; i < WAL_FAILURE_THREADS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, wal_failure_thread_main, (LPVOID)i, 0, NULL);
+    }
+
+    WaitForMultipleObjects(WAL_FAILURE_THREADS, threads, TRUE, INFINITE);
+
+    for (size_t i = 0; i < WAL_FAILURE_THREADS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[WAL_FAILURE_THREADS];
+
+    for (size_t i = 0; i < WAL_FAILURE_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, wal_failure_thread_main, (void*)i);
+    }
+
+    for (size_t i = 0; i < WAL_FAILURE_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+
+    size_t accepted = 0;
+
+    for (size_t i = 0; i < WAL_FAILURE_THREADS; i++)
+    {
+        accepted += wal_failure_accepted[i];
+    }
+
+    TEST_CHECK(accepted == 0);
+    TEST_MSG("%zu appends were reported as written.", accepted);
+
+    // An empty buffer doesn't make the log any less failed.
+    TEST_CHECK(!tfac_wal_sync(&wal_failure_wal));
+
+    // The failed write may have left a torn record behind: even once the log could be written to again, nothing goes after it...
+    fclose(wal_failure_wal.log);
+    wal_failure_wal.log = fopen(log_path, "ab");
+    TEST_ASSERT(wal_failure_wal.log != NULL);
+    TEST_CHECK(!tfac_wal_append(&wal_failure_wal, 2, expires, TFAC_DEFAULT_STEPS));
+
+    // ...until compaction starts a new log.
+    TEST_CHECK(tfac_wal_compact(&wal_failure_wal));
+    TEST_CHECK(tfac_wal_append(&wal_failure_wal, 3, expires, TFAC_DEFAULT_STEPS));
+    tfac_wal_close(&wal_failure_wal);
+
+    // Only the records that were reported as written are there after a restart.
+    wal_failure_loaded_count = 0;
+    TEST_ASSERT(tfac_wal_open(&wal_failure_wal, path, 0, key));
+    TEST_CHECK(tfac_wal_load(&wal_failure_wal, &wal_failure_load, NULL));
+    tfac_wal_close(&wal_failure_wal);
+
+    TEST_CHECK(wal_failure_loaded_count == 2);
+    TEST_MSG("Loaded %zu records.", wal_failure_loaded_count);
+    TEST_CHECK(wal_failure_loaded[0] == 1 && wal_failure_loaded[1] == 3);
+
+    remove(path);
+    remove(log_path);
+}
+
+static void wal_writes_batched_records_out_without_more_appends()
+{
+    const char* path = "tfac_tests_wal_batched.snapshot";
+    const char* log_path = "tfac_tests_wal_batched.snapshot.wal";
+    remove(path);
+    remove(log_path);
+
+    struct tfac_wal wal;
+    uint8_t key[16] = { 0 };
+
+    TEST_ASSERT(tfac_wal_open(&wal, path, 10, key));
+    TEST_ASSERT(tfac_wal_load(&wal, &wal_failure_load, NULL));
+    TEST_CHECK(tfac_wal_append(&wal, 1, (uint64_t)time(0) + 3600, TFAC_DEFAULT_STEPS));
+
+    // Nothing else is appended (or synced): the background flusher writes the record out on its own once the interval has passed.
+    long log_size = 0;
+    const time_t deadline = time(0) + 5;
+
+    while (log_size < (long)(32 + sizeof(struct tfac_wal_record)) && time(0) < deadline)
+    {
+        tfac_tests_sleep(1000);
+
+        FILE* file = fopen(log_path, "rb");
+        TEST_ASSERT(file != NULL);
+        fseek(file, 0, SEEK_END);
+        log_size = ftell(file);
+        fclose(file);
+    }
+
+    TEST_CHECK(log_size == (long)(32 + sizeof(struct tfac_wal_record)));
+    TEST_MSG("The log is %ld bytes long.", log_size);
+
+    tfac_wal_close(&wal);
+
+    remove(path);
+    remove(log_path);
+}
+
+static void key_cache_returns_the_same_keys_and_counts_hits()
+{
+    TEST_ASSERT(tfac_set_key_cache_size(3));
+
+    struct tfac_key_cache_stats stats = tfac_get_key_cache_stats();
+    TEST_CHECK(stats.entries == 4);
+    TEST_CHECK(stats.hits == 0);
+    TEST_CHECK(stats.misses == 0);
+
+    const struct tfac_secret s1 = tfac_generate_secret();
+    const uint64_t counter = 1234567;
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        const uint64_t expected = tfac_hotp_raw(s1.secret_key, sizeof(s1.secret_key), TFAC_DEFAULT_DIGITS, counter, (enum tfac_hash_algo)hash_algo);
+
+        // First one decodes the secret, the second one finds it in the cache: both have to come up with the same token (and so does every hash algo).
+        TEST_CHECK(tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, counter, (enum tfac_hash_algo)hash_algo).number == expected);
+        TEST_CHECK(tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, counter, (enum tfac_hash_algo)hash_algo).number == expected);
+    }
 
+    stats = tfac_get_key_cache_stats();
+    TEST_CHECK(stats.hits == 3);
+    TEST_CHECK(stats.misses == 3);
+
+    const struct tfac_token t1 = tfac_totp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO);
+    TEST_CHECK(tfac_verify_totp(s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+    TEST_CHECK(!tfac_verify_totp(s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, TFAC_DEFAULT_HASH_ALGO));
+
+    // A different secret never gets another secret's key.
     const struct tfac_secret s2 = tfac_generate_secret();
-    const struct tfac_token t2_1 = tfac_hotp(s2.secret_key_base32, TFAC_DEFAULT_DIGITS, 456, TFAC_DEFAULT_HASH_ALGO);
-    const struct tfac_token t2_2 = tfac_hotp(s2.secret_key_base32, TFAC_DEFAULT_DIGITS, 457, TFAC_DEFAULT_HASH_ALGO);
+    TEST_CHECK(tfac_hotp(s2.secret_key_base32, TFAC_DEFAULT_DIGITS, counter, TFAC_DEFAULT_HASH_ALGO).number == tfac_hotp_raw(s2.secret_key, sizeof(s2.secret_key), TFAC_DEFAULT_DIGITS, counter, TFAC_DEFAULT_HASH_ALGO));
 
-    TEST_CHECK(t1_1.number == t1_1.number);
-    TEST_CHECK(t1_1.number != t1_2.number);
-    TEST_CHECK(strcmp(t1_1.string, t1_1.string) == 0);
-    TEST_CHECK(strcmp(t1_1.string, t1_2.string) != 0);
+    TEST_CHECK(tfac_set_key_cache_size(0));
 
-    TEST_CHECK(t2_1.number == t2_1.number);
-    TEST_CHECK(t2_1.number != t2_2.number);
-    TEST_CHECK(strcmp(t2_1.string, t2_1.string) == 0);
-    TEST_CHECK(strcmp(t2_1.string, t2_2.string) != 0);
+    stats = tfac_get_key_cache_stats();
+    TEST_CHECK(stats.entries == 0);
+    TEST_CHECK(stats.hits == 0);
+    TEST_CHECK(tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, counter, TFAC_DEFAULT_HASH_ALGO).number == tfac_hotp_raw(s1.secret_key, sizeof(s1.secret_key), TFAC_DEFAULT_DIGITS, counter, TFAC_DEFAULT_HASH_ALGO));
+}
 
-    TEST_ASSERT(t1_1.number != t2_1.number);
-    TEST_ASSERT(t1_2.number != t2_2.number);
+static void key_registry_generates_and_verifies_tokens_by_handle()
+{
+    struct tfac_key_registry* registry = tfac_key_registry_new(3);
+    TEST_ASSERT(registry != NULL);
+
+    struct tfac_secret secrets[3];
+    uint32_t handles[4];
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        secrets[hash_algo] = tfac_generate_secret();
+        handles[hash_algo] = tfac_key_registry_register(registry, secrets[hash_algo].secret_key_base32, (enum tfac_hash_algo)hash_algo);
+        TEST_CHECK(handles[hash_algo] != 0);
+    }
+
+    // Full.
+    TEST_CHECK(tfac_key_registry_register(registry, secrets[0].secret_key_base32, TFAC_SHA1) == 0);
+
+    const time_t utc = time(0);
+    uint64_t tokens[4];
+    handles[3] = 12345;
+
+    tfac_key_registry_totp_many(registry, handles, 4, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, utc, tokens);
+    TEST_CHECK(tokens[3] == UINT64_MAX);
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        const uint64_t expected = tfac_totp_raw(secrets[hash_algo].secret_key, sizeof(secrets[hash_algo].secret_key), TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo, utc);
+        TEST_CHECK(tokens[hash_algo] == expected);
+        TEST_CHECK(tfac_key_registry_hotp(registry, handles[hash_algo], TFAC_DEFAULT_DIGITS, 42).number == tfac_hotp_raw(secrets[hash_algo].secret_key, sizeof(secrets[hash_algo].secret_key), TFAC_DEFAULT_DIGITS, 42, (enum tfac_hash_algo)hash_algo));
+    }
+
+    const struct tfac_token t1 = tfac_key_registry_totp(registry, handles[0], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    TEST_CHECK(tfac_key_registry_verify_totp(registry, handles[0], t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+    TEST_CHECK(!tfac_key_registry_verify_totp(registry, handles[0], t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+
+    // Unregistered handles stop working, even once their slot has been taken by another key.
+    TEST_CHECK(tfac_key_registry_unregister(registry, handles[0]));
+    TEST_CHECK(!tfac_key_registry_unregister(registry, handles[0]));
+    TEST_CHECK(tfac_key_registry_hotp(registry, handles[0], TFAC_DEFAULT_DIGITS, 42).string[0] == '\0');
+
+    const uint32_t reused = tfac_key_registry_register(registry, secrets[1].secret_key_base32, TFAC_SHA1);
+    TEST_CHECK(reused != 0);
+    TEST_CHECK(reused != handles[0]);
+    TEST_CHECK(tfac_key_registry_totp(registry, handles[0], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS).string[0] == '\0');
+    TEST_CHECK(tfac_key_registry_hotp(registry, reused, TFAC_DEFAULT_DIGITS, 42).number == tfac_hotp_raw(secrets[1].secret_key, sizeof(secrets[1].secret_key), TFAC_DEFAULT_DIGITS, 42, TFAC_SHA1));
+
+    tfac_key_registry_free(registry);
+
+    TEST_CHECK(tfac_key_registry_new(0) == NULL);
+    TEST_CHECK(tfac_key_registry_new(UINT32_MAX) == NULL);
+}
+
+static void key_stores_keep_registered_handles_working()
+{
+    const char* path = "tfac_tests_keys.bin";
+    remove(path);
+
+    struct tfac_key_registry* registry = tfac_key_registry_new(16);
+    TEST_ASSERT(registry != NULL);
+
+    struct tfac_secret secrets[3];
+    uint32_t handles[3];
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        secrets[i] = tfac_generate_secret();
+        handles[i] = tfac_key_registry_register(registry, secrets[i].secret_key_base32, (enum tfac_hash_algo)i);
+    }
+
+    TEST_CHECK(tfac_key_registry_unregister(registry, handles[1]));
+    TEST_CHECK(tfac_key_registry_save(registry, path));
+    tfac_key_registry_free(registry);
+
+#ifndef _WIN32
+    // The file is as sensitive as the secrets: nobody but its owner gets to read it.
+    struct stat file_info;
+    TEST_ASSERT(stat(path, &file_info) == 0);
+    TEST_CHECK((file_info.st_mode & 0777) == 0600);
+#endif
+
+    for (uint8_t verify_checksum = 0; verify_checksum <= 1; verify_checksum++)
+    {
+        registry = tfac_key_registry_open(path, verify_checksum);
+        TEST_ASSERT(registry != NULL);
+
+        TEST_CHECK(tfac_key_registry_hotp(registry, handles[0], TFAC_DEFAULT_DIGITS, 42).number == tfac_hotp_raw(secrets[0].secret_key, sizeof(secrets[0].secret_key), TFAC_DEFAULT_DIGITS, 42, TFAC_SHA1));
+        TEST_CHECK(tfac_key_registry_hotp(registry, handles[2], TFAC_DEFAULT_DIGITS, 42).number == tfac_hotp_raw(secrets[2].secret_key, sizeof(secrets[2].secret_key), TFAC_DEFAULT_DIGITS, 42, TFAC_SHA256));
+        TEST_CHECK(tfac_key_registry_hotp(registry, handles[1], TFAC_DEFAULT_DIGITS, 42).string[0] == '\0');
+
+        // Changes only ever go to this process' copy of the mapping: the next iteration opens the file just as it was saved.
+        const uint32_t handle = tfac_key_registry_register(registry, secrets[1].secret_key_base32, TFAC_SHA1);
+        TEST_CHECK(handle != 0 && handle != handles[1]);
+        TEST_CHECK(tfac_key_registry_unregister(registry, handles[0]));
+        TEST_CHECK(tfac_key_registry_hotp(registry, handles[0], TFAC_DEFAULT_DIGITS, 42).string[0] == '\0');
+
+        tfac_key_registry_free(registry);
+    }
+
+    // Slots that were unregistered before saving are reused after opening, even if the registry has no room left otherwise.
+    registry = tfac_key_registry_new(2);
+    TEST_ASSERT(registry != NULL);
+    const uint32_t kept = tfac_key_registry_register(registry, secrets[0].secret_key_base32, TFAC_SHA1);
+    TEST_CHECK(tfac_key_registry_unregister(registry, tfac_key_registry_register(registry, secrets[1].secret_key_base32, TFAC_SHA1)));
+    TEST_CHECK(tfac_key_registry_save(registry, path));
+    tfac_key_registry_free(registry);
+
+    registry = tfac_key_registry_open(path, 1);
+    TEST_ASSERT(registry != NULL);
+    const uint32_t reused = tfac_key_registry_register(registry, secrets[2].secret_key_base32, TFAC_SHA256);
+    TEST_CHECK(reused != 0 && reused != kept);
+    TEST_CHECK(tfac_key_registry_register(registry, secrets[2].secret_key_base32, TFAC_SHA256) == 0);
+    TEST_CHECK(tfac_key_registry_hotp(registry, reused, TFAC_DEFAULT_DIGITS, 42).number == tfac_hotp_raw(secrets[2].secret_key, sizeof(secrets[2].secret_key), TFAC_DEFAULT_DIGITS, 42, TFAC_SHA256));
+    tfac_key_registry_free(registry);
+
+    registry = tfac_key_registry_new(16);
+    TEST_ASSERT(registry != NULL);
+    handles[0] = tfac_key_registry_register(registry, secrets[0].secret_key_base32, TFAC_SHA1);
+    TEST_CHECK(tfac_key_registry_save(registry, path));
+    tfac_key_registry_free(registry);
+
+    registry = tfac_key_registry_open(path, 1);
+    TEST_ASSERT(registry != NULL);
+    const struct tfac_token t1 = tfac_key_registry_totp(registry, handles[0], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    TEST_CHECK(tfac_key_registry_verify_totp(registry, handles[0], t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+    TEST_CHECK(!tfac_key_registry_verify_totp(registry, handles[0], t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+    tfac_key_registry_free(registry);
+
+    // Flip a bit in the first key: only the checksum can tell.
+    FILE* file = fopen(path, "r+b");
+    TEST_ASSERT(file != NULL);
+    fseek(file, 64, SEEK_SET);
+    const int c = fgetc(file);
+    fseek(file, 64, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+
+    registry = tfac_key_registry_open(path, 0);
+    TEST_CHECK(registry != NULL);
+    tfac_key_registry_free(registry);
+    TEST_CHECK(tfac_key_registry_open(path, 1) == NULL);
+
+    // Truncated files (and ones that aren't key stores at all) are rejected right away.
+    file = fopen(path, "wb");
+    TEST_ASSERT(file != NULL);
+    fputs("definitely not a TFAC key store, but long enough to have a header..", file);
+    fclose(file);
+
+    TEST_CHECK(tfac_key_registry_open(path, 0) == NULL);
+    TEST_CHECK(tfac_key_registry_open(NULL, 0) == NULL);
+
+    // Unknown hash algos are rejected even without verifying the checksum (the first key's one lives right after its 16 slots' inner and outer states).
+    registry = tfac_key_registry_new(16);
+    TEST_ASSERT(registry != NULL);
+    tfac_key_registry_register(registry, secrets[0].secret_key_base32, TFAC_SHA1);
+    TEST_CHECK(tfac_key_registry_save(registry, path));
+    tfac_key_registry_free(registry);
+
+    file = fopen(path, "r+b");
+    TEST_ASSERT(file != NULL);
+    fseek(file, 64 + 2 * 16 * 32, SEEK_SET);
+    TEST_CHECK(fgetc(file) == TFAC_SHA1);
+    fseek(file, 64 + 2 * 16 * 32, SEEK_SET);
+    fputc(3, file);
+    fclose(file);
+
+    TEST_CHECK(tfac_key_registry_open(path, 0) == NULL);
+
+    // And the batch functions never put keys with unknown hash algos into their lanes.
+    struct tfac_key keys[32];
+    uint64_t counters[32], out[32];
+
+    for (size_t i = 0; i < 32; i++)
+    {
+        keys[i] = tfac_key_init(secrets[0].secret_key, sizeof(secrets[0].secret_key), TFAC_SHA1);
+        keys[i].hash_algo = (enum tfac_hash_algo)(i % 2 ? 3 : 0xFF);
+        counters[i] = i;
+    }
+
+    tfac_hotp_key_batch(keys, counters, 32, TFAC_DEFAULT_DIGITS, out);
+
+    for (size_t i = 0; i < 32; i++)
+    {
+        TEST_CHECK(out[i] == 0);
+    }
+
+    remove(path);
+    TEST_CHECK(tfac_key_registry_open(path, 0) == NULL);
+}
+
+static void key_deltas_turn_a_base_key_store_into_the_changed_one()
+{
+    const char* path = "tfac_tests_keys_base.bin";
+    const char* delta_path = "tfac_tests_keys.delta";
+
+    struct tfac_key_registry* registry = tfac_key_registry_new(8);
+    TEST_ASSERT(registry != NULL);
+
+    struct tfac_secret secrets[4];
+    uint32_t handles[4];
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        secrets[i] = tfac_generate_secret();
+    }
+
+    handles[0] = tfac_key_registry_register(registry, secrets[0].secret_key_base32, TFAC_SHA1);
+    handles[1] = tfac_key_registry_register(registry, secrets[1].secret_key_base32, TFAC_SHA1);
+    TEST_CHECK(tfac_key_registry_save(registry, path));
+    tfac_key_registry_free(registry);
+
+    struct tfac_key_registry* base = tfac_key_registry_open(path, 1);
+    struct tfac_key_registry* changed = tfac_key_registry_open(path, 1);
+    TEST_ASSERT(base != NULL && changed != NULL);
+
+    // Rotate the first secret (same handle), drop the second one and enroll two more (with a gap in between, to have the delta skip over a free slot).
+    TEST_CHECK(tfac_key_registry_replace(changed, handles[0], secrets[2].secret_key_base32, TFAC_SHA256));
+    TEST_CHECK(!tfac_key_registry_replace(changed, handles[0] + (UINT32_C(1) << 24), secrets[2].secret_key_base32, TFAC_SHA256));
+    TEST_CHECK(tfac_key_registry_unregister(changed, handles[1]));
+    TEST_CHECK(!tfac_key_registry_replace(changed, handles[1], secrets[2].secret_key_base32, TFAC_SHA256));
+    handles[2] = tfac_key_registry_register(changed, secrets[3].secret_key_base32, TFAC_SHA224);
+    handles[3] = tfac_key_registry_register(changed, secrets[1].secret_key_base32, TFAC_SHA1);
+    const uint32_t gap = tfac_key_registry_register(changed, secrets[0].secret_key_base32, TFAC_SHA1);
+    TEST_CHECK(tfac_key_registry_unregister(changed, gap));
+    TEST_CHECK(tfac_key_registry_save_delta(changed, base, delta_path));
+
+    TEST_CHECK(tfac_key_registry_hotp(base, handles[0], TFAC_DEFAULT_DIGITS, 7).number == tfac_hotp_raw(secrets[0].secret_key, sizeof(secrets[0].secret_key), TFAC_DEFAULT_DIGITS, 7, TFAC_SHA1));
+    TEST_CHECK(tfac_key_registry_apply_delta(base, delta_path));
+
+    for (uint64_t counter = 0; counter < 4; counter++)
+    {
+        for (size_t i = 0; i < 4; i++)
+        {
+            TEST_CHECK(strcmp(tfac_key_registry_hotp(base, handles[i], TFAC_DEFAULT_DIGITS, counter).string, tfac_key_registry_hotp(changed, handles[i], TFAC_DEFAULT_DIGITS, counter).string) == 0);
+        }
+    }
+
+    TEST_CHECK(tfac_key_registry_hotp(base, handles[0], TFAC_DEFAULT_DIGITS, 7).number == tfac_hotp_raw(secrets[2].secret_key, sizeof(secrets[2].secret_key), TFAC_DEFAULT_DIGITS, 7, TFAC_SHA256));
+    TEST_CHECK(tfac_key_registry_hotp(base, handles[1], TFAC_DEFAULT_DIGITS, 7).string[0] == '\0');
+    TEST_CHECK(tfac_key_registry_hotp(base, gap, TFAC_DEFAULT_DIGITS, 7).string[0] == '\0');
+
+    // The slots that the delta freed up are reused by the registry that it was applied to, and applying it once more doesn't change anything.
+    TEST_CHECK(tfac_key_registry_apply_delta(base, delta_path));
+    const uint32_t reused = tfac_key_registry_register(base, secrets[0].secret_key_base32, TFAC_SHA1);
+    TEST_CHECK((reused & 0xFFFFFF) == (handles[1] & 0xFFFFFF) || (reused & 0xFFFFFF) == (gap & 0xFFFFFF));
+
+    tfac_key_registry_free(changed);
+
+    // Deltas only apply to registries with the same capacity (and never partially).
+    registry = tfac_key_registry_new(9);
+    TEST_ASSERT(registry != NULL);
+    TEST_CHECK(!tfac_key_registry_apply_delta(registry, delta_path));
+    TEST_CHECK(!tfac_key_registry_save_delta(registry, base, delta_path));
+    tfac_key_registry_free(registry);
+
+    FILE* file = fopen(delta_path, "r+b");
+    TEST_ASSERT(file != NULL);
+    fseek(file, 48, SEEK_SET);
+    const int c = fgetc(file);
+    fseek(file, 48, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+
+    registry = tfac_key_registry_open(path, 1);
+    TEST_ASSERT(registry != NULL);
+    TEST_CHECK(!tfac_key_registry_apply_delta(registry, delta_path));
+    TEST_CHECK(tfac_key_registry_hotp(registry, handles[0], TFAC_DEFAULT_DIGITS, 7).number == tfac_hotp_raw(secrets[0].secret_key, sizeof(secrets[0].secret_key), TFAC_DEFAULT_DIGITS, 7, TFAC_SHA1));
+    TEST_CHECK(!tfac_key_registry_apply_delta(registry, "tfac_tests_missing.delta"));
+    tfac_key_registry_free(registry);
+
+    tfac_key_registry_free(base);
+    remove(path);
+    remove(delta_path);
+}
+
+#define KEY_ROTATION_READERS 4
+#define KEY_ROTATION_ROUNDS 20000
+
+static struct tfac_key_registry* key_rotation_registry;
+static uint32_t key_rotation_handle;
+static uint64_t key_rotation_tokens[2];
+static uint64_t key_rotation_done;
+static size_t key_rotation_torn[KEY_ROTATION_READERS];
+
+static void key_rotation_reader(const size_t thread)
+{
+    while (!tfac_atomic_load(&key_rotation_done))
+    {
+        const uint64_t token = tfac_key_registry_hotp(key_rotation_registry, key_rotation_handle, 8, 42).number;
+        key_rotation_torn[thread] += token != key_rotation_tokens[0] && token != key_rotation_tokens[1];
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI key_rotation_thread_main(LPVOID arg)
+{
+    key_rotation_reader((size_t)arg);
+    return 0;
+}
+#else
+static void* key_rotation_thread_main(void* arg)
+{
+    key_rotation_reader((size_t)arg);
+    return NULL;
+}
+#endif
+
+static void key_registry_readers_never_see_half_replaced_keys()
+{
+    key_rotation_registry = tfac_key_registry_new(4);
+    TEST_ASSERT(key_rotation_registry != NULL);
+
+    struct tfac_key keys[2];
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        const struct tfac_secret secret = tfac_generate_secret();
+        keys[i] = tfac_key_init(secret.secret_key, sizeof(secret.secret_key), TFAC_SHA1);
+        key_rotation_tokens[i] = tfac_hotp_key(&keys[i], 8, 42);
+    }
+
+    key_rotation_handle = tfac_key_registry_register_key(key_rotation_registry, &keys[0]);
+    key_rotation_done = 0;
+    memset(key_rotation_torn, 0x00, sizeof(key_rotation_torn));
+
+#ifdef _WIN32
+    HANDLE threads[KEY_ROTATION_READERS];
+
+    for (size_t i = 0; i < KEY_ROTATION_READERS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, key_rotation_thread_main, (LPVOID)i, 0, NULL);
+    }
+#else
+    pthread_t threads[KEY_ROTATION_READERS];
+
+    for (size_t i = 0; i < KEY_ROTATION_READERS; i++)
+    {
+        pthread_create(&threads[i], NULL, key_rotation_thread_main, (void*)i);
+    }
+#endif
+
+    for (size_t i = 0; i < KEY_ROTATION_ROUNDS; i++)
+    {
+        TEST_CHECK_(tfac_key_registry_replace_key(key_rotation_registry, key_rotation_handle, &keys[(i + 1) & 1]), "round %zu", i);
+    }
+
+    tfac_atomic_cas(&key_rotation_done, 0, 1);
+
+#ifdef _WIN32
+    WaitForMultipleObjects(KEY_ROTATION_READERS, threads, TRUE, INFINITE);
+
+    for (size_t i = 0; i < KEY_ROTATION_READERS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+#else
+    for (size_t i = 0; i < KEY_ROTATION_READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+
+    size_t torn = 0;
+
+    for (size_t i = 0; i < KEY_ROTATION_READERS; i++)
+    {
+        torn += key_rotation_torn[i];
+    }
+
+    TEST_CHECK(torn == 0);
+    TEST_MSG("%zu tokens were generated with neither of the two keys.", torn);
+
+    tfac_key_registry_free(key_rotation_registry);
+}
+
+static void token_cache_verifies_like_the_registry_and_misses_changed_keys()
+{
+    struct tfac_key_registry* registry = tfac_key_registry_new(8);
+    TEST_ASSERT(registry != NULL);
+
+    TEST_CHECK(tfac_token_cache_new(registry, 10, TFAC_DEFAULT_STEPS, 0) == NULL);
+    TEST_CHECK(tfac_token_cache_new(NULL, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, 0) == NULL);
+
+    uint32_t handles[5];
+
+    for (size_t i = 0; i < 5; i++)
+    {
+        handles[i] = tfac_key_registry_register(registry, tfac_generate_secret().secret_key_base32, (enum tfac_hash_algo)(i % 3));
+    }
+
+    struct tfac_token_cache* cache = tfac_token_cache_new(registry, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, 0);
+    TEST_ASSERT(cache != NULL);
+
+    struct tfac_token_cache_stats stats = tfac_token_cache_get_stats(cache);
+    TEST_CHECK(stats.memory >= 4 * 8 * sizeof(uint64_t));
+    TEST_CHECK(stats.hits == 0 && stats.misses == 0 && stats.rows_computed == 0);
+
+    // Nothing's cached yet: the tokens are computed on demand.
+    struct tfac_token token = tfac_key_registry_totp(registry, handles[0], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    TEST_CHECK(tfac_token_cache_verify_totp(cache, handles[0], token.string));
+    TEST_CHECK(!tfac_token_cache_verify_totp(cache, handles[0], token.string));
+    TEST_CHECK(tfac_token_cache_get_stats(cache).misses == 2);
+
+    tfac_token_cache_refresh(cache, time(0));
+    stats = tfac_token_cache_get_stats(cache);
+    TEST_CHECK(stats.rows_computed == 4);
+    TEST_CHECK(stats.tokens_computed == 4 * 5);
+
+    // Refreshing again within the same step doesn't compute anything.
+    tfac_token_cache_refresh(cache, time(0));
+    TEST_CHECK(tfac_token_cache_get_stats(cache).rows_computed == 4);
+
+    // Tokens accepted through the cache can't be replayed through the registry (and vice versa).
+    token = tfac_key_registry_totp(registry, handles[1], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    TEST_CHECK(tfac_token_cache_verify_totp(cache, handles[1], token.string));
+    TEST_CHECK(!tfac_key_registry_verify_totp(registry, handles[1], token.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+    token = tfac_key_registry_totp(registry, handles[2], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    TEST_CHECK(tfac_key_registry_verify_totp(registry, handles[2], token.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+    TEST_CHECK(!tfac_token_cache_verify_totp(cache, handles[2], token.string));
+    TEST_CHECK(!tfac_token_cache_verify_totp(cache, handles[3], "12345"));
+
+    stats = tfac_token_cache_get_stats(cache);
+    TEST_CHECK(stats.hits == 2 && stats.misses == 2);
+
+    // Rotated keys aren't served stale: the old token stops working right away, and the new one is computed on demand.
+    const struct tfac_token old_token = tfac_key_registry_totp(registry, handles[3], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    TEST_CHECK(tfac_key_registry_replace(registry, handles[3], tfac_generate_secret().secret_key_base32, TFAC_SHA1));
+    token = tfac_key_registry_totp(registry, handles[3], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+
+    if (strcmp(old_token.string, token.string) != 0)
+    {
+        TEST_CHECK(!tfac_token_cache_verify_totp(cache, handles[3], old_token.string));
+    }
+
+    TEST_CHECK(tfac_token_cache_verify_totp(cache, handles[3], token.string));
+    TEST_CHECK(tfac_token_cache_get_stats(cache).misses >= 3);
+
+    token = tfac_key_registry_totp(registry, handles[4], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS);
+    TEST_CHECK(tfac_key_registry_unregister(registry, handles[4]));
+    TEST_CHECK(!tfac_token_cache_verify_totp(cache, handles[4], token.string));
+
+    tfac_token_cache_free(cache);
+
+    // The background thread fills the cache by itself.
+    cache = tfac_token_cache_new(registry, 8, TFAC_DEFAULT_STEPS, 1);
+    TEST_ASSERT(cache != NULL);
+
+    const time_t deadline = time(0) + 5;
+
+    while (tfac_token_cache_get_stats(cache).rows_computed < 4 && time(0) < deadline)
+    {
+        tfac_tests_sleep(10);
+    }
+
+    TEST_CHECK(tfac_token_cache_get_stats(cache).rows_computed >= 4);
+
+    token = tfac_key_registry_totp(registry, handles[0], 8, TFAC_DEFAULT_STEPS);
+    TEST_CHECK(tfac_token_cache_verify_totp(cache, handles[0], token.string));
+    TEST_CHECK(tfac_token_cache_get_stats(cache).hits == 1);
+
+    tfac_token_cache_free(cache);
+    tfac_key_registry_free(registry);
+}
+
+static void replay_fingerprints_match_siphash_reference_vectors()
+{
+    uint64_t slots[TFAC_REPLAY_GENERATIONS * TFAC_REPLAY_BUCKET_SLOTS];
+
+    struct tfac_replay_table table;
+    tfac_replay_init(&table, slots, sizeof(slots) / sizeof(slots[0]), TFAC_REPLAY_EPOCH);
+    TEST_CHECK(!tfac_replay_has_key(&table));
+
+    uint8_t key[16], other_key[16], message[64];
+
+    for (size_t i = 0; i < sizeof(message); i++)
+    {
+        message[i] = (uint8_t)i;
+    }
+
+    for (size_t i = 0; i < sizeof(key); i++)
+    {
+        key[i] = (uint8_t)i;
+        other_key[i] = (uint8_t)(0xFF - i);
+    }
+
+    // The first key wins.
+    tfac_replay_set_key(&table, key);
+    tfac_replay_set_key(&table, other_key);
+    TEST_CHECK(tfac_replay_has_key(&table));
+
+    // SipHash-2-4 test vectors from the reference implementation (key 00 01 .. 0f, message 00 01 .. of the given length).
+    TEST_CHECK(tfac_replay_fingerprint(&table, message, 0) == UINT64_C(0x726fdb47dd0e0e31));
+    TEST_CHECK(tfac_replay_fingerprint(&table, message, 1) == UINT64_C(0x74f839c593dc67fd));
+    TEST_CHECK(tfac_replay_fingerprint(&table, message, 8) == UINT64_C(0x93f5f5799a932462));
+    TEST_CHECK(tfac_replay_fingerprint(&table, message, 15) == UINT64_C(0xa129ca6149be45e5));
+    TEST_CHECK(tfac_replay_fingerprint(&table, message, 63) == UINT64_C(0x958a324ceb064572));
+}
+
+static void replay_table_rejects_reinserted_entries()
+{
+    uint64_t slots[TFAC_REPLAY_GENERATIONS * 512 * TFAC_REPLAY_BUCKET_SLOTS];
+
+    struct tfac_replay_table table;
+    tfac_replay_init(&table, slots, sizeof(slots) / sizeof(slots[0]), TFAC_REPLAY_EPOCH);
+
+    uint64_t fingerprints[200];
+
+    for (size_t i = 0; i < 200; i++)
+    {
+        tests_random_bytes((uint8_t*)&fingerprints[i], sizeof(fingerprints[i]));
+
+        TEST_CHECK(tfac_replay_check_and_insert(&table, fingerprints[i], 1000 * TFAC_REPLAY_EPOCH));
+        TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], 1000 * TFAC_REPLAY_EPOCH));
+    }
+
+    // Barely filled: nothing should have been evicted yet.
+    for (size_t i = 0; i < 200; i++)
+    {
+        TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], 1000 * TFAC_REPLAY_EPOCH));
+    }
+
+    // A single bucket per generation: the 9th entry has to overwrite one of the first eight, but it must still be rejected on its second try.
+    tfac_replay_init(&table, slots, TFAC_REPLAY_GENERATIONS * TFAC_REPLAY_BUCKET_SLOTS, TFAC_REPLAY_EPOCH);
+
+    for (size_t i = 0; i < 16; i++)
+    {
+        TEST_CHECK(tfac_replay_check_and_insert(&table, fingerprints[i], 1000 * TFAC_REPLAY_EPOCH));
+        TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], 1000 * TFAC_REPLAY_EPOCH));
+    }
+
+    // Two buckets per generation, and every fingerprint's home is the last one: the probe sequence has to wrap around to the first bucket.
+    tfac_replay_init(&table, slots, TFAC_REPLAY_GENERATIONS * 2 * TFAC_REPLAY_BUCKET_SLOTS, TFAC_REPLAY_EPOCH);
+
+    for (uint64_t i = 0; i < 2 * TFAC_REPLAY_BUCKET_SLOTS; i++)
+    {
+        fingerprints[i] = UINT64_C(0x8000000000000000) | (i << 32);
+        TEST_CHECK(tfac_replay_check_and_insert(&table, fingerprints[i], 1000 * TFAC_REPLAY_EPOCH));
+    }
+
+    for (size_t i = 0; i < 2 * TFAC_REPLAY_BUCKET_SLOTS; i++)
+    {
+        TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], 1000 * TFAC_REPLAY_EPOCH));
+    }
+}
+
+static void replay_table_expires_whole_steps()
+{
+    uint64_t slots[TFAC_REPLAY_GENERATIONS * 64 * TFAC_REPLAY_BUCKET_SLOTS];
+
+    struct tfac_replay_table table;
+    tfac_replay_init(&table, slots, sizeof(slots) / sizeof(slots[0]), TFAC_REPLAY_EPOCH);
+
+    uint64_t fingerprints[100];
+
+    for (size_t i = 0; i < 100; i++)
+    {
+        tests_random_bytes((uint8_t*)&fingerprints[i], sizeof(fingerprints[i]));
+    }
+
+    // The same token expiring in different epochs is a different token (e.g. generated in another time step): one entry per epoch, each in its own generation.
+    for (uint64_t epoch = 1000; epoch < 1000 + TFAC_REPLAY_GENERATIONS; epoch++)
+    {
+        for (size_t i = 0; i < 100; i++)
+        {
+            TEST_CHECK(tfac_replay_check_and_insert(&table, fingerprints[i], epoch * TFAC_REPLAY_EPOCH));
+        }
+    }
+
+    // Expiry times within the same epoch share their entries (that's what lets tokens of different steps parameters share the table).
+    for (uint64_t epoch = 1000; epoch < 1000 + TFAC_REPLAY_GENERATIONS; epoch++)
+    {
+        for (size_t i = 0; i < 100; i++)
+        {
+            TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], epoch * TFAC_REPLAY_EPOCH));
+            TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], epoch * TFAC_REPLAY_EPOCH - TFAC_REPLAY_EPOCH + 1));
+        }
+    }
+
+    // Moving on to the next epoch recycles the oldest epoch's generation: its tokens count as expired now (rejected, since they are too old), the others stay used.
+    TEST_CHECK(tfac_replay_check_and_insert(&table, fingerprints[0], (1000 + TFAC_REPLAY_GENERATIONS) * TFAC_REPLAY_EPOCH));
+
+    for (size_t i = 0; i < 100; i++)
+    {
+        TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], 1000 * TFAC_REPLAY_EPOCH));
+        TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], 1001 * TFAC_REPLAY_EPOCH));
+        TEST_CHECK(tfac_replay_check_and_insert(&table, fingerprints[i], (1000 + TFAC_REPLAY_GENERATIONS) * TFAC_REPLAY_EPOCH) == (i != 0));
+    }
+
+    // Lots of epochs later (e.g. after a quiet night), all of the slots are free again.
+    for (uint64_t epoch = 5000; epoch < 5000 + 10 * TFAC_REPLAY_GENERATIONS; epoch++)
+    {
+        for (size_t i = 0; i < 100; i++)
+        {
+            TEST_CHECK(tfac_replay_check_and_insert(&table, fingerprints[i], epoch * TFAC_REPLAY_EPOCH));
+            TEST_CHECK(!tfac_replay_check_and_insert(&table, fingerprints[i], epoch * TFAC_REPLAY_EPOCH));
+        }
+    }
+}
+
+#define REPLAY_RACE_THREADS 8
+#define REPLAY_RACE_ENTRIES 4096
+
+static uint64_t replay_race_slots[TFAC_REPLAY_GENERATIONS * REPLAY_RACE_ENTRIES * 32];
+static struct tfac_replay_table replay_race_table;
+static uint64_t replay_race_fingerprints[REPLAY_RACE_ENTRIES];
+static size_t replay_race_accepted[REPLAY_RACE_THREADS];
+
+static void replay_race_thread(const size_t thread)
+{
+    // Every thread presents every token (each starting at a different offset): only one of them may get it accepted.
+    for (size_t i = 0; i < REPLAY_RACE_ENTRIES; i++)
+    {
+        replay_race_accepted[thread] += tfac_replay_check_and_insert(&replay_race_table, replay_race_fingerprints[(i + thread * 97) % REPLAY_RACE_ENTRIES], 1337 * TFAC_REPLAY_EPOCH);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI replay_race_thread_main(LPVOID arg)
+{
+    replay_race_thread((size_t)arg);
+    return 0;
+}
+#else
+static void* replay_race_thread_main(void* arg)
+{
+    replay_race_thread((size_t)arg);
+    return NULL;
+}
+#endif
+
+static void replay_table_accepts_each_entry_once_across_threads()
+{
+    tfac_replay_init(&replay_race_table, replay_race_slots, sizeof(replay_race_slots) / sizeof(replay_race_slots[0]), TFAC_REPLAY_EPOCH);
+
+    for (size_t i = 0; i < REPLAY_RACE_ENTRIES; i++)
+    {
+        tests_random_bytes((uint8_t*)&replay_race_fingerprints[i], sizeof(replay_race_fingerprints[i]));
+    }
+
+    memset(replay_race_accepted, 0x00, sizeof(replay_race_accepted));
+
+#ifdef _WIN32
+    HANDLE threads[REPLAY_RACE_THREADS];
+
+    for (size_t i = 0; i < REPLAY_RACE_THREADS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, replay_race_thread_main, (LPVOID)i, 0, NULL);
+    }
+
+    WaitForMultipleObjects(REPLAY_RACE_THREADS, threads, TRUE, INFINITE);
+
+    for (size_t i = 0; i < REPLAY_RACE_THREADS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[REPLAY_RACE_THREADS];
+
+    for (size_t i = 0; i < REPLAY_RACE_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, replay_race_thread_main, (void*)i);
+    }
+
+    for (size_t i = 0; i < REPLAY_RACE_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+
+    size_t accepted = 0;
+
+    for (size_t i = 0; i < REPLAY_RACE_THREADS; i++)
+    {
+        accepted += replay_race_accepted[i];
+    }
+
+    // The table has plenty of room for all of them, so nothing gets evicted (and then replayed) along the way either.
+    TEST_CHECK(accepted == REPLAY_RACE_ENTRIES);
+    TEST_MSG("Accepted %zu of %d tokens.", accepted, REPLAY_RACE_ENTRIES);
+}
+
+static void hotp_generates_correctly_and_validates_correctly()
+{
+    const struct tfac_secret s1 = tfac_generate_secret();
+    const struct tfac_token t1 = tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, 123, TFAC_DEFAULT_HASH_ALGO);
+    const struct tfac_token t2 = tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, 123, TFAC_DEFAULT_HASH_ALGO);
+
+    TEST_CHECK(t1.number == t2.number);
+    TEST_CHECK(strcmp(t1.string, t2.string) == 0);
+}
+
+static void hotp_validate_wrong_token_fails()
+{
+    const struct tfac_secret s1 = tfac_generate_secret();
+    const struct tfac_token t1_1 = tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, 123, TFAC_DEFAULT_HASH_ALGO);
+    const struct tfac_token t1_2 = tfac_hotp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, 124, TFAC_DEFAULT_HASH_ALGO);
+
+    const struct tfac_secret s2 = tfac_generate_secret();
+    const struct tfac_token t2_1 = tfac_hotp(s2.secret_key_base32, TFAC_DEFAULT_DIGITS, 456, TFAC_DEFAULT_HASH_ALGO);
+    const struct tfac_token t2_2 = tfac_hotp(s2.secret_key_base32, TFAC_DEFAULT_DIGITS, 457, TFAC_DEFAULT_HASH_ALGO);
+
+    TEST_CHECK(t1_1.number == t1_1.number);
+    TEST_CHECK(t1_1.number != t1_2.number);
+    TEST_CHECK(strcmp(t1_1.string, t1_1.string) == 0);
+    TEST_CHECK(strcmp(t1_1.string, t1_2.string) != 0);
+
+    TEST_CHECK(t2_1.number == t2_1.number);
+    TEST_CHECK(t2_1.number != t2_2.number);
+    TEST_CHECK(strcmp(t2_1.string, t2_1.string) == 0);
+    TEST_CHECK(strcmp(t2_1.string, t2_2.string) != 0);
+
+    TEST_ASSERT(t1_1.number != t2_1.number);
+    TEST_ASSERT(t1_2.number != t2_2.number);
+}
+
+static void hotp_matches_rfc_test_vectors()
+{
+    // RFC 4226 Appendix D and RFC 6238 Appendix B.
+
+    const uint8_t* sha1_secret = (const uint8_t*)"12345678901234567890";
+    const uint8_t* sha256_secret = (const uint8_t*)"12345678901234567890123456789012";
+
+    TEST_CHECK(tfac_hotp_raw(sha1_secret, 20, 6, 0, TFAC_SHA1) == 755224);
+    TEST_CHECK(tfac_hotp_raw(sha1_secret, 20, 6, 1, TFAC_SHA1) == 287082);
+    TEST_CHECK(tfac_hotp_raw(sha1_secret, 20, 6, 9, TFAC_SHA1) == 520489);
+    TEST_CHECK(tfac_totp_raw(sha1_secret, 20, 8, 30, TFAC_SHA1, 59) == 94287082);
+    TEST_CHECK(tfac_totp_raw(sha1_secret, 20, 8, 30, TFAC_SHA1, 1111111109) == 7081804);
+    TEST_CHECK(tfac_totp_raw(sha256_secret, 32, 8, 30, TFAC_SHA256, 59) == 46119246);
+    TEST_CHECK(tfac_totp_raw(sha256_secret, 32, 8, 30, TFAC_SHA256, 1111111109) == 68084774);
+
+    // Keys longer than the hash block size (reference values computed with Python's hmac module):
+
+    uint8_t long_secret[100];
+    memset(long_secret, 0x42, sizeof(long_secret));
+
+    TEST_CHECK(tfac_hotp_raw(long_secret, sizeof(long_secret), 6, 1337, TFAC_SHA1) == 620356);
+    TEST_CHECK(tfac_hotp_raw(long_secret, sizeof(long_secret), 6, 1337, TFAC_SHA224) == 222729);
+    TEST_CHECK(tfac_hotp_raw(long_secret, sizeof(long_secret), 6, 1337, TFAC_SHA256) == 93924);
+}
+
+static void key_api_matches_raw_api()
+{
+    const struct tfac_secret s1 = tfac_generate_secret();
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        const struct tfac_key k1 = tfac_key_init(s1.secret_key, sizeof(s1.secret_key), (enum tfac_hash_algo)hash_algo);
+        const struct tfac_key k2 = tfac_key_init_base32(s1.secret_key_base32, (enum tfac_hash_algo)hash_algo);
+
+        TEST_CHECK(memcmp(&k1, &k2, sizeof(k1)) == 0);
+
+        for (uint64_t counter = 0; counter < 64; counter++)
+        {
+            TEST_CHECK(tfac_hotp_key(&k1, 8, counter) == tfac_hotp_raw(s1.secret_key, sizeof(s1.secret_key), 8, counter, (enum tfac_hash_algo)hash_algo));
+        }
+
+        const struct tfac_token t1 = tfac_totp(s1.secret_key_base32, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo);
+        TEST_CHECK(tfac_verify_totp_key(&k1, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+        TEST_CHECK(!tfac_verify_totp_key(&k2, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS));
+        TEST_CHECK(!tfac_verify_totp(s1.secret_key_base32, t1.string, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo));
+    }
+
+    // Keys longer than the hash block size are hashed down first:
+
+    uint8_t long_secret[100];
+    memset(long_secret, 0x42, sizeof(long_secret));
+
+    const struct tfac_key k3 = tfac_key_init(long_secret, sizeof(long_secret), TFAC_SHA256);
+    TEST_CHECK(tfac_hotp_key(&k3, 6, 1337) == tfac_hotp_raw(long_secret, sizeof(long_secret), 6, 1337, TFAC_SHA256));
+}
+
+static void hardware_acceleration_matches_portable_code()
+{
+    const struct tfac_secret s1 = tfac_generate_secret();
+
+    uint8_t long_secret[150];
+    memcpy(long_secret, s1.secret_key, sizeof(s1.secret_key));
+    memset(long_secret + sizeof(s1.secret_key), 0x69, sizeof(long_secret) - sizeof(s1.secret_key));
+
+    uint64_t portable[3][2][32];
+    tfac_set_hardware_acceleration(0);
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        for (uint64_t counter = 0; counter < 32; counter++)
+        {
+            portable[hash_algo][0][counter] = tfac_hotp_raw(s1.secret_key, sizeof(s1.secret_key), 8, counter, (enum tfac_hash_algo)hash_algo);
+            portable[hash_algo][1][counter] = tfac_hotp_raw(long_secret, sizeof(long_secret), 8, counter, (enum tfac_hash_algo)hash_algo);
+        }
+    }
+
+    tfac_set_hardware_acceleration(1);
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        for (uint64_t counter = 0; counter < 32; counter++)
+        {
+            TEST_CHECK(portable[hash_algo][0][counter] == tfac_hotp_raw(s1.secret_key, sizeof(s1.secret_key), 8, counter, (enum tfac_hash_algo)hash_algo));
+            TEST_CHECK(portable[hash_algo][1][counter] == tfac_hotp_raw(long_secret, sizeof(long_secret), 8, counter, (enum tfac_hash_algo)hash_algo));
+        }
+    }
+}
+
+static void hotp_batch_matches_single_hotps()
+{
+    struct tfac_key keys[101];
+    uint64_t counters[101];
+    uint64_t batch[101];
+
+    for (size_t i = 0; i < 101; i++)
+    {
+        const struct tfac_secret s = tfac_generate_secret();
+
+        // Mostly SHA-1 keys, interleaved with runs of SHA-224 and SHA-256 ones.
+        keys[i] = tfac_key_init(s.secret_key, sizeof(s.secret_key), i < 40 ? (i % 5 == 4 ? (enum tfac_hash_algo)(1 + i % 2) : TFAC_SHA1) : (enum tfac_hash_algo)(i % 3));
+        counters[i] = ((uint64_t)i << 40) ^ (uint64_t)s.secret_key[0] * 1337;
+    }
+
+    for (uint8_t hardware_acceleration = 0; hardware_acceleration <= 1; hardware_acceleration++)
+    {
+        tfac_set_hardware_acceleration(hardware_acceleration);
+
+        // Odd counts on purpose, to cover partially filled batches.
+        for (size_t count = 0; count <= 101; count += 3)
+        {
+            memset(batch, 0x00, sizeof(batch));
+            tfac_hotp_key_batch(keys, counters, count, 8, batch);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                TEST_CHECK(batch[i] == tfac_hotp_key(&keys[i], 8, counters[i]));
+            }
+        }
+
+        const time_t utc = time(0);
+        tfac_totp_key_batch(keys, 101, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, utc, batch);
+
+        for (size_t i = 0; i < 101; i++)
+        {
+            TEST_CHECK(batch[i] == tfac_totp_key(&keys[i], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, utc));
+        }
+    }
+}
+
+static void raw_many_matches_single_raw_calls()
+{
+    uint8_t secrets[300][100];
+    const uint8_t* secret_keys[300];
+    size_t secret_key_lengths[300];
+    uint64_t counters[300];
+    time_t utcs[300];
+    uint64_t many[300];
+
+    for (size_t i = 0; i < 300; i++)
+    {
+        const struct tfac_secret s = tfac_generate_secret();
+
+        // A few keys longer than the hash block size too, to cover the generic HMAC key setup.
+        memset(secrets[i], s.secret_key[0], sizeof(secrets[i]));
+        memcpy(secrets[i], s.secret_key, sizeof(s.secret_key));
+
+        secret_keys[i] = secrets[i];
+        secret_key_lengths[i] = i % 7 == 6 ? 100 : i % 31;
+        counters[i] = ((uint64_t)i << 33) ^ (uint64_t)s.secret_key[1] * 420;
+        utcs[i] = time(0) + (time_t)(i * 17);
+    }
+
+    for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+    {
+        // Counts that straddle the internal chunk size.
+        const size_t counts[] = { 0, 1, 5, 127, 128, 129, 300 };
+
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+        {
+            memset(many, 0x00, sizeof(many));
+            tfac_hotp_raw_many(secret_keys, secret_key_lengths, counters, counts[c], 8, (enum tfac_hash_algo)hash_algo, many);
+
+            for (size_t i = 0; i < counts[c]; i++)
+            {
+                TEST_CHECK(many[i] == tfac_hotp_raw(secret_keys[i], secret_key_lengths[i], 8, counters[i], (enum tfac_hash_algo)hash_algo));
+            }
+        }
+
+        tfac_totp_raw_many(secret_keys, secret_key_lengths, utcs, 300, TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo, many);
+
+        for (size_t i = 0; i < 300; i++)
+        {
+            TEST_CHECK(many[i] == tfac_totp_raw(secret_keys[i], secret_key_lengths[i], TFAC_DEFAULT_DIGITS, TFAC_DEFAULT_STEPS, (enum tfac_hash_algo)hash_algo, utcs[i]));
+        }
+    }
+}
+
+static void sha256_x16_matches_portable_compression()
+{
+#ifdef TFAC_X86
+    if (!(tfac_cpu_detect_features() & TFAC_CPU_AVX512F))
+    {
+        return;
+    }
+
+    for (int r = 0; r < 64; r++)
+    {
+        uint32_t states[16][8];
+        uint32_t expected[16][8];
+        uint8_t blocks[16][64];
+
+        uint32_t* state_ptrs[16];
+        const uint8_t* block_ptrs[16];
+
+        for (int lane = 0; lane < 16; lane++)
+        {
+            uint8_t random[4 * 30];
+
+            for (int i = 0; i < 4; i++)
+            {
+                const struct tfac_secret s = tfac_generate_secret();
+                memcpy(random + i * 30, s.secret_key, 30);
+            }
+
+            memcpy(states[lane], random, sizeof(states[lane]));
+            memcpy(blocks[lane], random + sizeof(states[lane]), sizeof(blocks[lane]));
+
+            memcpy(expected[lane], states[lane], sizeof(expected[lane]));
+            _picohash_sha256_compress(expected[lane], blocks[lane]);
+
+            state_ptrs[lane] = states[lane];
+            block_ptrs[lane] = blocks[lane];
+        }
+
+        tfac_sha256_compress_x16_avx512(state_ptrs, block_ptrs);
+
+        TEST_CHECK(memcmp(states, expected, sizeof(states)) == 0);
+    }
+#endif
+}
+
+// Plain RFC 4226 HOTP on top of picohash's generic HMAC implementation, to check TFAC's own HMAC fast paths against.
+static uint64_t reference_hotp(const uint8_t* secret_key, const size_t secret_key_length, const uint64_t counter, const enum tfac_hash_algo hash_algo)
+{
+    static void (*const inits[])(picohash_ctx_t*) = { &picohash_init_sha1, &picohash_init_sha224, &picohash_init_sha256 };
+    static const size_t digest_lengths[] = { 20, 28, 32 };
+
+    uint8_t c[8];
+    uint8_t hmac[32];
+
+    for (size_t i = 0; i < 8; i++)
+    {
+        c[i] = (uint8_t)(counter >> ((7 - i) * 8));
+    }
+
+    picohash_ctx_t ctx;
+    picohash_init_hmac(&ctx, inits[hash_algo], secret_key, secret_key_length);
+    picohash_update(&ctx, c, sizeof(c));
+    picohash_final(&ctx, hmac);
+
+    const uint8_t offset = hmac[digest_lengths[hash_algo] - 1] & 0x0F;
+    const uint64_t trunc = ((uint64_t)hmac[offset] << 24 | (uint64_t)hmac[offset + 1] << 16 | (uint64_t)hmac[offset + 2] << 8 | (uint64_t)hmac[offset + 3]) & 0x7FFFFFFF;
+
+    return trunc % 100000000;
+}
+
+static void hmac_fast_path_matches_generic_hmac()
+{
+    uint8_t secret_key[130];
+
+    for (size_t i = 0; i < sizeof(secret_key); i++)
+    {
+        secret_key[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    // Covers empty keys, keys right at and around the 64-byte block size, and keys that need to be hashed down first.
+    for (size_t secret_key_length = 0; secret_key_length <= sizeof(secret_key); secret_key_length++)
+    {
+        for (int hash_algo = TFAC_SHA1; hash_algo <= TFAC_SHA256; hash_algo++)
+        {
+            const uint64_t counter = 0x0123456789ABCDEFULL ^ secret_key_length;
+            TEST_CHECK(tfac_hotp_raw(secret_key, secret_key_length, 8, counter, (enum tfac_hash_algo)hash_algo) == reference_hotp(secret_key, secret_key_length, counter, (enum tfac_hash_algo)hash_algo));
+        }
+    }
 }
 
 static void tfac_test_version_number_retrieval()
@@ -177,9 +1622,34 @@ TEST_LIST = {
     { "totp_too_many_digits_validation_fails", totp_too_many_digits_validation_fails }, //
     { "totp_validate_wrong_token_fails", totp_validate_wrong_token_fails }, //
     { "totp_reusage_fails_even_with_lots_of_traffic", totp_reusage_fails_even_with_lots_of_traffic }, //
+    { "totp_key_verification_accepts_neighbouring_steps_only", totp_key_verification_accepts_neighbouring_steps_only }, //
+    { "totp_last_accepted_step_verification_only_moves_forward", totp_last_accepted_step_verification_only_moves_forward }, //
+    { "verifiers_keep_track_of_used_tokens_independently", verifiers_keep_track_of_used_tokens_independently }, //
+    { "sharded_verifiers_accept_each_token_once", sharded_verifiers_accept_each_token_once }, //
+    { "file_backed_verifiers_share_used_tokens", file_backed_verifiers_share_used_tokens }, //
+    { "durable_verifiers_remember_used_tokens_across_restarts", durable_verifiers_remember_used_tokens_across_restarts }, //
+    { "wal_never_reports_failed_writes_as_written", wal_never_reports_failed_writes_as_written }, //
+    { "wal_writes_batched_records_out_without_more_appends", wal_writes_batched_records_out_without_more_appends }, //
+    { "key_cache_returns_the_same_keys_and_counts_hits", key_cache_returns_the_same_keys_and_counts_hits }, //
+    { "key_registry_generates_and_verifies_tokens_by_handle", key_registry_generates_and_verifies_tokens_by_handle }, //
+    { "key_stores_keep_registered_handles_working", key_stores_keep_registered_handles_working }, //
+    { "key_deltas_turn_a_base_key_store_into_the_changed_one", key_deltas_turn_a_base_key_store_into_the_changed_one }, //
+    { "key_registry_readers_never_see_half_replaced_keys", key_registry_readers_never_see_half_replaced_keys }, //
+    { "token_cache_verifies_like_the_registry_and_misses_changed_keys", token_cache_verifies_like_the_registry_and_misses_changed_keys }, //
+    { "replay_fingerprints_match_siphash_reference_vectors", replay_fingerprints_match_siphash_reference_vectors }, //
+    { "replay_table_rejects_reinserted_entries", replay_table_rejects_reinserted_entries }, //
+    { "replay_table_expires_whole_steps", replay_table_expires_whole_steps }, //
+    { "replay_table_accepts_each_entry_once_across_threads", replay_table_accepts_each_entry_once_across_threads }, //
     { "hotp_generates_correctly_and_validates_correctly", hotp_generates_correctly_and_validates_correctly }, //
     { "hotp_validate_wrong_token_fails", hotp_validate_wrong_token_fails }, //
     { "totp_validate_expired_token_fails_except_allowed_error_margin", totp_validate_expired_token_fails_except_allowed_error_margin }, //
+    { "hotp_matches_rfc_test_vectors", hotp_matches_rfc_test_vectors }, //
+    { "key_api_matches_raw_api", key_api_matches_raw_api }, //
+    { "hardware_acceleration_matches_portable_code", hardware_acceleration_matches_portable_code }, //
+    { "hotp_batch_matches_single_hotps", hotp_batch_matches_single_hotps }, //
+    { "raw_many_matches_single_raw_calls", raw_many_matches_single_raw_calls }, //
+    { "sha256_x16_matches_portable_compression", sha256_x16_matches_portable_compression }, //
+    { "hmac_fast_path_matches_generic_hmac", hmac_fast_path_matches_generic_hmac }, //
     { "tfac_test_version_number_retrieval", tfac_test_version_number_retrieval }, //
     // ------------------------------------------------------------------------------------------------------------
     { NULL, NULL } //